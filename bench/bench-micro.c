@@ -0,0 +1,360 @@
+/* Micro-benchmarks for the parsers in src/parse.c. Each case runs over a
+ * generated input, realistic or pathological, until enough time has passed
+ * to get a stable figure, and reports time per call, time per input byte and
+ * heap allocations per call. Run with "make bench-micro". */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+#include "util.h"
+
+#define BENCH_MIN_SECONDS 0.25
+
+/* Count allocations by interposing on glibc's allocator. Definitions in the
+ * executable take precedence over libc's for every caller in the process,
+ * libc itself included, just as an LD_PRELOAD shim would; -Wl,--wrap would
+ * only see the calls made from our own objects. The counter is volatile
+ * because glibc marks most of its functions as leaf, which lets the compiler
+ * keep it in a register across calls such as sscanf that allocate
+ * internally and report nothing. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static volatile uint64_t allocations;
+
+void *malloc(size_t size) {
+  ++allocations;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  ++allocations;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  ++allocations;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+
+struct input_t {
+  char *data;
+  size_t len;
+};
+
+struct bench_t {
+  const char *name;
+  void (*run)(const struct input_t *input, char *scratch);
+  struct input_t input;
+};
+
+/* Make sure allocations made inside libc are counted: sscanf's %ms has to
+ * allocate the string it returns. */
+static void check_counting(void) {
+  volatile const char *input = "counted";
+  char *word = NULL;
+
+  allocations = 0;
+  if (sscanf((const char *)input, "%ms", &word) != 1 || allocations == 0) {
+    fprintf(stderr, "allocation counting does not see libc's allocations\n");
+    exit(EXIT_FAILURE);
+  }
+  free(word);
+}
+
+static char *xmalloc(size_t size) {
+  char *p = malloc(size);
+  if (p == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/* Append |piece| to |buf| until it holds at least |len| bytes. */
+static struct input_t repeat(const char *head, const char *piece,
+    const char *tail, size_t len) {
+  size_t head_len = strlen(head), piece_len = strlen(piece),
+         tail_len = strlen(tail), n = 0;
+  struct input_t input;
+
+  input.data = xmalloc(head_len + len + piece_len + tail_len + 1);
+  memcpy(input.data, head, head_len);
+  n = head_len;
+  while (n - head_len < len) {
+    memcpy(input.data + n, piece, piece_len);
+    n += piece_len;
+  }
+  memcpy(input.data + n, tail, tail_len);
+  n += tail_len;
+  input.data[n] = '\0';
+  input.len = n;
+
+  return input;
+}
+
+static void run_strip_tags(const struct input_t *input, char *scratch) {
+  (void)scratch;
+  free(html_strip_tags(input->data, input->len));
+}
+
+static void run_extract_error(const struct input_t *input, char *scratch) {
+  char *error = NULL;
+
+  (void)scratch;
+  if (html_extract_error(input->data, &error) == 0)
+    free(error);
+}
+
+static void run_domain_equals(const struct input_t *input, char *scratch) {
+  const char *second = input->data + strlen(input->data) + 1;
+  volatile bool equal;
+
+  (void)scratch;
+  equal = domain_equals(input->data, second);
+  (void)equal;
+}
+
+static void run_srcinfo(const struct input_t *input, char *scratch) {
+  const char *buf = input->data;
+  size_t len = input->len;
+  struct srcinfo_entry_t entry;
+  volatile size_t entries = 0;
+
+  (void)scratch;
+  while (srcinfo_next(&buf, &len, &entry))
+    ++entries;
+}
+
+static int json_count(void *userdata, enum json_event_t event,
+    const char *key, size_t depth, const char *value, size_t len) {
+  size_t *events = userdata;
+
+  (void)event;
+  (void)key;
+  (void)depth;
+  (void)value;
+  (void)len;
+  ++*events;
+
+  return 0;
+}
+
+/* The reader is fed in pieces of 16 KiB, the size curl delivers a response
+ * body in. */
+static void run_json(const struct input_t *input, char *scratch) {
+  json_reader_t *reader;
+  volatile size_t events = 0;
+
+  (void)scratch;
+  if (json_reader_new(&reader, json_count, (size_t *)&events) < 0)
+    return;
+  for (size_t off = 0; off < input->len; off += 16384)
+    json_reader_feed(reader, input->data + off,
+        input->len - off < 16384 ? input->len - off : 16384);
+  json_reader_finish(reader);
+  json_reader_free(reader);
+}
+
+/* The parsers below work in place, so the input is copied first; the copy
+ * is part of the reported figure. */
+static void run_cookie_parse(const struct input_t *input, char *scratch) {
+  char *line = scratch, *end = scratch + input->len;
+
+  /* lines are NUL separated, like the entries of curl's cookie list */
+  memcpy(scratch, input->data, input->len + 1);
+  while (line < end) {
+    char *next = line + strlen(line) + 1, *domain, *name, *value;
+    long expire;
+
+    cookie_parse(line, &domain, &expire, &name, &value);
+    line = next;
+  }
+}
+
+static void run_strtrim(const struct input_t *input, char *scratch) {
+  memcpy(scratch, input->data, input->len + 1);
+  strtrim(scratch);
+}
+
+static void run_config(const struct input_t *input, char *scratch) {
+  char *line, *next;
+
+  memcpy(scratch, input->data, input->len + 1);
+  for (line = scratch; line; line = next) {
+    char *key, *value;
+
+    next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    config_parse_line(line, &key, &value);
+  }
+}
+
+static struct input_t cookie_jar(unsigned count) {
+  struct input_t input;
+  size_t n = 0;
+
+  input.data = xmalloc(count * 128 + 1);
+  for (unsigned i = 0; i < count; ++i)
+    n += sprintf(input.data + n, "%s.example.org\tTRUE\t/\tTRUE\t%u\t"
+        "cookie%u\t%08x%08x", i % 2 ? "#HttpOnly_" : "", 1700000000 + i, i,
+        i * 2654435761u, ~i) + 1;
+  input.data[n] = '\0';
+  input.len = n;
+
+  return input;
+}
+
+static struct input_t config_file(unsigned sections) {
+  struct input_t input;
+  size_t n = 0;
+
+  input.data = xmalloc(sections * 160 + 1);
+  for (unsigned i = 0; i < sections; ++i)
+    n += sprintf(input.data + n, "# account %u\n[account%u]\n"
+        "  User = user%u\nPassword=secret%u  \nCookies = ~/.cache/%u\n\n"
+        "Packages = pkg%ua pkg%ub pkg%uc\n", i, i, i, i, i, i, i, i);
+  input.len = n;
+
+  return input;
+}
+
+static struct input_t srcinfo(unsigned packages) {
+  struct input_t input;
+  size_t n = 0;
+
+  input.data = xmalloc(256 + packages * 96);
+  n += sprintf(input.data, "pkgbase = split\n\tpkgdesc = A split package\n"
+      "\tpkgver = 1.2.3\n\tpkgrel = 1\n\tepoch = 1\n\tarch = x86_64\n"
+      "\tlicense = MIT\n\tsource = https://example.org/split-1.2.3.tar.gz\n"
+      "\tsha256sums = SKIP\n\n");
+  for (unsigned i = 0; i < packages; ++i)
+    n += sprintf(input.data + n, "pkgname = split-%u\n\tpkgdesc = Part %u\n"
+        "\tdepends = split-%u\n\n", i, i, i ? i - 1 : 0);
+  input.len = n;
+
+  return input;
+}
+
+static struct input_t rpc_response(unsigned results) {
+  struct input_t input;
+  size_t n = 0;
+
+  input.data = xmalloc(128 + results * 512);
+  n += sprintf(input.data, "{\"version\":5,\"type\":\"multiinfo\","
+      "\"resultcount\":%u,\"results\":[", results);
+  for (unsigned i = 0; i < results; ++i)
+    n += sprintf(input.data + n, "%s{\"ID\":%u,\"Name\":\"pkg-%u\","
+        "\"PackageBaseID\":%u,\"PackageBase\":\"pkg-%u\","
+        "\"Version\":\"1:%u.0-1\",\"Description\":\"A \\\"quoted\\\" "
+        "description \\u00e9\",\"URL\":\"https:\\/\\/example.org\","
+        "\"NumVotes\":%u,\"Popularity\":0.%06u,\"OutOfDate\":null,"
+        "\"Maintainer\":\"someone\",\"FirstSubmitted\":1500000000,"
+        "\"LastModified\":1700000000,\"Depends\":[\"glibc\",\"pkg-%u\"],"
+        "\"License\":[\"MIT\"],\"Keywords\":[]}", i ? "," : "", i, i, i, i,
+        i, i, i, i ? i - 1 : 0);
+  n += sprintf(input.data + n, "]}");
+  input.len = n;
+
+  return input;
+}
+
+static struct input_t pair(const char *a, const char *b) {
+  struct input_t input;
+  size_t a_len = strlen(a), b_len = strlen(b);
+
+  input.data = xmalloc(a_len + b_len + 2);
+  memcpy(input.data, a, a_len + 1);
+  memcpy(input.data + a_len + 1, b, b_len + 1);
+  input.len = a_len + b_len;
+
+  return input;
+}
+
+int main(void) {
+  static const char *page_head = "<!DOCTYPE html><html><head>"
+      "<title>AUR (en) - Submit</title></head><body><div id=\"content\">";
+  static const char *page_body = "<div class=\"box\"><p>Lorem ipsum "
+      "<a href=\"/packages/foo/\">foo</a> dolor sit amet.</p></div>\n";
+  struct bench_t benches[] = {
+    { "html_strip_tags/page", run_strip_tags,
+      repeat(page_head, page_body, "</div></body></html>", 4 << 20) },
+    { "html_strip_tags/open-tags", run_strip_tags,
+      repeat("", "<", "", 4 << 20) },
+    { "html_extract_error/errorlist", run_extract_error,
+      repeat(page_head, page_body, "<ul class=\"errorlist\"><li>You must "
+        "<b>log in</b> first.</li></ul></div></body></html>", 2 << 20) },
+    { "html_extract_error/no-error", run_extract_error,
+      repeat(page_head, page_body, "</div></body></html>", 2 << 20) },
+    { "html_extract_error/unterminated", run_extract_error,
+      repeat("<p class=\"pkgoutput\">", "error <b>text</b> ", "", 2 << 20) },
+    { "domain_equals/match", run_domain_equals,
+      pair("aur.archlinux.org:443", "AUR.ArchLinux.org") },
+    { "domain_equals/long", run_domain_equals,
+      pair(repeat("", "sub.", "example.org", 64 << 10).data,
+        repeat("", "sub.", "example.net", 64 << 10).data) },
+    { "cookie_parse/10000-cookies", run_cookie_parse, cookie_jar(10000) },
+    { "srcinfo_next/single", run_srcinfo, srcinfo(1) },
+    { "srcinfo_next/1000-packages", run_srcinfo, srcinfo(1000) },
+    { "json_reader/rpc-1-result", run_json, rpc_response(1) },
+    { "json_reader/rpc-1000-results", run_json, rpc_response(1000) },
+    { "json_reader/deep-arrays", run_json,
+      repeat("", "[", "", 64 << 10) },
+    { "strtrim/padded", run_strtrim,
+      repeat(" \t ", " ", "value", 1 << 20) },
+    { "config_parse_line/5000-sections", run_config, config_file(5000) },
+    { "config_parse_line/long-line", run_config,
+      repeat("Packages = ", "pkgname ", "", 1 << 20) },
+  };
+  size_t scratch_len = 0;
+  char *scratch;
+
+  check_counting();
+
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i)
+    if (benches[i].input.len > scratch_len)
+      scratch_len = benches[i].input.len;
+  scratch = xmalloc(scratch_len + 1);
+
+  printf("%-36s %12s %10s %10s %12s\n", "benchmark", "bytes", "ns/call",
+      "ns/byte", "allocs/call");
+
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+    struct bench_t *bench = &benches[i];
+    uint64_t calls = 0, allocs;
+    double start, elapsed;
+
+    /* warm up caches and measure allocations on a single call */
+    allocations = 0;
+    bench->run(&bench->input, scratch);
+    allocs = allocations;
+
+    start = now_monotonic();
+    do {
+      for (unsigned n = 0; n < 16; ++n)
+        bench->run(&bench->input, scratch);
+      calls += 16;
+      elapsed = now_monotonic() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    printf("%-36s %12zu %10.0f %10.3f %12ju\n", bench->name,
+        bench->input.len, elapsed * 1e9 / calls,
+        bench->input.len ? elapsed * 1e9 / calls / bench->input.len : 0,
+        (uintmax_t)allocs);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* vim: set et ts=2 sw=2: */
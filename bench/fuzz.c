@@ -0,0 +1,171 @@
+/* libFuzzer entry points for the parsers in src/parse.c. One binary is built
+ * per parser, selected with -DFUZZ_HTML, -DFUZZ_COOKIE, -DFUZZ_SRCINFO,
+ * -DFUZZ_JSON, -DFUZZ_CONFIG, -DFUZZ_STRTRIM or -DFUZZ_DOMAIN; see "make
+ * fuzz". Built with
+ * -DFUZZ_STANDALONE instead, the binary runs each file named on its command
+ * line through the entry point once, for reproducing crashes without
+ * libFuzzer. */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#if defined(FUZZ_JSON)
+/* Containers must be closed at the depth they were opened at. */
+static int json_event(void *userdata, enum json_event_t event,
+    const char *key, size_t depth, const char *value, size_t len) {
+  size_t *open = userdata;
+
+  (void)key;
+  if (value[len] != '\0')
+    abort();
+
+  if (event == JSON_OBJECT_START || event == JSON_ARRAY_START) {
+    if (depth != *open)
+      abort();
+    ++*open;
+  } else if (event == JSON_OBJECT_END || event == JSON_ARRAY_END) {
+    if (depth != --*open)
+      abort();
+  } else if (depth != *open)
+    abort();
+
+  return 0;
+}
+#endif
+
+/* The parsers take NUL terminated strings. */
+static char *terminate(const uint8_t *data, size_t size) {
+  char *str = malloc(size + 1);
+  if (str == NULL)
+    abort();
+
+  memcpy(str, data, size);
+  str[size] = '\0';
+
+  return str;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char *input = terminate(data, size);
+
+#if defined(FUZZ_HTML)
+  {
+    char *text = NULL;
+
+    free(html_strip_tags(input, strlen(input)));
+    if (html_extract_error(input, &text) == 0)
+      free(text);
+  }
+#elif defined(FUZZ_COOKIE)
+  {
+    char *domain, *name, *value;
+    long expire;
+
+    if (cookie_parse(input, &domain, &expire, &name, &value) == 0 &&
+        (strchr(domain, '\t') || strchr(name, '\t')))
+      abort();
+  }
+#elif defined(FUZZ_SRCINFO)
+  {
+    const char *buf = input;
+    size_t len = size;
+    struct srcinfo_entry_t entry;
+
+    /* the tokenizer works on raw bytes, NULs included */
+    while (srcinfo_next(&buf, &len, &entry))
+      if (entry.key < input || entry.key + entry.key_len > input + size ||
+          entry.value < input || entry.value + entry.value_len > input + size)
+        abort();
+  }
+#elif defined(FUZZ_JSON)
+  {
+    json_reader_t *reader;
+    size_t open = 0, half = size / 2;
+
+    /* feed it in two pieces, so that tokens are split across calls */
+    if (json_reader_new(&reader, json_event, &open) < 0)
+      abort();
+    if (json_reader_feed(reader, input, half) == 0 &&
+        json_reader_feed(reader, input + half, size - half) == 0 &&
+        json_reader_finish(reader) == 0 && open != 0)
+      abort();
+    json_reader_free(reader);
+  }
+#elif defined(FUZZ_CONFIG)
+  {
+    char *line, *next, *key, *value;
+
+    for (line = input; line; line = next) {
+      next = strchr(line, '\n');
+      if (next)
+        *next++ = '\0';
+      config_parse_line(line, &key, &value);
+    }
+  }
+#elif defined(FUZZ_STRTRIM)
+  {
+    size_t len = strtrim(input);
+
+    if (len != strlen(input))
+      abort();
+  }
+#elif defined(FUZZ_DOMAIN)
+  {
+    /* the input holds both names, split at the first newline */
+    char *second = strchr(input, '\n');
+
+    if (second) {
+      *second++ = '\0';
+      if (domain_equals(input, second) != domain_equals(second, input))
+        abort();
+    }
+  }
+#else
+#error "define one of FUZZ_HTML, FUZZ_COOKIE, FUZZ_SRCINFO, FUZZ_JSON, FUZZ_CONFIG, FUZZ_STRTRIM or FUZZ_DOMAIN"
+#endif
+
+  free(input);
+
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    FILE *fp = fopen(argv[i], "rb");
+    uint8_t *data = NULL;
+    size_t size = 0, alloc = 0, n;
+
+    if (fp == NULL) {
+      perror(argv[i]);
+      return EXIT_FAILURE;
+    }
+
+    do {
+      if (size == alloc) {
+        alloc = alloc ? alloc * 2 : 4096;
+        data = realloc(data, alloc);
+        if (data == NULL)
+          abort();
+      }
+      n = fread(data + size, 1, alloc - size, fp);
+      size += n;
+    } while (n > 0);
+    fclose(fp);
+
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+  }
+
+  return EXIT_SUCCESS;
+}
+#endif
+
+/* vim: set et ts=2 sw=2: */
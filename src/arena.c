@@ -0,0 +1,161 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+struct arena_block_t {
+  struct arena_block_t *next;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+};
+
+struct arena_t {
+  struct arena_block_t *blocks;
+  size_t block_size;
+};
+
+static size_t align(size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+int arena_new(arena_t **ret, size_t block_size) {
+  arena_t *arena;
+
+  arena = calloc(1, sizeof(*arena));
+  if (arena == NULL)
+    return -ENOMEM;
+
+  arena->block_size = align(block_size);
+
+  *ret = arena;
+
+  return 0;
+}
+
+void arena_free(arena_t *arena) {
+  if (arena == NULL)
+    return;
+
+  while (arena->blocks) {
+    struct arena_block_t *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+
+  free(arena);
+}
+
+void arena_reset(arena_t *arena) {
+  struct arena_block_t *block = arena->blocks;
+
+  if (block == NULL)
+    return;
+
+  /* the oldest block is the last in the list; keep it unless it was an
+   * oversized one made for a single allocation */
+  while (block->next) {
+    struct arena_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+
+  if (block->size != arena->block_size) {
+    free(block);
+    arena->blocks = NULL;
+    return;
+  }
+
+  block->used = 0;
+  arena->blocks = block;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  struct arena_block_t *block = arena->blocks;
+  void *p;
+
+  size = align(size ? size : 1);
+
+  if (block == NULL || block->size - block->used < size) {
+    size_t block_size = size > arena->block_size ? size : arena->block_size;
+
+    block = malloc(sizeof(*block) + block_size);
+    if (block == NULL)
+      return NULL;
+
+    block->size = block_size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  p = (char *)block->data + block->used;
+  block->used += size;
+
+  return p;
+}
+
+void *arena_realloc(arena_t *arena, void *ptr, size_t old_size,
+    size_t new_size) {
+  struct arena_block_t *block = arena->blocks;
+  void *p;
+
+  if (ptr == NULL)
+    return arena_alloc(arena, new_size);
+
+  /* the last allocation in the current block can grow where it is */
+  if ((char *)ptr + align(old_size) == (char *)block->data + block->used &&
+      (char *)ptr - (char *)block->data + align(new_size) <= block->size) {
+    block->used = (char *)ptr - (char *)block->data + align(new_size);
+    return ptr;
+  }
+
+  p = arena_alloc(arena, new_size);
+  if (p)
+    memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+
+  return p;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len) {
+  char *p;
+
+  len = strnlen(str, len);
+  p = arena_alloc(arena, len + 1);
+  if (p) {
+    memcpy(p, str, len);
+    p[len] = '\0';
+  }
+
+  return p;
+}
+
+char *arena_printf(arena_t *arena, const char *format, ...) {
+  va_list ap;
+  char *p;
+  int len;
+
+  va_start(ap, format);
+  len = vsnprintf(NULL, 0, format, ap);
+  va_end(ap);
+  if (len < 0)
+    return NULL;
+
+  p = arena_alloc(arena, len + 1);
+  if (p == NULL)
+    return NULL;
+
+  va_start(ap, format);
+  vsnprintf(p, len + 1, format, ap);
+  va_end(ap);
+
+  return p;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,28 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/* A bump allocator for memory which lives no longer than one request.
+ * Nothing is freed on its own; arena_reset drops every allocation at once
+ * but keeps the first block around for the next request. */
+typedef struct arena_t arena_t;
+
+int arena_new(arena_t **ret, size_t block_size);
+void arena_free(arena_t *arena);
+
+void arena_reset(arena_t *arena);
+
+void *arena_alloc(arena_t *arena, size_t size);
+
+/* Grows the allocation at |ptr|, in place when it was the last one made. */
+void *arena_realloc(arena_t *arena, void *ptr, size_t old_size,
+    size_t new_size);
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+char *arena_printf(arena_t *arena, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _ARENA_H */
@@ -1,18 +1,59 @@
 #include <alloca.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <curl/curl.h>
 
+#include "arena.h"
 #include "aur.h"
 #include "log.h"
+#include "parse.h"
+#include "progress.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "trace.h"
+#include "transport.h"
 #include "util.h"
 
+/* Lookups are split so that no request URL grows longer than this, well
+ * within the 8 KiB request line that common server setups accept. */
+#define RPC_URL_MAX 4096
+
+/* CURLOPT_CURLU takes a parsed URL, which spares curl parsing it again on
+ * every request */
+#if LIBCURL_VERSION_NUM >= 0x073e00
+#define HAVE_CURLU 1
+#endif
+
+enum endpoint_t {
+  ENDPOINT_LOGIN,
+  ENDPOINT_SUBMIT,
+  ENDPOINT_LOGOUT,
+  ENDPOINT_RPC,
+  _ENDPOINT_MAX,
+};
+
+static const char *const endpoint_paths[_ENDPOINT_MAX] = {
+  [ENDPOINT_LOGIN] = "/login",
+  [ENDPOINT_SUBMIT] = "/submit",
+  [ENDPOINT_LOGOUT] = "/logout",
+  [ENDPOINT_RPC] = "/rpc/",
+};
+
+struct endpoint_url_t {
+  char *url;
+#ifdef HAVE_CURLU
+  CURLU *handle;
+#endif
+};
+
 struct aur_t {
   const char *proto;
   char *domainname;
@@ -24,6 +65,34 @@ struct aur_t {
   char *aursid;
 
   bool debug;
+  long retry_after;
+
+  /* when the request in flight last sent body bytes, how many it has sent,
+   * and when its final response began; response_time is the gap between
+   * the two in seconds, once the request is done */
+  uint64_t sent_usec;
+  curl_off_t sent_bytes;
+  uint64_t response_usec;
+  double response_time;
+
+  ratelimit_t *ratelimit;
+  progress_slot_t *progress;
+  stats_t *stats;
+  transport_t *transport;
+
+  /* every endpoint's URL, built once for the domain */
+  struct endpoint_url_t endpoints[_ENDPOINT_MAX];
+
+  /* transient allocations of the request in flight: its response body and
+   * headers. Reset whenever a new request is made. */
+  arena_t *arena;
+
+  /* the request being prepared, and the redirect of the last response */
+  const char *request_method;
+  const char *request_path;
+  const char *request_url;
+  struct curl_httppost *request_form;
+  char *redirect_url;
 
   CURL *curl;
 };
@@ -36,14 +105,68 @@ struct form_element_t {
 };
 
 struct memblock_t {
+  arena_t *arena;
   char *data;
   size_t len;
+  size_t alloc;
+};
+
+/* The reply to an info query, which is read as it arrives. */
+struct rpc_reply_t {
+  arena_t *arena;
+  json_reader_t *reader;
+  aur_package_fn callback;
+  void *userdata;
+  int result;
+
+  bool in_results;
+  bool is_error;
+  char *error;
+  struct aur_package_t package;
+};
+
+/* The tarball of an upload which is fed to curl through read_handler, from
+ * an open file, from memory, or from a callback when its length is not
+ * known. */
+struct upload_source_t {
+  FILE *fp;
+  const char *data;
+  size_t len;
+  size_t offset;
+  ratelimit_t *ratelimit;
+  aur_read_fn read;
+  void *read_data;
 };
 
-static inline void memblock_free(struct memblock_t *memblock) {
-  free(memblock->data);
+/* libcurl's global state is shared by every client in the process, and
+ * curl_global_init/cleanup are not thread-safe. Reference count it so that
+ * clients may be created and destroyed from any thread. */
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned global_refcount;
+
+static int global_ref(void) {
+  int r = 0;
+
+  pthread_mutex_lock(&global_lock);
+  if (global_refcount == 0) {
+    trace_span(span, "curl_global_init", NULL);
+
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+      r = -EIO;
+  }
+  if (r == 0)
+    ++global_refcount;
+  pthread_mutex_unlock(&global_lock);
+
+  return r;
+}
+
+static void global_unref(void) {
+  pthread_mutex_lock(&global_lock);
+  if (--global_refcount == 0)
+    curl_global_cleanup();
+  pthread_mutex_unlock(&global_lock);
 }
-#define _cleanup_memblock_ _cleanup_(memblock_free)
 
 static inline void formfreep(struct curl_httppost **form) {
   curl_formfree(*form);
@@ -55,22 +178,139 @@ static inline void slistfreep(struct curl_slist **slist) {
 }
 #define _cleanup_slist_ _cleanup_(slistfreep)
 
-static size_t write_handler(void *ptr, size_t nmemb, size_t size, void *userdata) {
+static inline void json_reader_freep(json_reader_t **reader) {
+  json_reader_free(*reader);
+}
+#define _cleanup_json_reader_ _cleanup_(json_reader_freep)
+
+/* The block is kept NUL terminated. */
+static int memblock_append(struct memblock_t *block, const char *data,
+    size_t len) {
+  if (block->len + len + 1 > block->alloc) {
+    size_t alloc = block->alloc ? block->alloc * 2 : 4096;
+    char *newdata;
+
+    while (alloc < block->len + len + 1)
+      alloc *= 2;
+
+    newdata = arena_realloc(block->arena, block->data, block->alloc, alloc);
+    if (newdata == NULL)
+      return -ENOMEM;
+
+    block->data = newdata;
+    block->alloc = alloc;
+  }
+
+  memcpy(block->data + block->len, data, len);
+  block->len += len;
+  block->data[block->len] = '\0';
+
+  return 0;
+}
+
+static size_t write_handler(char *ptr, size_t nmemb, size_t size, void *userdata) {
   struct memblock_t *response = userdata;
   size_t bytecount = size * nmemb;
-  char *alloc;
 
-  alloc = realloc(response->data, response->len + bytecount + 1);
-  if (alloc == NULL)
+  if (memblock_append(response, ptr, bytecount) < 0)
     return 0;
 
-  response->data = memcpy(alloc + response->len, ptr, bytecount);
-  response->len += bytecount;
-  response->data[response->len] = '\0';
+  return bytecount;
+}
+
+static size_t rpc_write_handler(char *ptr, size_t nmemb, size_t size,
+    void *userdata) {
+  struct rpc_reply_t *reply = userdata;
+  size_t bytecount = size * nmemb;
+
+  /* after an error the rest is still read, so that the status of the
+   * response is known */
+  if (reply->result == 0)
+    reply->result = json_reader_feed(reply->reader, ptr, bytecount);
 
   return bytecount;
 }
 
+static size_t header_handler(char *buffer, size_t size, size_t nitems,
+    void *userdata) {
+  aur_t *aur = userdata;
+  size_t len = size * nitems;
+  char *value;
+
+  /* an interim 100 Continue arrives before the body is sent */
+  if (aur->response_usec == 0 && len > 9 && strncmp(buffer, "HTTP/", 5) == 0) {
+    const char *status = memchr(buffer, ' ', len);
+    if (status && status[1] != '1')
+      aur->response_usec = now_usec();
+  }
+
+  if (len <= 12 || strncasecmp(buffer, "Retry-After:", 12) != 0)
+    return len;
+
+  value = arena_strndup(aur->arena, buffer + 12, len - 12);
+  if (value == NULL)
+    return len;
+
+  /* either delay-seconds or an HTTP-date */
+  value[strcspn(value, "\r\n")] = '\0';
+  if (value[strspn(value, " \t0123456789")] == '\0')
+    aur->retry_after = strtol(value, NULL, 10);
+  else {
+    time_t when = curl_getdate(value, NULL);
+    if (when > 0)
+      aur->retry_after = when > time(NULL) ? when - time(NULL) : 0;
+  }
+
+  return len;
+}
+
+static size_t read_handler(char *buffer, size_t size, size_t nitems,
+    void *userdata) {
+  struct upload_source_t *source = userdata;
+  size_t want = size * nitems;
+
+  if (source->read == NULL && source->offset + want > source->len)
+    want = source->len - source->offset;
+
+  if (source->ratelimit)
+    want = ratelimit_take(source->ratelimit, want);
+
+  if (source->read) {
+    ssize_t n = source->read(source->read_data, buffer, want);
+    if (n < 0)
+      return CURL_READFUNC_ABORT;
+    want = n;
+  } else if (source->fp) {
+    want = fread(buffer, 1, want, source->fp);
+    if (want == 0 && ferror(source->fp))
+      return CURL_READFUNC_ABORT;
+  } else
+    memcpy(buffer, source->data + source->offset, want);
+
+  source->offset += want;
+
+  return want;
+}
+
+static int xferinfo_handler(void *clientp, curl_off_t dltotal,
+    curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+  aur_t *aur = clientp;
+
+  (void)dltotal;
+  (void)dlnow;
+  (void)ultotal;
+
+  if (ulnow > aur->sent_bytes) {
+    aur->sent_bytes = ulnow;
+    aur->sent_usec = now_usec();
+  }
+
+  if (aur->progress)
+    progress_update(aur->progress, (uint64_t)ulnow);
+
+  return 0;
+}
+
 static int touch(const char *filename) {
   return close(open(filename, O_WRONLY|O_CREAT|O_CLOEXEC|O_NOCTTY, 0644));
 }
@@ -91,25 +331,75 @@ static int curl_reset(aur_t *aur) {
   } else
     curl_easy_setopt(aur->curl, CURLOPT_COOKIEFILE, "");
 
-  curl_easy_setopt(aur->curl, CURLOPT_WRITEFUNCTION, write_handler);
+  /* signals can't be used for timeouts when other threads own clients */
+  curl_easy_setopt(aur->curl, CURLOPT_NOSIGNAL, 1L);
+
+  return 0;
+}
+
+static int make_endpoints(aur_t *aur) {
+  for (int i = 0; i < _ENDPOINT_MAX; ++i) {
+    struct endpoint_url_t *endpoint = &aur->endpoints[i];
+
+    if (asprintf(&endpoint->url, "%s://%s%s", aur->proto, aur->domainname,
+          endpoint_paths[i]) < 0) {
+      endpoint->url = NULL;
+      return -ENOMEM;
+    }
+
+#ifdef HAVE_CURLU
+    endpoint->handle = curl_url();
+    if (endpoint->handle == NULL)
+      return -ENOMEM;
+
+    /* leave anything curl can't parse to fail when it's requested */
+    if (curl_url_set(endpoint->handle, CURLUPART_URL, endpoint->url, 0) !=
+        CURLUE_OK) {
+      curl_url_cleanup(endpoint->handle);
+      endpoint->handle = NULL;
+    }
+#endif
+  }
 
   return 0;
 }
 
 int aur_new(aur_t **ret, const char *domainname, bool secure) {
   aur_t *aur;
+  int r;
 
   aur = calloc(1, sizeof(*aur));
   if (aur == NULL)
     return -ENOMEM;
 
+  r = global_ref();
+  if (r < 0) {
+    free(aur);
+    return r;
+  }
+
   aur->secure = secure;
   aur->proto = secure ? "https" : "http";
+  aur->transport = transport_curl();
   aur->domainname = strdup(domainname);
-  if (aur->domainname == NULL)
+  if (aur->domainname == NULL) {
+    global_unref();
+    free(aur);
     return -ENOMEM;
+  }
 
-  curl_global_init(CURL_GLOBAL_ALL);
+  r = make_endpoints(aur);
+  if (r < 0) {
+    aur_free(aur);
+    return r;
+  }
+
+  /* large enough for the response of a typical request */
+  r = arena_new(&aur->arena, 32 * 1024);
+  if (r < 0) {
+    aur_free(aur);
+    return r;
+  }
 
   log_debug("created new AUR client for %s://%s", aur->proto,
       aur->domainname);
@@ -131,9 +421,20 @@ void aur_free(aur_t *aur) {
   free(aur->domainname);
   free(aur->aursid);
   free(aur->password);
+  free(aur->redirect_url);
+
+  for (int i = 0; i < _ENDPOINT_MAX; ++i) {
+    free(aur->endpoints[i].url);
+#ifdef HAVE_CURLU
+    curl_url_cleanup(aur->endpoints[i].handle);
+#endif
+  }
 
   curl_easy_cleanup(aur->curl);
-  curl_global_cleanup();
+  arena_free(aur->arena);
+  free(aur);
+
+  global_unref();
 }
 
 static int copy_string(char **field, const char *value) {
@@ -168,88 +469,56 @@ int aur_set_debug(aur_t *aur, bool enable) {
   return 0;
 }
 
-static bool is_package_url(const char *url) {
-  return strstr(url, "/packages/") || strstr(url, "/pkgbase/");
+int aur_set_ratelimit(aur_t *aur, ratelimit_t *ratelimit) {
+  aur->ratelimit = ratelimit;
+  return 0;
 }
 
-static char *strip_html_tags(const char *in, size_t len) {
-  int tag_depth = 0;
-  size_t i;
-  char *p, *out;
-
-  out = malloc(len + 1);
-  if (out == NULL)
-    return NULL;
-
-  p = out;
-  for (i = 0; i < len; i++) {
-    switch (in[i]) {
-    case '<':
-      ++tag_depth;
-      break;
-    case '>':
-      --tag_depth;
-      break;
-    default:
-      if (!tag_depth)
-        *p++ = in[i];
-      break;
-    }
-  }
-
-  *p = '\0';
-  return out;
+int aur_set_progress(aur_t *aur, progress_slot_t *progress) {
+  aur->progress = progress;
+  return 0;
 }
 
-static int extract_html(const char *html, const char *start_tag,
-    const char *end_tag, char **text_out) {
-  char *p, *q;
-
-  /* find the start */
-  p = strstr(html, start_tag);
-  if (p == NULL)
-    return -ENOENT;
-
-  /* fast forward past the tag */
-  p += strlen(start_tag);
-
-  q = strstr(p, end_tag);
-  if (q == NULL)
-    return -EINVAL;
-
-  *text_out = strip_html_tags(p, q - p);
-  if (*text_out == NULL)
-    return -ENOMEM;
+int aur_set_transport(aur_t *aur, transport_t *transport) {
+  aur->transport = transport ? transport : transport_curl();
+  return 0;
+}
 
+int aur_set_stats(aur_t *aur, stats_t *stats) {
+  aur->stats = stats;
   return 0;
 }
 
-static int extract_html_error(const char *html, char **error_out) {
-  struct tagpair_t {
-    const char *start;
-    const char *end;
-  } error_tags[] = {
-    { "<p class=\"pkgoutput\">", "</p>" },   /* AUR before 3.0.0 */
-    { "<ul class=\"errorlist\">", "</ul>" }, /* AUR >=3.0.0 */
-    { NULL, NULL },
-  };
+const char *aur_get_session(aur_t *aur) {
+  return aur->aursid;
+}
 
-  for (struct tagpair_t *tag = error_tags; tag->start; ++tag) {
-    if (extract_html(html, tag->start, tag->end, error_out) == 0)
-      return 0;
-  }
+long aur_get_retry_after(aur_t *aur) {
+  return aur->retry_after;
+}
 
-  return -ENOENT;
+double aur_get_response_time(aur_t *aur) {
+  return aur->response_time;
 }
 
-static struct curl_httppost *make_form(const struct form_element_t *elements) {
-  struct curl_httppost *post = NULL, *last = NULL;
+static bool is_package_url(const char *url) {
+  return strstr(url, "/packages/") || strstr(url, "/pkgbase/");
+}
 
+/* Names and values are referenced, not copied, so they must outlive the
+ * form. */
+static struct curl_httppost *make_form(const struct form_element_t *elements,
+    struct curl_httppost **last) {
+  struct curl_httppost *post = NULL;
+
+  *last = NULL;
   for (const struct form_element_t *elem = elements; elem->key; ++elem) {
     log_debug("  appending form field: %s=%s", elem->key, elem->value);
-    if (curl_formadd(&post, &last, elem->keyoption, elem->key,
-          elem->valueoption, elem->value, CURLFORM_END) != CURL_FORMADD_OK)
+    if (curl_formadd(&post, last, elem->keyoption, elem->key,
+          elem->valueoption, elem->value, CURLFORM_END) != CURL_FORMADD_OK) {
+      curl_formfree(post);
       return NULL;
+    }
   }
 
   return post;
@@ -257,40 +526,31 @@ static struct curl_httppost *make_form(const struct form_element_t *elements) {
 
 static struct curl_httppost *make_login_form(aur_t *aur) {
   const struct form_element_t elements[] = {
-    { CURLFORM_COPYNAME, "user", CURLFORM_COPYCONTENTS, aur->username },
-    { CURLFORM_COPYNAME, "passwd", CURLFORM_COPYCONTENTS, aur->password },
-    { CURLFORM_COPYNAME, "remember_me", CURLFORM_COPYCONTENTS, "on" },
+    { CURLFORM_PTRNAME, "user", CURLFORM_PTRCONTENTS, aur->username },
+    { CURLFORM_PTRNAME, "passwd", CURLFORM_PTRCONTENTS, aur->password },
+    { CURLFORM_PTRNAME, "remember_me", CURLFORM_PTRCONTENTS, "on" },
     { 0, NULL, 0, NULL },
   };
+  struct curl_httppost *last;
 
   log_debug("building login form");
 
-  return make_form(elements);
+  return make_form(elements, &last);
 }
 
-static struct curl_httppost *make_upload_form(aur_t *aur, const char *filepath,
-    const char *category) {
+/* Builds everything but the "pfile" part, which the caller appends. */
+static struct curl_httppost *make_upload_form(aur_t *aur, const char *category,
+    struct curl_httppost **last) {
   const struct form_element_t elements[] = {
-    { CURLFORM_COPYNAME, "category", CURLFORM_COPYCONTENTS, category },
-    { CURLFORM_COPYNAME, "token", CURLFORM_COPYCONTENTS, aur->aursid },
-    { CURLFORM_COPYNAME, "pkgsubmit", CURLFORM_COPYCONTENTS, "1" },
-    { CURLFORM_COPYNAME, "pfile", CURLFORM_FILE, filepath },
+    { CURLFORM_PTRNAME, "category", CURLFORM_PTRCONTENTS, category },
+    { CURLFORM_PTRNAME, "token", CURLFORM_COPYCONTENTS, aur->aursid },
+    { CURLFORM_PTRNAME, "pkgsubmit", CURLFORM_PTRCONTENTS, "1" },
     { 0, NULL, 0, NULL },
   };
 
   log_debug("building upload form");
 
-  return make_form(elements);
-}
-
-static bool domain_equals(const char *a, const char *b) {
-  size_t a_len, b_len;
-
-  /* ignore port numbers */
-  a_len = strcspn(a, ":");
-  b_len = strcspn(b, ":");
-
-  return a_len == b_len && strncasecmp(a, b, a_len) == 0;
+  return make_form(elements, last);
 }
 
 static bool cookie_domain_equals(const char *a, const char *b) {
@@ -307,13 +567,12 @@ static int update_aursid_from_cookies(aur_t *aur) {
   curl_easy_getinfo(aur->curl, CURLINFO_COOKIELIST, &cookielist);
 
   for (struct curl_slist *i = cookielist; i; i = i->next) {
-    _cleanup_free_ char *domain = NULL, *name = NULL, *aursid = NULL;
+    char *domain, *name, *aursid;
     long expire;
 
     log_debug("cookie=%s", i->data);
 
-    if (sscanf(i->data, "%ms\t%*s\t%*s\t%*s\t%ld\t%ms\t%ms",
-        &domain, &expire, &name, &aursid) != 4)
+    if (cookie_parse(i->data, &domain, &expire, &name, &aursid) < 0)
       continue;
 
     if (!cookie_domain_equals(domain, aur->domainname))
@@ -322,15 +581,13 @@ static int update_aursid_from_cookies(aur_t *aur) {
     if (!streq(name, "AURSID"))
       continue;
 
-    if (now >= expire)
+    /* an expiry of zero marks a session cookie */
+    if (expire != 0 && now >= expire)
       return -EKEYEXPIRED;
 
     log_debug("found valid cookie to use");
 
-    free(aur->aursid);
-    aur->aursid = aursid;
-    aursid = NULL;
-    return 0;
+    return copy_string(&aur->aursid, aursid);
   }
 
   /* if no cookie was found, expire any existing credentials */
@@ -341,6 +598,8 @@ static int update_aursid_from_cookies(aur_t *aur) {
 }
 
 static void preload_cookiefile(aur_t *aur) {
+  trace_span(span, "cookie preload", aur->cookiefile);
+
   /* Hack alert! Prime the cookielist for inspection. */
   curl_easy_setopt(aur->curl, CURLOPT_URL, "file:///dev/null");
   curl_easy_perform(aur->curl);
@@ -360,30 +619,47 @@ static int aur_login_cookies(aur_t *aur) {
   return update_aursid_from_cookies(aur);
 }
 
-static char *aur_make_url(aur_t *aur, const char *uri) {
-  char *url;
-  int r;
+static CURL *make_post_request(aur_t *aur, enum endpoint_t endpoint,
+    struct curl_httppost *post) {
+  const struct endpoint_url_t *url = &aur->endpoints[endpoint];
 
-  r = asprintf(&url, "%s://%s%s", aur->proto, aur->domainname, uri);
-  if (r < 0)
-    return NULL;
+  /* nothing of the previous request is needed anymore */
+  arena_reset(aur->arena);
 
-  return url;
-}
+  log_info("creating POST request to %s", url->url);
+  aur->request_method = "POST";
+#ifdef HAVE_CURLU
+  if (url->handle)
+    curl_easy_setopt(aur->curl, CURLOPT_CURLU, url->handle);
+  else
+#endif
+    curl_easy_setopt(aur->curl, CURLOPT_URL, url->url);
+  aur->request_url = url->url;
+  aur->request_path = endpoint_paths[endpoint];
 
-static CURL *make_post_request(aur_t *aur, const char *path,
-    struct curl_httppost *post) {
-  char *url = NULL;
+  curl_easy_setopt(aur->curl, CURLOPT_HTTPPOST, post);
+  aur->request_form = post;
 
-  url = aur_make_url(aur, path);
-  if (url == NULL)
-    return NULL;
+  if (aur->debug)
+    curl_easy_setopt(aur->curl, CURLOPT_VERBOSE, 1L);
 
-  log_info("creating POST request to %s", url);
-  curl_easy_setopt(aur->curl, CURLOPT_URL, url);
-  free(url);
+  return aur->curl;
+}
 
-  curl_easy_setopt(aur->curl, CURLOPT_HTTPPOST, post);
+/* |url| is one of |endpoint|'s with a query appended. It is usually built in
+ * the arena, which is left alone here. */
+static CURL *make_get_request(aur_t *aur, enum endpoint_t endpoint,
+    const char *url) {
+  log_info("creating GET request to %s", url);
+#ifdef HAVE_CURLU
+  curl_easy_setopt(aur->curl, CURLOPT_CURLU, NULL);
+#endif
+  curl_easy_setopt(aur->curl, CURLOPT_URL, url);
+  curl_easy_setopt(aur->curl, CURLOPT_HTTPGET, 1L);
+  aur->request_method = "GET";
+  aur->request_url = url;
+  aur->request_path = endpoint_paths[endpoint];
+  aur->request_form = NULL;
 
   if (aur->debug)
     curl_easy_setopt(aur->curl, CURLOPT_VERBOSE, 1L);
@@ -391,25 +667,62 @@ static CURL *make_post_request(aur_t *aur, const char *path,
   return aur->curl;
 }
 
-static long communicate(aur_t *aur, struct memblock_t *response) {
+/* Requests of |op| _STATS_OP_MAX aren't recorded. */
+static long communicate(aur_t *aur, enum stats_op_t op, uint64_t size,
+    curl_write_callback body_cb, void *body_data) {
+  struct transport_exchange_t exchange = {
+    .method = aur->request_method,
+    .url = aur->request_url,
+    .path = aur->request_path,
+    .form = aur->request_form,
+    .header_cb = header_handler,
+    .header_data = aur,
+    .body_cb = body_cb,
+    .body_data = body_data,
+    .read_cb = read_handler,
+  };
   long response_code;
+  uint64_t start, end;
+  int r;
 
-  log_info("fetching response from remote");
-  curl_easy_setopt(aur->curl, CURLOPT_WRITEDATA, response);
+  trace_span(span, "http request", NULL);
 
-  if (curl_easy_perform(aur->curl) != CURLE_OK)
+  log_info("fetching response from remote");
+  aur->retry_after = 0;
+  aur->sent_bytes = 0;
+  aur->response_usec = 0;
+
+  start = aur->sent_usec = now_usec();
+  r = transport_perform(aur->transport, aur->curl, &exchange);
+  end = now_usec();
+
+  /* transports without a status line are timed as a whole */
+  if (aur->response_usec == 0)
+    aur->response_usec = end;
+  aur->response_time = aur->response_usec > aur->sent_usec ?
+      (aur->response_usec - aur->sent_usec) / 1e6 : 0;
+  log_debug("response began %.3fs after the request was sent",
+      aur->response_time);
+
+  free(aur->redirect_url);
+  aur->redirect_url = exchange.redirect_url;
+  if (r < 0)
     return -1;
 
-  curl_easy_getinfo(aur->curl, CURLINFO_RESPONSE_CODE, &response_code);
+  response_code = exchange.status;
   log_info("server responded with status %ld", response_code);
 
+  /* throttled responses say nothing about how fast the server works */
+  if (aur->stats && op != _STATS_OP_MAX && response_code != 429 &&
+      response_code != 503)
+    stats_record(aur->stats, op, size, end - start);
+
   return response_code;
 }
 
 static int aur_login_password(aur_t *aur, char **error) {
   _cleanup_form_ struct curl_httppost *form = NULL;
-  _cleanup_memblock_ struct memblock_t response = { NULL, 0 };
-  char *effective_url = NULL;
+  struct memblock_t response = { aur->arena, NULL, 0, 0 };
   long http_status;
   int r;
 
@@ -423,17 +736,16 @@ static int aur_login_password(aur_t *aur, char **error) {
   if (form == NULL)
     return -ENOMEM;
 
-  aur->curl = make_post_request(aur, "/login", form);
+  aur->curl = make_post_request(aur, ENDPOINT_LOGIN, form);
   if (aur->curl == NULL)
     return -ENOMEM;
 
-  http_status = communicate(aur, &response);
+  http_status = communicate(aur, STATS_LOGIN, 0, write_handler, &response);
   if (http_status < 0 || http_status >= 400)
     return -EIO;
 
-  curl_easy_getinfo(aur->curl, CURLINFO_REDIRECT_URL, &effective_url);
-  if (effective_url == NULL) {
-    r = extract_html_error(response.data, error);
+  if (aur->redirect_url == NULL) {
+    r = html_extract_error(response.data, error);
     if (r < 0)
       return r;
 
@@ -444,7 +756,33 @@ static int aur_login_password(aur_t *aur, char **error) {
   return update_aursid_from_cookies(aur);
 }
 
+int aur_set_session(aur_t *aur, const char *session) {
+  _cleanup_free_ char *cookie = NULL;
+  int r;
+
+  r = copy_string(&aur->aursid, session);
+  if (r < 0)
+    return r;
+
+  r = curl_reset(aur);
+  if (r < 0)
+    return r;
+
+  /* a host-only session cookie, in Netscape cookie file format */
+  if (asprintf(&cookie, "%.*s\tFALSE\t/\t%s\t0\tAURSID\t%s",
+        (int)strcspn(aur->domainname, ":"), aur->domainname,
+        aur->secure ? "TRUE" : "FALSE", session) < 0)
+    return -ENOMEM;
+
+  if (curl_easy_setopt(aur->curl, CURLOPT_COOKIELIST, cookie) != CURLE_OK)
+    return -ENOMEM;
+
+  return 0;
+}
+
 int aur_login(aur_t *aur, char **error) {
+  trace_span(span, "login", aur->domainname);
+
   if (!aur->username)
     return -EBADR;
 
@@ -457,17 +795,104 @@ int aur_login(aur_t *aur, char **error) {
   return -ENOKEY;
 }
 
+/* Whether the session cookie is still good for an upload. A session which
+ * the server dropped or which ran out yields -EKEYEXPIRED, so that the
+ * caller knows to log in again. */
+static int check_session(aur_t *aur) {
+  int r;
+
+  if (aur->aursid == NULL)
+    return -ENOKEY;
+
+  r = update_aursid_from_cookies(aur);
+
+  return r == -ENOKEY ? -EKEYEXPIRED : r;
+}
+
+static int submit_upload(aur_t *aur, struct curl_httppost *form, size_t size,
+    char **error) {
+  struct memblock_t response = { aur->arena, NULL, 0, 0 };
+  long http_status;
+  int r;
+
+  aur->curl = make_post_request(aur, ENDPOINT_SUBMIT, form);
+  if (aur->curl == NULL)
+    return -ENOMEM;
+
+  /* the budget is shared by all transfers, but no single transfer may exceed
+   * it; read_handler paces the transfers against each other */
+  curl_easy_setopt(aur->curl, CURLOPT_MAX_SEND_SPEED_LARGE,
+      (curl_off_t)(aur->ratelimit ? ratelimit_get_rate(aur->ratelimit) : 0));
+
+  /* tracks the bytes sent, for the progress display and response_time */
+  curl_easy_setopt(aur->curl, CURLOPT_XFERINFOFUNCTION, xferinfo_handler);
+  curl_easy_setopt(aur->curl, CURLOPT_XFERINFODATA, aur);
+  curl_easy_setopt(aur->curl, CURLOPT_NOPROGRESS, 0L);
+
+  http_status = communicate(aur, STATS_UPLOAD, size, write_handler,
+      &response);
+  if (http_status == 429 || http_status == 503)
+    return -EAGAIN;
+  if (http_status == 411)
+    return -EMSGSIZE;
+  if (http_status < 0 || http_status >= 400)
+    return -EIO;
+
+  if (aur->redirect_url && is_package_url(aur->redirect_url))
+    return 0;
+
+  /* an expired session is sent to the login page */
+  r = check_session(aur);
+  if (r < 0)
+    return r;
+
+  r = html_extract_error(response.data, error);
+  if (r < 0)
+    return r;
+
+  return -EKEYREJECTED;
+}
+
+static int add_stream_part(aur_t *aur, struct curl_httppost **form,
+    struct curl_httppost **last, const char *filename,
+    struct upload_source_t *source) {
+  CURLFORMcode r;
+
+  /* without a length, libcurl sends the part chunked */
+  if (source->read)
+    r = curl_formadd(form, last, CURLFORM_COPYNAME, "pfile",
+        CURLFORM_FILENAME, filename, CURLFORM_STREAM, source, CURLFORM_END);
+  else
+    r = curl_formadd(form, last, CURLFORM_COPYNAME, "pfile",
+        CURLFORM_FILENAME, filename, CURLFORM_STREAM, source,
+        CURLFORM_CONTENTSLENGTH, (long)source->len, CURLFORM_END);
+  if (r != CURL_FORMADD_OK)
+    return -ENOMEM;
+
+  curl_easy_setopt(aur->curl, CURLOPT_READFUNCTION, read_handler);
+
+  return 0;
+}
+
+static const char *path_basename(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
 int aur_upload(aur_t *aur, const char *tarball_path,
     const char *category, char **error) {
   _cleanup_form_ struct curl_httppost *form = NULL;
-  _cleanup_memblock_ struct memblock_t response = { NULL, 0 };
-  long http_status;
-  char *effective_url = NULL;
+  _cleanup_fclose_ FILE *fp = NULL;
+  struct upload_source_t source = { NULL, NULL, 0, 0, aur->ratelimit };
+  struct curl_httppost *last;
   struct stat st;
   int r;
 
-  if (aur->aursid == NULL)
-    return -ENOKEY;
+  trace_span(span, "upload", tarball_path);
+
+  r = check_session(aur);
+  if (r < 0)
+    return r;
 
   log_info("uploading %s with category %s", tarball_path, category);
 
@@ -477,34 +902,254 @@ int aur_upload(aur_t *aur, const char *tarball_path,
   if (!S_ISREG(st.st_mode))
     return -EINVAL;
 
-  form = make_upload_form(aur, tarball_path, category);
+  form = make_upload_form(aur, category, &last);
   if (form == NULL)
     return -ENOMEM;
 
-  aur->curl = make_post_request(aur, "/submit", form);
+  if (aur->ratelimit) {
+    /* stream the file ourselves so that every read can be paced */
+    fp = fopen(tarball_path, "rbe");
+    if (fp == NULL)
+      return -errno;
+
+    source.fp = fp;
+    source.len = st.st_size;
+    r = add_stream_part(aur, &form, &last, path_basename(tarball_path),
+        &source);
+    if (r < 0)
+      return r;
+  } else if (curl_formadd(&form, &last, CURLFORM_COPYNAME, "pfile",
+        CURLFORM_FILE, tarball_path, CURLFORM_END) != CURL_FORMADD_OK)
+    return -ENOMEM;
+
+  return submit_upload(aur, form, st.st_size, error);
+}
+
+int aur_upload_buffer(aur_t *aur, const char *filename, const void *data,
+    size_t len, const char *category, char **error) {
+  _cleanup_form_ struct curl_httppost *form = NULL;
+  struct upload_source_t source = { NULL, data, len, 0, aur->ratelimit };
+  struct curl_httppost *last;
+  int r;
+
+  trace_span(span, "upload", filename);
+
+  r = check_session(aur);
+  if (r < 0)
+    return r;
+
+  log_info("uploading %s (%zu bytes from memory) with category %s", filename,
+      len, category);
+
+  form = make_upload_form(aur, category, &last);
+  if (form == NULL)
+    return -ENOMEM;
+
+  /* either way, the buffer is neither copied nor owned by the form */
+  if (aur->ratelimit) {
+    r = add_stream_part(aur, &form, &last, filename, &source);
+    if (r < 0)
+      return r;
+  } else if (curl_formadd(&form, &last, CURLFORM_COPYNAME, "pfile",
+        CURLFORM_BUFFER, filename, CURLFORM_BUFFERPTR, len ? data : "",
+        CURLFORM_BUFFERLENGTH, (long)len, CURLFORM_END) != CURL_FORMADD_OK)
+    return -ENOMEM;
+
+  return submit_upload(aur, form, len, error);
+}
+
+int aur_upload_stream(aur_t *aur, const char *filename, aur_read_fn read,
+    void *userdata, const char *category, char **error) {
+  _cleanup_form_ struct curl_httppost *form = NULL;
+  struct upload_source_t source = { NULL, NULL, 0, 0, aur->ratelimit, read,
+      userdata };
+  struct curl_httppost *last;
+  int r;
+
+  trace_span(span, "upload", filename);
+
+  r = check_session(aur);
+  if (r < 0)
+    return r;
+
+  /* forms only learned to stream parts of unknown length in 7.56 */
+  if (curl_version_info(CURLVERSION_NOW)->version_num < 0x073800)
+    return -EMSGSIZE;
+
+  log_info("uploading %s (streamed) with category %s", filename, category);
+
+  form = make_upload_form(aur, category, &last);
+  if (form == NULL)
+    return -ENOMEM;
+
+  r = add_stream_part(aur, &form, &last, filename, &source);
+  if (r < 0)
+    return r;
+
+  return submit_upload(aur, form, 0, error);
+}
+
+/* Replies look like {"type":"multiinfo","results":[{"Name":...},...]}, or
+ * {"type":"error","error":"..."}. */
+static int rpc_event(void *userdata, enum json_event_t event,
+    const char *key, size_t depth, const char *value, size_t len) {
+  struct rpc_reply_t *reply = userdata;
+  const char **field = NULL;
+
+  if (depth == 1) {
+    if (event == JSON_ARRAY_START && key && streq(key, "results"))
+      reply->in_results = true;
+    else if (event == JSON_ARRAY_END)
+      reply->in_results = false;
+    else if (event == JSON_STRING && key && streq(key, "type"))
+      reply->is_error = streq(value, "error");
+    else if (event == JSON_STRING && key && streq(key, "error")) {
+      reply->error = arena_strndup(reply->arena, value, len);
+      if (reply->error == NULL)
+        return -ENOMEM;
+    }
+    return 0;
+  }
+
+  if (!reply->in_results)
+    return 0;
+
+  if (depth == 2 && event == JSON_OBJECT_START)
+    memset(&reply->package, 0, sizeof(reply->package));
+  else if (depth == 2 && event == JSON_OBJECT_END) {
+    if (reply->package.name && reply->package.pkgbase &&
+        reply->package.version)
+      return reply->callback(reply->userdata, &reply->package);
+  } else if (depth == 3 && event == JSON_STRING && key) {
+    if (streq(key, "Name"))
+      field = &reply->package.name;
+    else if (streq(key, "PackageBase"))
+      field = &reply->package.pkgbase;
+    else if (streq(key, "Version"))
+      field = &reply->package.version;
+
+    if (field) {
+      *field = arena_strndup(reply->arena, value, len);
+      if (*field == NULL)
+        return -ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+static int rpc_query(aur_t *aur, const char *url, aur_package_fn callback,
+    void *userdata, char **error) {
+  _cleanup_json_reader_ json_reader_t *reader = NULL;
+  struct rpc_reply_t reply = {
+    .arena = aur->arena,
+    .callback = callback,
+    .userdata = userdata,
+  };
+  long http_status;
+  int r;
+
+  r = json_reader_new(&reader, rpc_event, &reply);
+  if (r < 0)
+    return r;
+  reply.reader = reader;
+
+  aur->curl = make_get_request(aur, ENDPOINT_RPC, url);
   if (aur->curl == NULL)
     return -ENOMEM;
 
-  http_status = communicate(aur, &response);
+  /* lookups have no place in the stats file */
+  http_status = communicate(aur, _STATS_OP_MAX, 0, rpc_write_handler, &reply);
+  if (http_status == 429 || http_status == 503)
+    return -EAGAIN;
   if (http_status < 0 || http_status >= 400)
     return -EIO;
 
-  curl_easy_getinfo(aur->curl, CURLINFO_REDIRECT_URL, &effective_url);
-  if (effective_url && is_package_url(effective_url))
-    return 0;
+  if (reply.result < 0)
+    return reply.result;
 
-  r = extract_html_error(response.data, error);
+  r = json_reader_finish(reader);
   if (r < 0)
     return r;
 
-  return -EKEYREJECTED;
+  if (reply.is_error) {
+    if (error && reply.error) {
+      *error = strdup(reply.error);
+      if (*error == NULL)
+        return -ENOMEM;
+    }
+    return -EREMOTEIO;
+  }
+
+  return 0;
+}
+
+int aur_info(aur_t *aur, const char *const *names, size_t count,
+    aur_package_fn callback, void *userdata, char **error) {
+  static const char query[] = "?v=5&type=info";
+  static const char arg[] = "&arg%5B%5D=";
+  const char *base = aur->endpoints[ENDPOINT_RPC].url;
+  size_t i = 0;
+  int r;
+
+  trace_span(span, "info", aur->domainname);
+
+  r = curl_reset(aur);
+  if (r < 0)
+    return r;
+
+  while (i < count) {
+    struct memblock_t url = { aur->arena, NULL, 0, 0 };
+    size_t first = i;
+
+    /* the URL is built in the arena, so this is where it is reset */
+    arena_reset(aur->arena);
+
+    r = memblock_append(&url, base, strlen(base));
+    if (r == 0)
+      r = memblock_append(&url, query, sizeof(query) - 1);
+    if (r < 0)
+      return r;
+
+    for (; i < count; ++i) {
+      char *escaped = curl_easy_escape(aur->curl, names[i], 0);
+      size_t len;
+
+      if (escaped == NULL)
+        return -ENOMEM;
+
+      /* a name too long on its own is still sent, for the server to refuse */
+      len = strlen(escaped);
+      if (i > first && url.len + sizeof(arg) - 1 + len > RPC_URL_MAX) {
+        curl_free(escaped);
+        break;
+      }
+
+      r = memblock_append(&url, arg, sizeof(arg) - 1);
+      if (r == 0)
+        r = memblock_append(&url, escaped, len);
+      curl_free(escaped);
+      if (r < 0)
+        return r;
+    }
+
+    log_info("looking up %zu packages", i - first);
+
+    r = rpc_query(aur, url.data, callback, userdata, error);
+    if (r < 0)
+      return r;
+  }
+
+  return 0;
 }
 
 int aur_logout(aur_t *aur) {
-  _cleanup_memblock_ struct memblock_t response = { NULL, 0 };
+  struct memblock_t response = { aur->arena, NULL, 0, 0 };
   long http_status;
   int r;
 
+  trace_span(span, "logout", aur->domainname);
+
   log_info("logging out");
 
   r = curl_reset(aur);
@@ -518,11 +1163,11 @@ int aur_logout(aur_t *aur) {
       return 0;
   }
 
-  aur->curl = make_post_request(aur, "/logout", NULL);
+  aur->curl = make_post_request(aur, ENDPOINT_LOGOUT, NULL);
   if (aur->curl == NULL)
     return -ENOMEM;
 
-  http_status = communicate(aur, &response);
+  http_status = communicate(aur, STATS_LOGOUT, 0, write_handler, &response);
   if (http_status >= 400)
     return -EIO;
 
@@ -2,8 +2,18 @@
 #define _AUR_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 
+/* Thread safety: an aur_t is not safe for concurrent use, but distinct
+ * clients share no mutable state and may be used from different threads at
+ * the same time. Creating and freeing clients is safe from any thread. Clients
+ * used concurrently should not share a cookie file. */
 typedef struct aur_t aur_t;
+struct progress_slot_t;
+struct ratelimit_t;
+struct stats_t;
+struct transport_t;
 
 int aur_new(aur_t **ret, const char *domainname, bool secure);
 void aur_free(aur_t *aur);
@@ -12,11 +22,75 @@ int aur_set_username(aur_t *aur, const char *username);
 int aur_set_password(aur_t *aur, const char *password);
 int aur_set_cookiefile(aur_t *aur, const char *cookiefile);
 int aur_set_debug(aur_t *aur, bool enable);
+/* Pace uploads against a bandwidth budget, which may be shared by several
+ * clients and must outlive them. */
+int aur_set_ratelimit(aur_t *aur, struct ratelimit_t *ratelimit);
+/* Report the bytes sent by each upload to |progress|, which must outlive the
+ * client. */
+int aur_set_progress(aur_t *aur, struct progress_slot_t *progress);
+/* Record the latency of every request in |stats|. */
+int aur_set_stats(aur_t *aur, struct stats_t *stats);
+/* Send requests through |transport| instead of libcurl's network stack. The
+ * transport must outlive the client. NULL restores the default. */
+int aur_set_transport(aur_t *aur, struct transport_t *transport);
+
+/* The session token of a logged in client. Another client for the same
+ * domain may adopt it with aur_set_session instead of logging in again. */
+const char *aur_get_session(aur_t *aur);
+int aur_set_session(aur_t *aur, const char *session);
+
+/* Seconds the server asked us to wait in its last response, or 0. */
+long aur_get_retry_after(aur_t *aur);
+/* Seconds between the last request having been sent in full and the start
+ * of its response. Unlike the duration of the whole request, this doesn't
+ * grow with the size of an upload. */
+double aur_get_response_time(aur_t *aur);
 
 int aur_login(aur_t *aur, char **error);
 int aur_logout(aur_t *aur);
+/* Returns -EAGAIN when the server is throttling us (429 or 503), and
+ * -EKEYEXPIRED when the session has run out or the server dropped it, after
+ * which the client needs to log in again. */
 int aur_upload(aur_t *aur, const char *tarball_path, const char *category,
     char **error);
+/* Like aur_upload, but the tarball is read from |data|, which must remain
+ * valid until the call returns. |filename| is what the server sees. */
+int aur_upload_buffer(aur_t *aur, const char *filename, const void *data,
+    size_t len, const char *category, char **error);
+
+/* Supplies the next bytes of a tarball being uploaded: at most |len| of them
+ * are stored at |buf|. Returns how many, 0 at the end of the tarball, or a
+ * negative errno. */
+typedef ssize_t (*aur_read_fn)(void *userdata, void *buf, size_t len);
+
+/* Like aur_upload, but the tarball's length need not be known in advance: it
+ * is pulled through |read| while it is sent, with chunked transfer encoding.
+ * Returns -EMSGSIZE if the length is needed after all, because the server
+ * asked for it (411) or libcurl is too old to send chunked forms. */
+int aur_upload_stream(aur_t *aur, const char *filename, aur_read_fn read,
+    void *userdata, const char *category, char **error);
+
+/* A package as the AUR's RPC interface describes it. |version| is the full
+ * version, with the epoch if there is one, as makepkg writes it. */
+struct aur_package_t {
+  const char *name;
+  const char *pkgbase;
+  const char *version;
+};
+
+/* Called for every package found by aur_info. The package is only valid
+ * during the call. A negative return stops the lookup, and aur_info returns
+ * it. */
+typedef int (*aur_package_fn)(void *userdata,
+    const struct aur_package_t *package);
+
+/* Look up the packages named |names|, with as few info queries as the length
+ * of a request URL allows. Names the server doesn't know are left out. No
+ * login is needed. Returns -EAGAIN when the server is throttling us,
+ * -EBADMSG if a response isn't JSON, and -EREMOTEIO if the server reports an
+ * error, which is then stored in |error|. */
+int aur_info(aur_t *aur, const char *const *names, size_t count,
+    aur_package_fn callback, void *userdata, char **error);
 
 /* vim: set et ts=2 sw=2: */
 
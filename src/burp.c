@@ -1,32 +1,174 @@
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
+#include <unistd.h>
 #include <wordexp.h>
 
 #include "aur.h"
+#include "git.h"
+#include "ingest.h"
+#include "journal.h"
 #include "log.h"
+#include "parse.h"
+#include "progress.h"
+#include "queue.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "tarball.h"
+#include "throttle.h"
+#include "trace.h"
+#include "transport.h"
 #include "util.h"
+#include "walk.h"
+#include "watch.h"
 
 #ifdef GIT_VERSION
 #undef PACKAGE_VERSION
 #define PACKAGE_VERSION GIT_VERSION
 #endif
 
-static inline void aur_freep(aur_t **aur) { aur_free(*aur); }
-#define _cleanup_aur_ _cleanup_(aur_freep)
+static inline void watch_freep(watch_t **watch) { watch_free(*watch); }
 
 struct category_t {
   const char *name;
   const char *id;
 };
 
+struct category_map_t {
+  char *path;
+  const char *id;
+};
+
+/* upper bound on concurrent uploads per account, and per domain */
+#define MAX_WORKERS 8
+/* how often an upload is retried while the server is throttling us */
+#define MAX_RETRIES 5
+/* how many targets are looked up on the AUR at once before being queued */
+#define LOOKUP_BATCH 100
+/* how long, in seconds, a path waits for its batch to fill before the batch
+ * is queued as it is, so that a slow list or walk still streams */
+#define LOOKUP_LINGER 0.5
+/* threads reading the targets of a batch */
+#define PREPARE_WORKERS 8
+/* how much of a tarball is read ahead when only its .SRCINFO and PKGBUILD,
+ * which makepkg puts first, are needed before the upload */
+#define INGEST_HEAD (256 * 1024)
+
+enum session_state_t {
+  SESSION_NONE,
+  SESSION_PENDING,
+  SESSION_READY,
+  SESSION_FAILED,
+};
+
+struct account_t {
+  char *name;
+  char *username;
+  char *password;
+  char *cookiefile;
+  const char *domain;
+  bool has_packages;
+
+  throttle_t *throttle;
+  git_t *git;
+  queue_t *queue;
+  pthread_t workers[MAX_WORKERS];
+  unsigned worker_count;
+  unsigned queued;
+
+  /* The first worker logs in, the others adopt its session. Everything
+   * below is protected by the lock. */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  enum session_state_t session_state;
+  char *session;
+  /* bumped whenever the session is replaced by a new login */
+  unsigned session_generation;
+  int result;
+  unsigned uploaded;
+  unsigned failed;
+};
+
+/* A tarball queued for upload, shared by every endpoint it is sent to. */
+struct target_t {
+  char *path;
+  struct stat st;
+  char *pkgbase;
+  char *version;
+  const char *category;
+
+  /* When fanning out to several endpoints, the tarball is read once and
+   * every upload is served from this mapping. A
+   * package directory is instead built into a tarball on the heap, which is
+   * uploaded as |filename|. */
+  void *data;
+  size_t size;
+  char *filename;
+  bool built;
+
+  /* A tarball read from a pipe or stdin is streamed as it is uploaded. Every
+   * byte read from |stream| is kept in |spool|, a memfd, so that it can be
+   * sent again; |offset| is where the current upload has got to. The copy
+   * can't wait for a failure: by then the bytes already sent are gone from
+   * the pipe, and a busy server, an expired session or a 411 all need the
+   * whole tarball for the next attempt. */
+  int stream;
+  int spool;
+  off_t spooled;
+  off_t offset;
+
+  int refcount;
+};
+
+struct account_map_t {
+  char *pkgbase;
+  struct account_t *account;
+};
+
+/* Paths waiting to be read, targets waiting to be queued, and which of
+ * them a domain already has at the same version. */
+struct lookup_t {
+  char *paths[LOOKUP_BATCH];
+  size_t path_count;
+  double first_added;
+  struct target_t *targets[LOOKUP_BATCH];
+  bool live[LOOKUP_BATCH];
+  size_t count;
+};
+
 enum {
   OPT_DOMAIN = '~' + 1,
+  OPT_CATEGORY_MAP,
+  OPT_JOURNAL,
+  OPT_RESUME,
+  OPT_LIMIT_RATE,
+  OPT_PROGRESS,
+  OPT_TRACE,
+  OPT_STATS,
+  OPT_STATS_FILE,
+  OPT_STATS_PROMETHEUS,
+  OPT_LOOPBACK,
+  OPT_RECORD,
+  OPT_REPLAY,
+  OPT_REPLAY_REALTIME,
+  OPT_FORCE,
+  OPT_GIT,
+  OPT_WATCH,
+  OPT_FILES_FROM,
+  OPT_RECURSIVE,
 };
 
 /* This list must be sorted */
@@ -55,12 +197,65 @@ static const struct category_t categories[] = {
 };
 
 static const char *arg_category = "1";
-static const char *arg_domain = "aur.archlinux.org";
+static const char *arg_category_map;
+static const char **arg_domains;
+static size_t arg_domain_count;
 static char *arg_username;
 static char *arg_password;
 static char *arg_cookiefile;
+static char *arg_journal;
+static const char *arg_trace;
+static char *arg_stats_file;
+static char *arg_stats_prometheus;
+static const char *arg_record;
+static const char *arg_replay;
+static size_t arg_limit_rate;
 static int arg_loglevel = LOG_WARN;
 static bool arg_expire;
+static bool arg_resume;
+static bool arg_progress;
+static bool arg_stats;
+static bool arg_loopback;
+static bool arg_replay_realtime;
+static bool arg_force;
+static bool arg_git;
+static const char *arg_git_url;
+static const char *arg_watch;
+static const char *arg_files_from;
+static const char *arg_recursive;
+static bool arg_null;
+
+static struct category_map_t *category_map;
+static size_t category_map_len;
+
+/* the account given on the command line or at the top of the config file */
+static struct account_t default_account = {
+  .name = (char *)"default",
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* the account used for targets not mapped to any other, one per domain */
+static struct account_t **domain_accounts;
+static throttle_t **domain_throttles;
+static git_t **domain_gits;
+
+/* accounts from [sections] of the config file */
+static struct account_t **accounts;
+static size_t account_count;
+
+static struct account_map_t *account_map;
+static size_t account_map_len;
+
+static pthread_mutex_t prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static journal_t *journal;
+static ratelimit_t *ratelimit;
+static progress_t *progress;
+static stats_t *stats;
+static transport_t *transport;
+static transport_t *recorder;
+static aur_t **lookup_clients;
 
 static int category_compare(const void *a, const void *b) {
   const struct category_t *left = a;
@@ -117,30 +312,255 @@ static char *shell_expand(const char *in) {
   return out;
 }
 
-static size_t strtrim(char *str) {
-  char *left = str, *right;
+static int category_map_compare(const void *a, const void *b) {
+  const struct category_map_t *left = a;
+  const struct category_map_t *right = b;
+  return strcmp(left->path, right->path);
+}
+
+static const char *category_map_lookup(const char *path) {
+  struct category_map_t key = { (char *)path, NULL };
+  struct category_map_t *res;
 
-  if (!str || *str == '\0')
-    return 0;
+  if (category_map_len == 0)
+    return NULL;
+
+  res = bsearch(&key, category_map, category_map_len,
+      sizeof(struct category_map_t), category_map_compare);
 
-  while (isspace((unsigned char)*left))
-    left++;
+  return res ? res->id : NULL;
+}
 
-  if (left != str) {
-    memmove(str, left, (strlen(left) + 1));
-    left = str;
+static const char *category_from_pkgbuild(const char *tarball_path,
+    char *pkgbuild) {
+  char *line, *p;
+
+  if (pkgbuild == NULL) {
+    log_debug("unable to read PKGBUILD from %s", tarball_path);
+    return NULL;
   }
 
-  if (*str == '\0')
-    return 0;
+  p = pkgbuild;
+  while ((line = strsep(&p, "\n")) != NULL) {
+    const char *id;
+
+    line += strspn(line, " \t");
+    if (*line != '#')
+      continue;
+
+    line += 1 + strspn(line + 1, " \t");
+    if (strncasecmp(line, "category:", 9) != 0)
+      continue;
+
+    line += 9;
+    strtrim(line);
+
+    id = category_validate(line);
+    if (id == NULL)
+      log_warn("ignoring invalid category hint '%s' in %s", line,
+          tarball_path);
+    return id;
+  }
+
+  return NULL;
+}
+
+/* Per-package category assignment, in order of preference: an entry in the
+ * category map, a "# category:" hint in the PKGBUILD, or the -c argument. */
+static const char *package_category(const char *tarball_path,
+    char *pkgbuild) {
+  const char *id;
+
+  id = category_map_lookup(tarball_path);
+  if (id) {
+    log_debug("using category %s for %s from category map", id, tarball_path);
+    return id;
+  }
+
+  id = category_from_pkgbuild(tarball_path, pkgbuild);
+  if (id) {
+    log_debug("using category %s for %s from PKGBUILD", id, tarball_path);
+    return id;
+  }
+
+  return arg_category;
+}
+
+static int read_category_map(const char *filename) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ char *line = NULL;
+  size_t linesz = 0;
+  int lineno = 0;
+
+  fp = fopen(filename, "r");
+  if (fp == NULL) {
+    log_error("failed to open %s: %s", filename, strerror(errno));
+    return -errno;
+  }
+
+  while (getline(&line, &linesz, fp) != -1) {
+    struct category_map_t *alloc;
+    char *path, *category;
+    size_t len;
+
+    ++lineno;
+
+    len = strtrim(line);
+    if (len == 0 || line[0] == '#')
+      continue;
+
+    /* the category is the last field, so paths may contain whitespace */
+    category = line + len;
+    while (category > line && !isspace((unsigned char)category[-1]))
+      --category;
+    if (category == line) {
+      log_error("missing category on line %d of %s", lineno, filename);
+      return -EINVAL;
+    }
+    category[-1] = '\0';
+    path = line;
+    strtrim(path);
+
+    alloc = realloc(category_map,
+        (category_map_len + 1) * sizeof(struct category_map_t));
+    if (alloc == NULL) {
+      log_error("failed to allocate memory");
+      return -ENOMEM;
+    }
+    category_map = alloc;
+
+    category_map[category_map_len].id = category_validate(category);
+    if (category_map[category_map_len].id == NULL) {
+      log_error("invalid category %s on line %d of %s", category, lineno,
+          filename);
+      return -EINVAL;
+    }
+
+    category_map[category_map_len].path = strdup(path);
+    if (category_map[category_map_len].path == NULL) {
+      log_error("failed to allocate memory");
+      return -ENOMEM;
+    }
+
+    ++category_map_len;
+  }
+
+  qsort(category_map, category_map_len, sizeof(struct category_map_t),
+      category_map_compare);
+
+  return 0;
+}
+
+static int account_map_compare(const void *a, const void *b) {
+  const struct account_map_t *left = a;
+  const struct account_map_t *right = b;
+  return strcmp(left->pkgbase, right->pkgbase);
+}
+
+static struct account_t *package_account(const struct target_t *target,
+    size_t domain) {
+  struct account_map_t key, *res;
+
+  if (target->pkgbase == NULL || account_map_len == 0)
+    return domain_accounts[domain];
+
+  key.pkgbase = target->pkgbase;
+  res = bsearch(&key, account_map, account_map_len,
+      sizeof(struct account_map_t), account_map_compare);
+  if (res == NULL)
+    return domain_accounts[domain];
+
+  /* a pkgbase may be owned by different accounts on different domains */
+  while (res > account_map && streq(res[-1].pkgbase, target->pkgbase))
+    --res;
+  for (; res < account_map + account_map_len &&
+      streq(res->pkgbase, target->pkgbase); ++res)
+    if (streq(res->account->domain, arg_domains[domain]))
+      return res->account;
+
+  return domain_accounts[domain];
+}
+
+static struct account_t *account_new(const char *name) {
+  struct account_t *account, **alloc;
+
+  alloc = realloc(accounts, (account_count + 1) * sizeof(*accounts));
+  if (alloc == NULL)
+    return NULL;
+  accounts = alloc;
+
+  account = calloc(1, sizeof(*account));
+  if (account == NULL)
+    return NULL;
+
+  account->name = strdup(name);
+  if (account->name == NULL) {
+    free(account);
+    return NULL;
+  }
 
-  right = (char*)rawmemchr(str, '\0') - 1;
-  while (isspace((unsigned char)*right))
-    right--;
+  pthread_mutex_init(&account->lock, NULL);
+  pthread_cond_init(&account->cond, NULL);
 
-  *++right = '\0';
+  accounts[account_count++] = account;
 
-  return right - left;
+  return account;
+}
+
+static int account_map_add(struct account_t *account, char *packages) {
+  char *pkgbase;
+
+  while ((pkgbase = strsep(&packages, " \t")) != NULL) {
+    struct account_map_t *alloc;
+
+    if (*pkgbase == '\0')
+      continue;
+
+    alloc = realloc(account_map,
+        (account_map_len + 1) * sizeof(struct account_map_t));
+    if (alloc == NULL)
+      return -ENOMEM;
+    account_map = alloc;
+
+    account_map[account_map_len].pkgbase = strdup(pkgbase);
+    if (account_map[account_map_len].pkgbase == NULL)
+      return -ENOMEM;
+    account_map[account_map_len].account = account;
+    ++account_map_len;
+  }
+
+  return 0;
+}
+
+/* Parses a byte count with an optional K, M or G suffix. */
+static int parse_size(const char *str, size_t *size) {
+  unsigned long long value;
+  char *end;
+
+  errno = 0;
+  value = strtoull(str, &end, 10);
+  if (errno != 0 || end == str)
+    return -EINVAL;
+
+  switch (*end) {
+  case 'G': case 'g':
+    value *= 1024;
+    /* fallthrough */
+  case 'M': case 'm':
+    value *= 1024;
+    /* fallthrough */
+  case 'K': case 'k':
+    value *= 1024;
+    ++end;
+    break;
+  }
+
+  if (*end != '\0')
+    return -EINVAL;
+
+  *size = value;
+
+  return 0;
 }
 
 static int read_config_file(void) {
@@ -148,6 +568,7 @@ static int read_config_file(void) {
   char *config_path = NULL;
   char line[BUFSIZ];
   int lineno = 0;
+  struct account_t *section = NULL;
 
   config_path = find_config_file();
   if (config_path == NULL) {
@@ -168,41 +589,160 @@ static int read_config_file(void) {
 
   while (fgets(line, sizeof(line), fp) != NULL) {
     char *key, *value;
-    size_t len;
 
     ++lineno;
 
-    len = strtrim(line);
-    if (len == 0 || line[0] == '#')
+    switch (config_parse_line(line, &key, &value)) {
+    case CONFIG_BLANK:
       continue;
-
-    key = value = line;
-    strsep(&value, "=");
-    strtrim(key);
-    strtrim(value);
+    case CONFIG_SECTION:
+      section = account_new(key);
+      if (section == NULL) {
+        log_error("failed to allocate memory");
+        return -ENOMEM;
+      }
+      continue;
+    case CONFIG_INVALID:
+      log_warn("missing value for config entry '%s' on line %d", key, lineno);
+      continue;
+    case CONFIG_ENTRY:
+      break;
+    }
 
     if (streq(key, "User")) {
       char *v = strdup(value);
       if (v == NULL)
         log_error("failed to allocate memory\n");
+      else if (section)
+        section->username = v;
       else
         arg_username = v;
     } else if (streq(key, "Password")) {
       char *v = strdup(value);
       if (v == NULL)
         log_error("failed to allocate memory\n");
+      else if (section)
+        section->password = v;
       else
         arg_password = v;
     } else if (streq(key, "Cookies")) {
       char *v = shell_expand(value);
       if (v == NULL)
         log_error("failed to allocate memory\n");
+      else if (section)
+        section->cookiefile = v;
       else
         arg_cookiefile = v;
+    } else if (streq(key, "Journal") && !section) {
+      char *v = shell_expand(value);
+      if (v == NULL)
+        log_error("failed to allocate memory\n");
+      else
+        arg_journal = v;
+    } else if (streq(key, "StatsFile") && !section) {
+      char *v = shell_expand(value);
+      if (v == NULL)
+        log_error("failed to allocate memory\n");
+      else
+        arg_stats_file = v;
+    } else if (streq(key, "StatsPrometheus") && !section) {
+      char *v = shell_expand(value);
+      if (v == NULL)
+        log_error("failed to allocate memory\n");
+      else
+        arg_stats_prometheus = v;
+    } else if (streq(key, "LimitRate") && !section) {
+      if (parse_size(value, &arg_limit_rate) < 0)
+        log_warn("invalid rate '%s' on line %d", value, lineno);
+    } else if (streq(key, "Domain") && section) {
+      char *v = strdup(value);
+      if (v == NULL)
+        log_error("failed to allocate memory\n");
+      else
+        section->domain = v;
+    } else if (streq(key, "Packages") && section) {
+      if (account_map_add(section, value) < 0) {
+        log_error("failed to allocate memory");
+        return -ENOMEM;
+      }
+      section->has_packages = true;
     } else
       log_warn("unknown config entry '%s' on line %d", key, lineno);
   }
 
+  qsort(account_map, account_map_len, sizeof(struct account_map_t),
+      account_map_compare);
+
+  return 0;
+}
+
+/* Pick the default account for every target domain, and bind sections which
+ * don't name a domain to the first one. */
+static int setup_domain_accounts(void) {
+  domain_accounts = calloc(arg_domain_count, sizeof(*domain_accounts));
+  if (domain_accounts == NULL)
+    return -ENOMEM;
+
+  default_account.username = arg_username;
+  default_account.password = arg_password;
+  default_account.cookiefile = arg_cookiefile;
+  default_account.domain = arg_domains[0];
+
+  for (size_t d = 0; d < arg_domain_count; ++d) {
+    struct account_t *account = NULL;
+
+    /* only sections naming the domain themselves, not defaulted to it */
+    for (size_t i = 0; i < account_count; ++i)
+      if (!accounts[i]->has_packages && accounts[i]->domain &&
+          streq(accounts[i]->domain, arg_domains[d])) {
+        account = accounts[i];
+        break;
+      }
+
+    if (account == NULL && d == 0)
+      account = &default_account;
+    else if (account == NULL) {
+      /* reuse the default credentials, but never share its cookie jar */
+      account = account_new(arg_domains[d]);
+      if (account == NULL)
+        return -ENOMEM;
+      account->username = arg_username;
+      account->password = arg_password;
+      account->domain = arg_domains[d];
+    }
+
+    domain_accounts[d] = account;
+  }
+
+  for (size_t i = 0; i < account_count; ++i)
+    if (accounts[i]->domain == NULL)
+      accounts[i]->domain = arg_domains[0];
+
+  /* accounts on the same server share its throttle */
+  domain_throttles = calloc(arg_domain_count, sizeof(*domain_throttles));
+  if (domain_throttles == NULL)
+    return -ENOMEM;
+
+  for (size_t d = 0; d < arg_domain_count; ++d) {
+    if (throttle_new(&domain_throttles[d], MAX_WORKERS) < 0)
+      return -ENOMEM;
+
+    if (streq(default_account.domain, arg_domains[d]) &&
+        default_account.throttle == NULL)
+      default_account.throttle = domain_throttles[d];
+    for (size_t i = 0; i < account_count; ++i)
+      if (streq(accounts[i]->domain, arg_domains[d]) &&
+          accounts[i]->throttle == NULL)
+        accounts[i]->throttle = domain_throttles[d];
+  }
+
+  for (size_t i = 1; i < account_map_len; ++i)
+    if (streq(account_map[i - 1].pkgbase, account_map[i].pkgbase) &&
+        streq(account_map[i - 1].account->domain,
+          account_map[i].account->domain))
+      log_warn("package %s is assigned to more than one account on %s",
+          account_map[i].pkgbase, account_map[i].account->domain);
+
   return 0;
 }
 
@@ -220,6 +760,8 @@ static void usage_categories(void) {
 static void __attribute__((noreturn)) print_usage(void) {
   fprintf(stderr, "burp %s\n"
   "Usage: burp [options] targets...\n\n"
+  " Targets are source tarballs, or package directories holding a PKGBUILD\n"
+  " and an up to date .SRCINFO. A tarball named - is read from stdin.\n\n"
   " Options:\n"
   "  -u, --user                AUR login username.\n"
   "  -p, --password            AUR login password.\n"
@@ -227,11 +769,41 @@ static void __attribute__((noreturn)) print_usage(void) {
   "                              This will default to the current category\n"
   "                              for pre-existing packages and 'None' for new\n"
   "                              packages. -c help will give a list of valid\n"
-  "                              categories.\n", PACKAGE_VERSION);
+  "                              categories.\n"
+  "      --category-map=FILE   Read per-package categories from FILE. Each\n"
+  "                              line holds a target path followed by its\n"
+  "                              category.\n", PACKAGE_VERSION);
   fprintf(stderr,
   "  -e, --expire              Instead of uploading, expire the current session\n"
-  /* leaving --domain undocumented for now */
-  /* "      --domain=DOMAIN       Domain of the AUR (default: aur.archlinux.org)\n" */
+  "      --domain=DOMAIN       Domain of the AUR (default: aur.archlinux.org).\n"
+  "                              Pass several times to upload to each of them.\n"
+  "      --journal=FILE        Record the outcome of every upload in FILE.\n"
+  "      --resume              Skip uploads the journal records as done.\n"
+  "      --force               Upload even versions the AUR already has.\n"
+  "      --git[=URL]           Push to the git repository of each pkgbase\n"
+  "                              instead, at URL with %%s for the pkgbase\n"
+  "                              (default: ssh://aur@DOMAIN/%%s.git).\n"
+  "      --files-from=FILE     Also upload the targets listed in FILE, one per\n"
+  "                              line, or - for stdin. Uploads start while\n"
+  "                              the list is being read.\n"
+  "  -0, --null                Targets in FILE are separated by NULs.\n"
+  "      --recursive=DIR       Also upload the source tarballs found anywhere\n"
+  "                              below DIR.\n"
+  "      --watch=DIR           After the targets, upload the source tarballs\n"
+  "                              in DIR, and keep uploading those which\n"
+  "                              appear in it until interrupted.\n"
+  "      --limit-rate=RATE     Upload at most RATE bytes per second in total.\n"
+  "                              RATE may carry a K, M or G suffix.\n"
+  "      --progress            Show the progress of uploads on stderr.\n"
+  "      --trace=FILE          Write a Chrome trace of the run to FILE.\n"
+  "      --stats-file=FILE     Keep latency histograms across runs in FILE.\n"
+  "      --stats               Print the latencies recorded in the stats file.\n"
+  "      --stats-prometheus=FILE\n"
+  "                            Export the stats file for Prometheus to FILE.\n"
+  "      --loopback            Talk to a simulated AUR instead of the network.\n"
+  "      --record=DIR          Store every request and response under DIR.\n"
+  "      --replay=DIR          Answer requests with responses stored under DIR.\n"
+  "      --replay-realtime     Delay replayed responses as much as the originals.\n"
   "  -C FILE, --cookies=FILE   Read and write login cookies from FILE. \n"
   "                              The file must be a valid Netscape cookie file.\n"
   "  -v, --verbose             be more verbose. Pass twice for debug info.\n\n"
@@ -246,6 +818,7 @@ static int parseargs(int *argc, char ***argv) {
   static struct option option_table[] = {
     { "cookies",       required_argument,  0, 'C' },
     { "category",      required_argument,  0, 'c' },
+    { "category-map",  required_argument,  0, OPT_CATEGORY_MAP },
     { "expire",        no_argument,        0, 'e' },
     { "help",          no_argument,        0, 'h' },
     { "password",      required_argument,  0, 'p' },
@@ -253,15 +826,36 @@ static int parseargs(int *argc, char ***argv) {
     { "version",       no_argument,        0, 'V' },
     { "verbose",       no_argument,        0, 'v' },
     { "domain",        required_argument,  0, OPT_DOMAIN },
+    { "journal",       required_argument,  0, OPT_JOURNAL },
+    { "resume",        no_argument,        0, OPT_RESUME },
+    { "force",         no_argument,        0, OPT_FORCE },
+    { "git",           optional_argument,  0, OPT_GIT },
+    { "watch",         required_argument,  0, OPT_WATCH },
+    { "files-from",    required_argument,  0, OPT_FILES_FROM },
+    { "null",          no_argument,        0, '0' },
+    { "recursive",     required_argument,  0, OPT_RECURSIVE },
+    { "limit-rate",    required_argument,  0, OPT_LIMIT_RATE },
+    { "progress",      no_argument,        0, OPT_PROGRESS },
+    { "trace",         required_argument,  0, OPT_TRACE },
+    { "stats",         no_argument,        0, OPT_STATS },
+    { "stats-file",    required_argument,  0, OPT_STATS_FILE },
+    { "stats-prometheus", required_argument, 0, OPT_STATS_PROMETHEUS },
+    { "loopback",      no_argument,        0, OPT_LOOPBACK },
+    { "record",        required_argument,  0, OPT_RECORD },
+    { "replay",        required_argument,  0, OPT_REPLAY },
+    { "replay-realtime", no_argument,      0, OPT_REPLAY_REALTIME },
     { NULL, 0, NULL, 0 },
   };
 
   for (;;) {
-    int opt = getopt_long(*argc, *argv, "C:c:ehp:u:Vv", option_table, NULL);
+    int opt = getopt_long(*argc, *argv, "0C:c:ehp:u:Vv", option_table, NULL);
     if (opt < 0)
       break;
 
     switch (opt) {
+    case '0':
+      arg_null = true;
+      break;
     case 'C':
       arg_cookiefile = optarg;
       break;
@@ -290,7 +884,74 @@ static int parseargs(int *argc, char ***argv) {
       ++arg_loglevel;
       break;
     case OPT_DOMAIN:
-      arg_domain = optarg;
+      {
+        const char **alloc = realloc(arg_domains,
+            (arg_domain_count + 1) * sizeof(*arg_domains));
+        if (alloc == NULL) {
+          log_error("failed to allocate memory");
+          return -ENOMEM;
+        }
+        arg_domains = alloc;
+        arg_domains[arg_domain_count++] = optarg;
+      }
+      break;
+    case OPT_CATEGORY_MAP:
+      arg_category_map = optarg;
+      break;
+    case OPT_JOURNAL:
+      arg_journal = optarg;
+      break;
+    case OPT_RESUME:
+      arg_resume = true;
+      break;
+    case OPT_FORCE:
+      arg_force = true;
+      break;
+    case OPT_GIT:
+      arg_git = true;
+      arg_git_url = optarg;
+      break;
+    case OPT_WATCH:
+      arg_watch = optarg;
+      break;
+    case OPT_FILES_FROM:
+      arg_files_from = optarg;
+      break;
+    case OPT_RECURSIVE:
+      arg_recursive = optarg;
+      break;
+    case OPT_LIMIT_RATE:
+      if (parse_size(optarg, &arg_limit_rate) < 0) {
+        log_error("invalid rate %s", optarg);
+        return -EINVAL;
+      }
+      break;
+    case OPT_PROGRESS:
+      arg_progress = true;
+      break;
+    case OPT_TRACE:
+      arg_trace = optarg;
+      break;
+    case OPT_STATS:
+      arg_stats = true;
+      break;
+    case OPT_STATS_FILE:
+      arg_stats_file = optarg;
+      break;
+    case OPT_STATS_PROMETHEUS:
+      arg_stats_prometheus = optarg;
+      break;
+    case OPT_LOOPBACK:
+      arg_loopback = true;
+      break;
+    case OPT_RECORD:
+      arg_record = optarg;
+      break;
+    case OPT_REPLAY:
+      arg_replay = optarg;
+      break;
+    case OPT_REPLAY_REALTIME:
+      arg_replay_realtime = true;
       break;
     default:
       return -EINVAL;
@@ -300,13 +961,50 @@ static int parseargs(int *argc, char ***argv) {
   *argv += optind;
   *argc -= optind;
 
-  if (!arg_expire && *argc == 0) {
+  if (!arg_expire && !arg_stats && !arg_watch && !arg_files_from &&
+      !arg_recursive && *argc == 0) {
     log_error("error: no files specified (use -h for help)");
     return -EINVAL;
   }
 
   log_set_level(arg_loglevel);
 
+  if (arg_files_from && streq(arg_files_from, "-"))
+    for (int i = 0; i < *argc; ++i)
+      if (streq((*argv)[i], "-")) {
+        log_error("--files-from=- and the target - can't both read stdin");
+        return -EINVAL;
+      }
+
+  if (arg_resume && arg_journal == NULL) {
+    log_error("--resume requires a journal (use --journal)");
+    return -EINVAL;
+  }
+
+  if (arg_loopback && arg_replay) {
+    log_error("--loopback and --replay are mutually exclusive");
+    return -EINVAL;
+  }
+
+  if ((arg_stats || arg_stats_prometheus) && arg_stats_file == NULL) {
+    log_error("no stats file to read (use --stats-file)");
+    return -EINVAL;
+  }
+
+  if (arg_domain_count == 0) {
+    static const char *default_domain = "aur.archlinux.org";
+    arg_domains = &default_domain;
+    arg_domain_count = 1;
+  }
+
+  if (arg_git_url && arg_domain_count > 1) {
+    log_error("--git=URL names a single server (use --git with --domain)");
+    return -EINVAL;
+  }
+
+  if (arg_category_map && read_category_map(arg_category_map) < 0)
+    return -EINVAL;
+
   return 0;
 }
 
@@ -369,14 +1067,17 @@ static char *read_stdin(char *buf, int len, bool echo) {
   return r;
 }
 
-static char *ask_username(void) {
+static char *ask_username(const struct account_t *account) {
   char *username, *r;
 
   username = malloc(128 + 1);
   if (username == NULL)
     return NULL;
 
-  printf("Enter username: ");
+  if (account == &default_account)
+    printf("Enter username: ");
+  else
+    printf("[%s] Enter username: ", account->name);
 
   r = read_stdin(username, 128, true);
   if (r == NULL) {
@@ -387,14 +1088,14 @@ static char *ask_username(void) {
   return username;
 }
 
-static char *ask_password(void) {
+static char *ask_password(const struct account_t *account) {
   char *passwd, *r;
 
   passwd = malloc(128 + 1);
   if (passwd == NULL)
     return NULL;
 
-  printf("[%s] Enter password: ", arg_username);
+  printf("[%s] Enter password: ", account->username);
 
   r = read_stdin(passwd, 128, false);
   if (r == NULL) {
@@ -405,21 +1106,20 @@ static char *ask_password(void) {
   return passwd;
 }
 
-static int login(aur_t *aur) {
+static int login(struct account_t *account, aur_t *aur) {
   int r;
-  _cleanup_free_ char *username = NULL, *password = NULL, *error = NULL;
+  _cleanup_free_ char *password = NULL, *error = NULL;
 
-  if (arg_username == NULL) {
-
-    username = ask_username();
-    if (username == NULL)
+  if (account->username == NULL) {
+    pthread_mutex_lock(&prompt_lock);
+    account->username = ask_username(account);
+    pthread_mutex_unlock(&prompt_lock);
+    if (account->username == NULL)
       return log_login_error(ENOMEM, NULL);
 
-    r = aur_set_username(aur, username);
+    r = aur_set_username(aur, account->username);
     if (r < 0)
       return log_login_error(r, NULL);
-
-    arg_username = username;
   }
 
   r = aur_login(aur, &error);
@@ -430,7 +1130,9 @@ static int login(aur_t *aur) {
       log_warn("Your cookie has expired -- using password login");
     /* fallthrough */
     case -ENOKEY:
-      password = ask_password();
+      pthread_mutex_lock(&prompt_lock);
+      password = ask_password(account);
+      pthread_mutex_unlock(&prompt_lock);
       if (password == NULL)
         return -ENOMEM;
 
@@ -449,68 +1151,1495 @@ static int login(aur_t *aur) {
   return 0;
 }
 
-static int upload(aur_t *aur, char **packages, int package_count) {
-  int r = 0;
+static void target_unref(struct target_t *target) {
+  if (target == NULL || __atomic_sub_fetch(&target->refcount, 1,
+        __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  if (target->built)
+    free(target->data);
+  else if (target->data && target->size)
+    munmap(target->data, target->size);
+  if (target->stream >= 0)
+    close(target->stream);
+  if (target->spool >= 0)
+    close(target->spool);
+  free(target->filename);
+  free(target->version);
+  free(target->pkgbase);
+  free(target->path);
+  free(target);
+}
 
-  for (int i = 0; i < package_count; ++i) {
-    _cleanup_free_ char *error = NULL;
-    int k = aur_upload(aur, packages[i], arg_category, &error);
-    if (k == 0)
-      printf("success: uploaded %s\n", packages[i]);
-    else {
-      log_error("failed to upload %s: %s", packages[i],
-          error ? error : strerror(-k));
-      if (r == 0)
-        r = k;
-    }
+static struct target_t *target_ref(struct target_t *target) {
+  __atomic_add_fetch(&target->refcount, 1, __ATOMIC_RELAXED);
+  return target;
+}
+
+static int target_map_fd(struct target_t *target, int fd) {
+  target->size = target->st.st_size;
+  if (target->size == 0)
+    return 0;
+
+  target->data = mmap(NULL, target->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (target->data == MAP_FAILED) {
+    target->data = NULL;
+    return -errno;
   }
 
+  madvise(target->data, target->size, MADV_SEQUENTIAL);
+
+  log_debug("mapped %s: %zu bytes", target->path, target->size);
+
+  return 0;
+}
+
+static int target_map(struct target_t *target) {
+  int fd, r;
+
+  fd = open(target->path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  r = target_map_fd(target, fd);
+  close(fd);
+
   return r;
 }
 
-static int create_aur_client(aur_t **aur) {
-  int r;
+/* Move up to |len| more bytes of a streamed tarball into its spool, and
+ * return them at |buf|. */
+static ssize_t target_spool_some(struct target_t *target, void *buf,
+    size_t len) {
+  ssize_t n;
+
+  do
+    n = read(target->stream, buf, len);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return n < 0 ? -errno : 0;
+
+  for (ssize_t done = 0; done < n;) {
+    ssize_t k = pwrite(target->spool, (char *)buf + done, n - done,
+        target->spooled + done);
+    if (k < 0 && errno != EINTR)
+      return -errno;
+    if (k > 0)
+      done += k;
+  }
+  target->spooled += n;
 
-  r = aur_new(aur, arg_domain, true);
-  if (r < 0) {
-    log_error("failed to create AUR client: %s", strerror(-r));
-    return r;
+  return n;
+}
+
+/* The read callback of a streamed upload: what was spooled before is sent
+ * again, then the stream is read on. */
+static ssize_t target_stream_read(void *userdata, void *buf, size_t len) {
+  struct target_t *target = userdata;
+  ssize_t n;
+
+  if (target->offset < target->spooled) {
+    if ((off_t)len > target->spooled - target->offset)
+      len = target->spooled - target->offset;
+    n = pread(target->spool, buf, len, target->offset);
+    if (n < 0)
+      return -errno;
+  } else {
+    n = target_spool_some(target, buf, len);
+    if (n < 0)
+      return n;
   }
 
-  if (arg_username)
-    aur_set_username(*aur, arg_username);
-  if (arg_password)
-    aur_set_password(*aur, arg_password);
-  if (arg_cookiefile)
-    aur_set_cookiefile(*aur, arg_cookiefile);
-  if (arg_loglevel >= LOG_DEBUG)
-    aur_set_debug(*aur, true);
+  target->offset += n;
+
+  return n;
+}
+
+/* Read the rest of a streamed tarball into its spool. */
+static int target_drain(struct target_t *target) {
+  char buf[64 * 1024];
+  ssize_t n;
+
+  while ((n = target_spool_some(target, buf, sizeof(buf))) > 0)
+    ;
+  if (n < 0)
+    return n;
+
+  close(target->stream);
+  target->stream = -1;
 
   return 0;
 }
 
-int main(int argc, char *argv[]) {
-  _cleanup_aur_ aur_t *aur = NULL;
+/* Read the rest of a streamed tarball and serve it from memory from now on,
+ * as one whose length is known. */
+static int target_spool(struct target_t *target) {
+  int r;
 
-  if (read_config_file() < 0)
-    return EXIT_FAILURE;
+  if (target->stream < 0)
+    return 0;
 
-  if (parseargs(&argc, &argv) < 0)
-    return EXIT_FAILURE;
+  r = target_drain(target);
+  if (r < 0)
+    return r;
 
-  if (create_aur_client(&aur) < 0)
-    return EXIT_FAILURE;
+  target->st.st_size = target->spooled;
+  r = target_map_fd(target, target->spool);
+  if (r < 0)
+    return r;
 
-  if (arg_expire)
-    return !!aur_logout(aur);
+  close(target->spool);
+  target->spool = -1;
 
-  if (login(aur) < 0)
-    return EXIT_FAILURE;
+  return 0;
+}
 
-  if (upload(aur, argv, argc) < 0)
-    return EXIT_FAILURE;
+/* Spool the head of a streamed tarball, enough to learn its pkgbase. */
+static int target_open_stream(struct target_t *target, int fd) {
+  char buf[64 * 1024];
+  ssize_t n;
+  int r;
+
+  target->stream = fd;
+  target->spool = memfd_create("burp-spool", MFD_CLOEXEC);
+  if (target->spool < 0)
+    return -errno;
+
+  do
+    n = target_spool_some(target, buf, sizeof(buf));
+  while (n > 0 && target->spooled < (off_t)sizeof(buf));
+  if (n < 0)
+    return n;
+
+  r = tarball_read_pkgbase_fd(target->spool, &target->pkgbase);
+  if (r < 0)
+    return r;
+
+  if (asprintf(&target->filename, "%s%s", target->pkgbase,
+        tarball_suffix_fd(target->spool)) < 0) {
+    target->filename = NULL;
+    return -ENOMEM;
+  }
+
+  log_debug("streaming %s as %s", target->path, target->filename);
+
+  return 0;
+}
+
+static int target_build(struct target_t *target) {
+  time_t mtime;
+  int r;
+
+  r = tarball_build(target->path, &target->pkgbase, &target->data,
+      &target->size, &mtime);
+  if (r < 0)
+    return r;
+  target->built = true;
+
+  if (asprintf(&target->filename, "%s.src.tar.gz", target->pkgbase) < 0) {
+    target->filename = NULL;
+    return -ENOMEM;
+  }
+
+  /* the journal and the queue know the tarball, not the directory */
+  target->st.st_size = target->size;
+  target->st.st_mtim.tv_sec = mtime;
+  target->st.st_mtim.tv_nsec = 0;
+
+  log_debug("built %s from %s: %zu bytes", target->filename, target->path,
+      target->size);
+
+  return 0;
+}
+
+static int target_new(struct target_t **ret, const char *path) {
+  struct target_t *target;
+  int r;
+
+  target = calloc(1, sizeof(*target));
+  if (target == NULL)
+    return -ENOMEM;
+  target->refcount = 1;
+  target->stream = target->spool = -1;
+
+  /* stdin redirected from a file is uploaded like any other file */
+  if (streq(path, "-") && fstat(STDIN_FILENO, &target->st) == 0 &&
+      S_ISREG(target->st.st_mode))
+    path = "/dev/stdin";
+
+  target->path = strdup(path);
+  if (target->path == NULL) {
+    target_unref(target);
+    return -ENOMEM;
+  }
+
+  if (streq(path, "-"))
+    r = fstat(STDIN_FILENO, &target->st);
+  else
+    r = stat(path, &target->st);
+  if (r < 0) {
+    r = -errno;
+    target_unref(target);
+    return r;
+  }
+
+  if (S_ISFIFO(target->st.st_mode) || S_ISSOCK(target->st.st_mode) ||
+      S_ISCHR(target->st.st_mode)) {
+    int fd;
+
+    if (streq(path, "-"))
+      fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    else
+      fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+    if (fd < 0) {
+      r = -errno;
+      target_unref(target);
+      return r;
+    }
+
+    r = target_open_stream(target, fd);
+    if (r < 0) {
+      target_unref(target);
+      return r;
+    }
+  } else if (S_ISDIR(target->st.st_mode)) {
+    r = target_build(target);
+    if (r < 0) {
+      target_unref(target);
+      return r;
+    }
+  } else if (!S_ISREG(target->st.st_mode)) {
+    target_unref(target);
+    return -EINVAL;
+  }
+
+  *ret = target;
+
+  return 0;
+}
+
+/* The pkgbase and version from the .SRCINFO, which tarballs made before
+ * makepkg wrote one lack. */
+static void target_read_info(struct target_t *target,
+    const struct tarball_head_t *head) {
+  struct tarball_info_t info;
+  int r;
+
+  r = tarball_head_info(head, &info);
+  if (r < 0) {
+    log_debug("unable to read .SRCINFO from %s: %s", target->path,
+        strerror(-r));
+    return;
+  }
+
+  log_debug("%s holds %s %s", target->path, info.pkgbase, info.version);
+
+  if (target->pkgbase == NULL) {
+    target->pkgbase = info.pkgbase;
+    info.pkgbase = NULL;
+  }
+  target->version = info.version;
+  info.version = NULL;
+
+  tarball_info_free(&info);
+}
+
+/* The more expensive part of setting up a target, deferred until we know
+ * that it needs to be uploaded at all. */
+static int target_prepare(struct target_t *target) {
+  struct tarball_head_t head;
+  int r;
+
+  /* a streamed tarball's files are found if they were spooled already */
+  if (target->spool >= 0)
+    r = tarball_read_head_fd(target->spool, &head);
+  else
+    r = tarball_read_head(target->path, &head);
+  if (r < 0)
+    log_debug("unable to read %s: %s", target->path, strerror(-r));
+
+  target_read_info(target, &head);
+
+  /* pushes go to the pkgbase's own repository */
+  if ((account_map_len > 0 || arg_git) && target->pkgbase == NULL) {
+    if (head.dirname) {
+      target->pkgbase = head.dirname;
+      head.dirname = NULL;
+    } else
+      log_warn("unable to determine pkgbase of %s", target->path);
+  }
+
+  target->category = package_category(target->path, head.pkgbuild);
+  tarball_head_free(&head);
+
+  /* git needs all of the files, and reads them from the spool */
+  if (arg_git && target->stream >= 0)
+    return target_drain(target);
+
+  /* every endpoint gets the same copy, so a stream is read in full now */
+  if (arg_domain_count > 1 && target->stream >= 0)
+    return target_spool(target);
+  if (arg_domain_count > 1 && !target->built)
+    return target_map(target);
+
+  return 0;
+}
+
+/* Smaller tarballs go first, so that short uploads aren't stuck behind a
+ * huge one. */
+static int target_compare(const void *a, const void *b) {
+  const struct target_t *left = a, *right = b;
+
+  if (left->st.st_size != right->st.st_size)
+    return left->st.st_size < right->st.st_size ? -1 : 1;
+
+  return 0;
+}
+
+static bool target_is_done(const struct target_t *target, size_t domain) {
+  return arg_resume &&
+      journal_contains(journal, arg_domains[domain], target->path, &target->st);
+}
+
+/* Start reading a tarball which is uploaded from its path into the page
+ * cache, in the background, and return a descriptor keeping it open until
+ * the upload is done, or -1. */
+static int target_prefetch(const struct target_t *target) {
+  int fd;
+
+  if (target->data || target->built || target->stream >= 0 ||
+      target->spool >= 0)
+    return -1;
+
+  fd = open(target->path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+  if (fd < 0)
+    return -1;
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+  return fd;
+}
+
+static void print_success(const struct account_t *account,
+    const struct target_t *target) {
+  const char *to = arg_domain_count > 1 ? " to " : "";
+  const char *domain = arg_domain_count > 1 ? account->domain : "";
+
+  if (progress)
+    progress_printf(progress, stdout, "success: uploaded %s%s%s\n",
+        target->path, to, domain);
+  else
+    printf("success: uploaded %s%s%s\n", target->path, to, domain);
+}
+
+static int create_aur_client(struct account_t *account, aur_t **aur,
+    bool with_cookies) {
+  int r;
+
+  r = aur_new(aur, account->domain, true);
+  if (r < 0) {
+    log_error("failed to create AUR client: %s", strerror(-r));
+    return r;
+  }
+
+  if (account->username)
+    aur_set_username(*aur, account->username);
+  if (account->password)
+    aur_set_password(*aur, account->password);
+  if (account->cookiefile && with_cookies)
+    aur_set_cookiefile(*aur, account->cookiefile);
+  if (arg_loglevel >= LOG_DEBUG)
+    aur_set_debug(*aur, true);
+  if (ratelimit)
+    aur_set_ratelimit(*aur, ratelimit);
+  if (stats)
+    aur_set_stats(*aur, stats);
+  if (recorder || transport)
+    aur_set_transport(*aur, recorder ? recorder : transport);
+
+  return 0;
+}
+
+/* The first worker of an account logs in. Workers started later wait for it
+ * and adopt its session with a client of their own, which never touches the
+ * account's cookie file. |generation| is set to that of the session. */
+static int worker_login(struct account_t *account, aur_t **aur,
+    unsigned *generation) {
+  _cleanup_free_ char *session = NULL;
+  bool first;
+  int r = 0;
+
+  pthread_mutex_lock(&account->lock);
+  first = account->session_state == SESSION_NONE;
+  if (first)
+    account->session_state = SESSION_PENDING;
+  while (!first && account->session_state == SESSION_PENDING)
+    pthread_cond_wait(&account->cond, &account->lock);
+
+  /* a relogin replaces the session, so take a copy while it can't */
+  if (!first) {
+    if (account->session_state != SESSION_READY)
+      r = -ENOKEY;
+    else {
+      session = strdup(account->session);
+      if (session == NULL)
+        r = -ENOMEM;
+      *generation = account->session_generation;
+    }
+  }
+  pthread_mutex_unlock(&account->lock);
+
+  if (first) {
+    r = create_aur_client(account, aur, true);
+    if (r == 0)
+      r = login(account, *aur);
+
+    pthread_mutex_lock(&account->lock);
+    if (r == 0) {
+      account->session = strdup(aur_get_session(*aur));
+      if (account->session == NULL)
+        r = -ENOMEM;
+    }
+    account->session_state = r == 0 ? SESSION_READY : SESSION_FAILED;
+    *generation = ++account->session_generation;
+    if (r < 0)
+      account->result = r;
+    pthread_cond_broadcast(&account->cond);
+    pthread_mutex_unlock(&account->lock);
+
+    return r;
+  }
+
+  if (r < 0)
+    return r;
+
+  r = create_aur_client(account, aur, false);
+  if (r < 0)
+    return r;
+
+  return aur_set_session(*aur, session);
+}
+
+/* The session of |aur|, of |generation|, has expired. The first worker to
+ * notice logs in again, with its own client; the others wait for it and
+ * adopt the new session, as does a worker which noticed too late. */
+static int worker_relogin(struct account_t *account, aur_t *aur,
+    unsigned *generation) {
+  char *session = NULL;
+  int r;
+
+  pthread_mutex_lock(&account->lock);
+  if (account->session_state == SESSION_READY &&
+      account->session_generation == *generation) {
+    account->session_state = SESSION_PENDING;
+    pthread_mutex_unlock(&account->lock);
+
+    log_info("session of account %s on %s has expired, logging in again",
+        account->name, account->domain);
+    r = login(account, aur);
+    if (r == 0) {
+      session = strdup(aur_get_session(aur));
+      if (session == NULL)
+        r = -ENOMEM;
+    }
+
+    pthread_mutex_lock(&account->lock);
+    if (r == 0) {
+      free(account->session);
+      account->session = session;
+    }
+    account->session_state = r == 0 ? SESSION_READY : SESSION_FAILED;
+    *generation = ++account->session_generation;
+    pthread_cond_broadcast(&account->cond);
+    pthread_mutex_unlock(&account->lock);
+
+    return r;
+  }
+
+  while (account->session_state == SESSION_PENDING)
+    pthread_cond_wait(&account->cond, &account->lock);
+
+  if (account->session_state == SESSION_READY) {
+    r = aur_set_session(aur, account->session);
+    *generation = account->session_generation;
+  } else
+    r = -ENOKEY;
+  pthread_mutex_unlock(&account->lock);
+
+  return r;
+}
+
+static int upload_target(struct account_t *account, aur_t *aur,
+    unsigned *generation, progress_slot_t *slot, struct target_t *target) {
+  _cleanup_free_ char *error = NULL;
+  int r;
+
+  for (int attempt = 0;; ++attempt) {
+    double start;
+
+    free(error);
+    error = NULL;
+
+    {
+      trace_span(span, "throttle wait", account->domain);
+      throttle_acquire(account->throttle);
+    }
+    start = now_monotonic();
+    if (slot)
+      progress_begin(slot, target->path, target->stream >= 0 ?
+          PROGRESS_SIZE_UNKNOWN : (uint64_t)target->st.st_size);
+
+    if (account->git) {
+      r = git_push(account->git, target->pkgbase, target->version,
+          target->path, target->spool, &error);
+    } else if (target->stream >= 0) {
+      target->offset = 0;
+      r = aur_upload_stream(aur, target->filename, target_stream_read,
+          target, target->category, &error);
+
+      /* the stream can't be rewound; keep all of it for another attempt */
+      if (r < 0) {
+        int k = target_spool(target);
+        if (k < 0) {
+          log_error("failed to read %s: %s", target->path, strerror(-k));
+          r = k;
+        }
+      }
+    } else if (target->data || target->size) {
+      const char *filename = strrchr(target->path, '/');
+
+      if (target->filename)
+        filename = target->filename;
+      else
+        filename = filename ? filename + 1 : target->path;
+
+      r = aur_upload_buffer(aur, filename, target->data, target->size,
+          target->category, &error);
+    } else
+      r = aur_upload(aur, target->path, target->category, &error);
+
+    /* the server's answer, not the transfer, says how busy it is; a push
+     * has nothing but its duration to go by */
+    throttle_release(account->throttle,
+        aur ? aur_get_response_time(aur) : now_monotonic() - start,
+        r == -EAGAIN, aur ? aur_get_retry_after(aur) : 0);
+
+    if (r == -EMSGSIZE && target->stream < 0 && attempt < MAX_RETRIES) {
+      log_info("server wants to know the length of %s, uploading it again",
+          target->path);
+      continue;
+    }
+
+    /* a long running batch may outlive its session */
+    if (r == -EKEYEXPIRED && attempt < MAX_RETRIES) {
+      int k = worker_relogin(account, aur, generation);
+      if (k == 0)
+        continue;
+      r = k;
+    }
+
+    if (r != -EAGAIN || attempt == MAX_RETRIES)
+      break;
+
+    log_info("server is busy, retrying upload of %s", target->path);
+  }
+
+  if (slot)
+    progress_end(slot, r == 0);
+
+  if (r < 0) {
+    if (arg_domain_count > 1)
+      log_error("failed to upload %s to %s: %s", target->path,
+          account->domain, error ? error : strerror(-r));
+    else
+      log_error("failed to upload %s: %s", target->path,
+          error ? error : strerror(-r));
+    return r;
+  }
+
+  print_success(account, target);
+
+  return 0;
+}
+
+/* Each account gets its own pool of workers, so that logins and uploads for
+ * different accounts and domains proceed concurrently. How many uploads are
+ * actually in flight is decided by the domain's throttle. */
+static void *account_worker(void *arg) {
+  struct account_t *account = arg;
+  struct target_t *target;
+  progress_slot_t *slot = NULL;
+  aur_t *aur = NULL;
+  unsigned generation = 0;
+  bool logged_in;
+
+  trace_span(span, "worker", account->name);
+
+  /* git authenticates every push itself */
+  logged_in = account->git || worker_login(account, &aur, &generation) == 0;
+
+  if (progress && logged_in) {
+    slot = progress_slot_new(progress);
+    if (slot && aur)
+      aur_set_progress(aur, slot);
+  }
+
+  while ((target = queue_pop(account->queue)) != NULL) {
+    int prefetch, r;
+
+    if (!logged_in) {
+      log_error("not uploading %s: login for account %s on %s failed",
+          target->path, account->name, account->domain);
+      if (progress)
+        progress_drop(progress, target->st.st_size);
+      pthread_mutex_lock(&account->lock);
+      ++account->failed;
+      pthread_mutex_unlock(&account->lock);
+      target_unref(target);
+      continue;
+    }
+
+    /* upload_target waits for its turn first: while the throttle allows a
+     * single upload, that's for as long as the previous one is in flight */
+    prefetch = target_prefetch(target);
+    r = upload_target(account, aur, &generation, slot, target);
+    if (prefetch >= 0)
+      close(prefetch);
+    if (journal) {
+      int k = journal_record(journal, account->domain, target->path,
+          &target->st, r == 0);
+      if (k < 0)
+        log_warn("failed to write journal record for %s: %s", target->path,
+            strerror(-k));
+    }
+
+    pthread_mutex_lock(&account->lock);
+    if (r < 0) {
+      ++account->failed;
+      if (account->result == 0)
+        account->result = r;
+    } else
+      ++account->uploaded;
+    pthread_mutex_unlock(&account->lock);
+
+    target_unref(target);
+  }
+
+  aur_free(aur);
+
+  return NULL;
+}
+
+static int account_enqueue(struct account_t *account, struct target_t *target) {
+  int r;
+
+  if (account->queue == NULL) {
+    r = queue_new(&account->queue, target_compare);
+    if (r < 0)
+      return r;
+  }
+
+  /* grow the pool while there is a backlog for the new worker to take */
+  if (account->worker_count < MAX_WORKERS &&
+      account->queued >= account->worker_count) {
+    r = -pthread_create(&account->workers[account->worker_count], NULL,
+        account_worker, account);
+    if (r < 0 && account->worker_count == 0)
+      return r;
+    if (r == 0)
+      ++account->worker_count;
+  }
+
+  r = queue_push(account->queue, target_ref(target));
+  if (r < 0) {
+    target_unref(target);
+    return r;
+  }
+
+  ++account->queued;
+  if (progress)
+    progress_add(progress, target->st.st_size);
+
+  return 0;
+}
+
+static int account_finish(struct account_t *account) {
+  if (account->queue == NULL)
+    return 0;
+
+  queue_close(account->queue);
+  for (unsigned i = 0; i < account->worker_count; ++i)
+    pthread_join(account->workers[i], NULL);
+
+  queue_free(account->queue);
+  account->queue = NULL;
+  account->worker_count = 0;
+
+  return account->result;
+}
+
+static void print_domain_summary(void) {
+  for (size_t d = 0; d < arg_domain_count; ++d) {
+    unsigned uploaded = 0, failed = 0;
+
+    if (streq(default_account.domain, arg_domains[d])) {
+      uploaded += default_account.uploaded;
+      failed += default_account.failed;
+    }
+
+    for (size_t i = 0; i < account_count; ++i)
+      if (streq(accounts[i]->domain, arg_domains[d])) {
+        uploaded += accounts[i]->uploaded;
+        failed += accounts[i]->failed;
+      }
+
+    printf("%s: %u uploaded, %u failed\n", arg_domains[d], uploaded, failed);
+  }
+}
+
+static int lookup_package(void *userdata, const struct aur_package_t *package) {
+  struct lookup_t *lookup = userdata;
+
+  for (size_t i = 0; i < lookup->count; ++i) {
+    const struct target_t *target = lookup->targets[i];
+
+    if (target->pkgbase && target->version &&
+        streq(target->pkgbase, package->pkgbase) &&
+        streq(target->version, package->version))
+      lookup->live[i] = true;
+  }
+
+  return 0;
+}
+
+/* Ask |domain| which of the targets it already has, with one query for the
+ * whole batch. Targets without a .SRCINFO can't be matched and are always
+ * uploaded, as is everything if the lookup fails. */
+static void lookup_targets(struct lookup_t *lookup, size_t domain) {
+  _cleanup_free_ const char **names = NULL;
+  _cleanup_free_ char *error = NULL;
+  size_t count = 0;
+  int r;
+
+  trace_span(span, "lookup", arg_domains[domain]);
+
+  memset(lookup->live, 0, sizeof(lookup->live));
+  if (arg_force)
+    return;
+
+  names = malloc(lookup->count * sizeof(*names));
+  if (names == NULL)
+    return;
+
+  for (size_t i = 0; i < lookup->count; ++i) {
+    const struct target_t *target = lookup->targets[i];
+
+    if (target->pkgbase && target->version && !target_is_done(target, domain))
+      names[count++] = target->pkgbase;
+  }
+  if (count == 0)
+    return;
+
+  if (lookup_clients == NULL) {
+    lookup_clients = calloc(arg_domain_count, sizeof(*lookup_clients));
+    if (lookup_clients == NULL)
+      return;
+  }
+
+  /* the info query needs no login, so no account's cookies are touched */
+  if (lookup_clients[domain] == NULL &&
+      create_aur_client(domain_accounts[domain], &lookup_clients[domain],
+        false) < 0)
+    return;
+
+  r = aur_info(lookup_clients[domain], names, count, lookup_package, lookup,
+      &error);
+  if (r < 0) {
+    log_warn("unable to look up packages on %s: %s", arg_domains[domain],
+        error ? error : strerror(-r));
+    memset(lookup->live, 0, sizeof(lookup->live));
+  }
+}
+
+static void free_lookup_clients(void) {
+  if (lookup_clients == NULL)
+    return;
+
+  for (size_t d = 0; d < arg_domain_count; ++d)
+    aur_free(lookup_clients[d]);
+  free(lookup_clients);
+  lookup_clients = NULL;
+}
+
+/* Queue a batch of prepared targets for every domain which needs them, and
+ * drop the batch's references. */
+static int queue_targets(struct lookup_t *lookup) {
+  int r = 0, k;
+
+  for (size_t d = 0; d < arg_domain_count; ++d) {
+    lookup_targets(lookup, d);
+
+    for (size_t i = 0; i < lookup->count; ++i) {
+      struct target_t *target = lookup->targets[i];
+      struct account_t *account;
+
+      if (target_is_done(target, d)) {
+        log_info("skipping %s on %s: already uploaded", target->path,
+            arg_domains[d]);
+        continue;
+      }
+
+      if (lookup->live[i]) {
+        log_warn("skipping %s: %s %s is already on %s (use --force)",
+            target->path, target->pkgbase, target->version, arg_domains[d]);
+        continue;
+      }
+
+      account = package_account(target, d);
+
+      log_debug("queueing %s for account %s on %s", target->path,
+          account->name, account->domain);
+
+      k = account_enqueue(account, target);
+      if (k < 0) {
+        log_error("failed to queue %s: %s", target->path, strerror(-k));
+        if (r == 0)
+          r = k;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < lookup->count; ++i)
+    target_unref(lookup->targets[i]);
+  lookup->count = 0;
+
+  return r;
+}
+
+/* Read the target at |path| into |ret|, which stays NULL if every domain
+ * has it already. */
+static int read_target(const char *path, struct target_t **ret) {
+  struct target_t *target = NULL;
+  size_t done = 0;
+  int r;
+
+  r = target_new(&target, path);
+  if (r < 0) {
+    log_error("failed to read %s: %s", path, strerror(-r));
+    return r;
+  }
+
+  for (size_t d = 0; d < arg_domain_count; ++d)
+    if (target_is_done(target, d))
+      ++done;
+
+  if (done == arg_domain_count) {
+    log_info("skipping %s: already uploaded", target->path);
+    target_unref(target);
+    return 0;
+  }
+
+  r = target_prepare(target);
+  if (r < 0) {
+    log_error("failed to read %s: %s", target->path, strerror(-r));
+    target_unref(target);
+    return r;
+  }
+
+  *ret = target;
+
+  return 0;
+}
+
+struct prepare_t {
+  const struct lookup_t *lookup;
+  struct target_t *targets[LOOKUP_BATCH];
+  int results[LOOKUP_BATCH];
+  size_t next;
+};
+
+static void *prepare_worker(void *userdata) {
+  struct prepare_t *prepare = userdata;
+  size_t i;
+
+  while ((i = __atomic_fetch_add(&prepare->next, 1, __ATOMIC_RELAXED)) <
+      prepare->lookup->path_count)
+    prepare->results[i] = read_target(prepare->lookup->paths[i],
+        &prepare->targets[i]);
+
+  return NULL;
+}
+
+/* Read the paths waiting in |lookup| into targets. Their files are first
+ * pulled into the page cache all at once, and then parsed, and mapped for
+ * several domains, by a few threads, rather than one file after another.
+ * The read ahead hands nothing on: each target opens and reads its file as
+ * it would on its own, only without waiting for the storage. The targets
+ * keep the order of their paths. */
+static int read_targets(struct lookup_t *lookup) {
+  struct prepare_t prepare = { .lookup = lookup };
+  pthread_t threads[PREPARE_WORKERS];
+  size_t thread_count = 0;
+  int r = 0;
+
+  if (lookup->path_count == 0)
+    return 0;
+
+  if (lookup->path_count > 1) {
+    trace_span(span, "ingest", NULL);
+
+    /* a copy for every domain, or a push, reads the whole file; without the
+     * read ahead, the targets are merely read more slowly */
+    r = ingest_files((const char *const *)lookup->paths, lookup->path_count,
+        arg_domain_count > 1 || arg_git ? SIZE_MAX : INGEST_HEAD);
+    if (r < 0) {
+      log_warn("failed to read ahead: %s", strerror(-r));
+      r = 0;
+    }
+  }
+
+  {
+    trace_span(span, "prepare", NULL);
+
+    while (thread_count < PREPARE_WORKERS &&
+        thread_count + 1 < lookup->path_count &&
+        pthread_create(&threads[thread_count], NULL, prepare_worker,
+            &prepare) == 0)
+      ++thread_count;
+
+    prepare_worker(&prepare);
+
+    for (size_t t = 0; t < thread_count; ++t)
+      pthread_join(threads[t], NULL);
+  }
+
+  for (size_t i = 0; i < lookup->path_count; ++i) {
+    if (prepare.results[i] < 0 && r == 0)
+      r = prepare.results[i];
+    if (prepare.targets[i])
+      lookup->targets[lookup->count++] = prepare.targets[i];
+  }
+
+  for (size_t i = 0; i < lookup->path_count; ++i)
+    free(lookup->paths[i]);
+  lookup->path_count = 0;
+
+  return r;
+}
+
+/* Read the waiting paths and queue their targets. */
+static int flush_targets(struct lookup_t *lookup) {
+  int r, k;
+
+  r = read_targets(lookup);
+  k = queue_targets(lookup);
+  if (r == 0)
+    r = k;
+
+  return r;
+}
+
+/* Whether the first path of the batch has waited for LOOKUP_LINGER. */
+static bool batch_lingered(struct lookup_t *lookup) {
+  return lookup->path_count > 0 &&
+      now_monotonic() - lookup->first_added >= LOOKUP_LINGER;
+}
+
+/* Add |path| to the batch, which is read and queued once full, or once its
+ * first path has waited for LOOKUP_LINGER. */
+static int add_target(struct lookup_t *lookup, const char *path) {
+  char *copy;
+
+  copy = strdup(path);
+  if (copy == NULL)
+    return -ENOMEM;
+
+  if (lookup->path_count == 0)
+    lookup->first_added = now_monotonic();
+
+  lookup->paths[lookup->path_count++] = copy;
+  if (lookup->path_count == LOOKUP_BATCH || batch_lingered(lookup))
+    return flush_targets(lookup);
+
+  return 0;
+}
+
+struct listing_t {
+  struct lookup_t *lookup;
+  int fd;
+  int result;
+};
+
+/* Refills stdio's buffer of the arg_files_from list. When the writer of the
+ * list falls silent, the paths read so far are queued rather than left
+ * waiting for the batch to fill. */
+static ssize_t listing_read(void *cookie, char *buf, size_t size) {
+  struct listing_t *listing = cookie;
+  struct lookup_t *lookup = listing->lookup;
+  ssize_t n;
+
+  if (lookup->path_count > 0) {
+    struct pollfd pfd = { .fd = listing->fd, .events = POLLIN };
+    double wait = lookup->first_added + LOOKUP_LINGER - now_monotonic();
+
+    if (poll(&pfd, 1, wait > 0 ? (int)(wait * 1000) : 0) == 0) {
+      int r = flush_targets(lookup);
+      if (listing->result == 0)
+        listing->result = r;
+    }
+  }
+
+  do
+    n = read(listing->fd, buf, size);
+  while (n < 0 && errno == EINTR);
+
+  return n;
+}
+
+static int listing_close(void *cookie) {
+  struct listing_t *listing = cookie;
+
+  return listing->fd == STDIN_FILENO ? 0 : close(listing->fd);
+}
+
+/* Add the targets listed in arg_files_from, one line at a time, so that
+ * uploads start while the list is still being read. */
+static int add_listed_targets(struct lookup_t *lookup) {
+  static const cookie_io_functions_t io = {
+    .read = listing_read,
+    .close = listing_close,
+  };
+  _cleanup_free_ char *line = NULL;
+  struct listing_t listing = { lookup, STDIN_FILENO, 0 };
+  FILE *fp;
+  size_t alloc = 0;
+  ssize_t len;
+  int r = 0, k;
+
+  if (!streq(arg_files_from, "-")) {
+    listing.fd = open(arg_files_from, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+    if (listing.fd < 0) {
+      r = -errno;
+      log_error("failed to open %s: %s", arg_files_from, strerror(-r));
+      return r;
+    }
+  }
+
+  fp = fopencookie(&listing, "r", io);
+  if (fp == NULL) {
+    r = -errno;
+    listing_close(&listing);
+    log_error("failed to open %s: %s", arg_files_from, strerror(-r));
+    return r;
+  }
+
+  while ((len = getdelim(&line, &alloc, arg_null ? '\0' : '\n', fp)) > 0) {
+    if (line[len - 1] == (arg_null ? '\0' : '\n'))
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+
+    k = add_target(lookup, line);
+    if (r == 0)
+      r = k;
+  }
+
+  /* getdelim fails at the end of the list too, and for want of memory
+   * without marking the stream */
+  if (ferror(fp) || !feof(fp)) {
+    k = errno ? -errno : -EIO;
+    log_error("failed to read %s: %s", arg_files_from, strerror(-k));
+    if (r == 0)
+      r = k;
+  }
+
+  fclose(fp);
+
+  if (r == 0)
+    r = listing.result;
+
+  return r;
+}
+
+struct found_t {
+  struct lookup_t *lookup;
+  int result;
+};
+
+/* Called for each tarball found, and between batches of directory entries,
+ * which is when a batch that stopped growing is queued. */
+static int add_found_target(void *userdata, const char *path) {
+  struct found_t *found = userdata;
+  int r = 0;
+
+  if (path)
+    r = add_target(found->lookup, path);
+  else if (batch_lingered(found->lookup))
+    r = flush_targets(found->lookup);
+  if (found->result == 0)
+    found->result = r;
+
+  return 0;
+}
+
+/* Add the source tarballs below arg_recursive, batch by batch while the
+ * walk goes on. */
+static int add_found_targets(struct lookup_t *lookup) {
+  struct found_t found = { lookup, 0 };
+  int r;
+
+  trace_span(span, "walk", arg_recursive);
+
+  r = walk_tree(arg_recursive, add_found_target, &found);
+  if (r < 0) {
+    log_error("failed to search %s: %s", arg_recursive, strerror(-r));
+    return r;
+  }
+
+  return found.result;
+}
+
+/* Queue the tarballs appearing in arg_watch as they settle, until SIGINT or
+ * SIGTERM. The workers, and with them the sessions, live on in between. */
+static int watch_targets(struct lookup_t *lookup, int signal_fd) {
+  _cleanup_(watch_freep) watch_t *watch = NULL;
+  int r = 0, k;
+
+  k = watch_new(&watch, arg_watch);
+  if (k < 0) {
+    log_error("failed to watch %s: %s", arg_watch, strerror(-k));
+    return k;
+  }
+
+  log_info("watching %s for source tarballs", arg_watch);
+
+  for (;;) {
+    _cleanup_free_ char *path = NULL;
+
+    k = watch_next(watch, signal_fd, &path);
+    if (k <= 0)
+      break;
+
+    /* a failed tarball doesn't end the watch, but the exit status */
+    k = add_target(lookup, path);
+    if (r == 0)
+      r = k;
+    k = flush_targets(lookup);
+    if (r == 0)
+      r = k;
+  }
+
+  if (k < 0) {
+    log_error("failed to watch %s: %s", arg_watch, strerror(-k));
+    return k;
+  }
+
+  log_info("stopped watching %s", arg_watch);
+
+  return r;
+}
+
+/* In watch mode, SIGINT and SIGTERM end the watch rather than burp: they are
+ * blocked in every thread, which is why this runs before any is started, and
+ * read from the returned signalfd. */
+static int block_signals(void) {
+  sigset_t mask;
+  int fd;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+
+  fd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+    close(fd);
+    return -EINVAL;
+  }
+
+  return fd;
+}
+
+static int upload(char **packages, int package_count) {
+  struct lookup_t lookup = { .count = 0 };
+  int r = 0, k, signal_fd = -1;
+
+  trace_span(span, "batch", NULL);
+
+  if (arg_watch) {
+    signal_fd = block_signals();
+    if (signal_fd < 0) {
+      log_error("failed to set up signal handling: %s", strerror(-signal_fd));
+      return signal_fd;
+    }
+  }
+
+  for (int i = 0; i < package_count; ++i) {
+    k = add_target(&lookup, packages[i]);
+    if (r == 0)
+      r = k;
+  }
+
+  if (arg_files_from) {
+    k = add_listed_targets(&lookup);
+    if (r == 0)
+      r = k;
+  }
+
+  if (arg_recursive) {
+    k = add_found_targets(&lookup);
+    if (r == 0)
+      r = k;
+  }
+
+  k = flush_targets(&lookup);
+  if (r == 0)
+    r = k;
+
+  if (arg_watch) {
+    k = watch_targets(&lookup, signal_fd);
+    if (r == 0)
+      r = k;
+    close(signal_fd);
+  }
+
+  free_lookup_clients();
+
+  k = account_finish(&default_account);
+  if (r == 0)
+    r = k;
+
+  for (size_t i = 0; i < account_count; ++i) {
+    k = account_finish(accounts[i]);
+    if (r == 0)
+      r = k;
+  }
+
+  return r;
+}
+
+static int expire(void) {
+  int r = 0;
+
+  trace_span(span, "expire", NULL);
+
+  for (size_t d = 0; d < arg_domain_count; ++d) {
+    struct account_t *account = domain_accounts[d];
+    aur_t *aur = NULL;
+    int k;
+
+    k = create_aur_client(account, &aur, true);
+    if (k == 0) {
+      k = aur_logout(aur);
+      aur_free(aur);
+    }
+
+    if (r == 0)
+      r = k;
+  }
+
+  return r;
+}
+
+/* One git_t per domain, shared by its accounts like the throttle. */
+static int setup_git(void) {
+  int r;
+
+  domain_gits = calloc(arg_domain_count, sizeof(*domain_gits));
+  if (domain_gits == NULL)
+    return -ENOMEM;
+
+  for (size_t d = 0; d < arg_domain_count; ++d) {
+    _cleanup_free_ char *url = NULL;
+
+    /* the port of the domain is that of the web interface, not of SSH */
+    if (arg_git_url == NULL) {
+      if (asprintf(&url, "ssh://aur@%.*s/%%s.git",
+            (int)strcspn(arg_domains[d], ":"), arg_domains[d]) < 0) {
+        url = NULL;
+        return -ENOMEM;
+      }
+    }
+
+    r = git_new(&domain_gits[d], url ? url : arg_git_url);
+    if (r < 0)
+      return r;
+
+    if (streq(default_account.domain, arg_domains[d]) &&
+        default_account.git == NULL)
+      default_account.git = domain_gits[d];
+    for (size_t i = 0; i < account_count; ++i)
+      if (streq(accounts[i]->domain, arg_domains[d]) &&
+          accounts[i]->git == NULL)
+        accounts[i]->git = domain_gits[d];
+  }
+
+  return 0;
+}
+
+static void free_git(void) {
+  if (domain_gits == NULL)
+    return;
+
+  for (size_t d = 0; d < arg_domain_count; ++d)
+    git_free(domain_gits[d]);
+  free(domain_gits);
+  domain_gits = NULL;
+}
+
+static int setup_transport(void) {
+  int r;
+
+  if (arg_loopback) {
+    r = loopback_new(&transport);
+    if (r < 0) {
+      log_error("failed to set up loopback transport: %s", strerror(-r));
+      return r;
+    }
+  } else if (arg_replay) {
+    r = replay_new(&transport, arg_replay, arg_replay_realtime);
+    if (r < 0) {
+      log_error("failed to load recording from %s: %s", arg_replay,
+          strerror(-r));
+      return r;
+    }
+  }
+
+  if (arg_record) {
+    r = record_new(&recorder, transport ? transport : transport_curl(),
+        arg_record);
+    if (r < 0) {
+      log_error("failed to record to %s: %s", arg_record, strerror(-r));
+      return r;
+    }
+  }
+
+  return 0;
+}
+
+static void export_stats(void) {
+  int r;
+
+  if (stats == NULL || arg_stats_prometheus == NULL)
+    return;
+
+  r = stats_export_prometheus(stats, arg_stats_prometheus);
+  if (r < 0)
+    log_warn("failed to export stats to %s: %s", arg_stats_prometheus,
+        strerror(-r));
+}
+
+int main(int argc, char *argv[]) {
+  double config_start, config_end;
+  int r, ret = EXIT_FAILURE;
+
+  /* the config file is read before we know whether to trace */
+  config_start = trace_now();
+  if (read_config_file() < 0)
+    return EXIT_FAILURE;
+  config_end = trace_now();
+
+  if (parseargs(&argc, &argv) < 0)
+    return EXIT_FAILURE;
+
+  if (arg_trace) {
+    r = trace_open(arg_trace);
+    if (r < 0) {
+      log_error("failed to open trace file %s: %s", arg_trace, strerror(-r));
+      return EXIT_FAILURE;
+    }
+    trace_complete("read config", NULL, config_start, config_end);
+  }
+
+  /* from here on, every exit goes through the cleanup at the end, which
+   * also completes the trace */
+  if (setup_domain_accounts() < 0) {
+    log_error("failed to allocate memory");
+    goto out;
+  }
+
+  if (arg_stats_file) {
+    r = stats_open(&stats, arg_stats_file);
+    if (r < 0) {
+      log_error("failed to open stats file %s: %s", arg_stats_file,
+          strerror(-r));
+      goto out;
+    }
+  }
+
+  if (arg_stats) {
+    stats_report(stats, stdout);
+    export_stats();
+    ret = EXIT_SUCCESS;
+    goto out;
+  }
+
+  if (setup_transport() < 0)
+    goto out;
+
+  if (arg_expire) {
+    r = expire();
+    export_stats();
+    ret = !!r;
+    goto out;
+  }
+
+  if (arg_limit_rate) {
+    r = ratelimit_new(&ratelimit, arg_limit_rate);
+    if (r < 0) {
+      log_error("failed to set up rate limit: %s", strerror(-r));
+      goto out;
+    }
+  }
+
+  if (arg_journal) {
+    r = journal_open(&journal, arg_journal, arg_resume);
+    if (r < 0) {
+      log_error("failed to open journal %s: %s", arg_journal, strerror(-r));
+      goto out;
+    }
+  }
+
+  if (arg_git) {
+    r = setup_git();
+    if (r < 0) {
+      log_error("failed to set up git: %s", strerror(-r));
+      goto out;
+    }
+  }
+
+  if (arg_progress) {
+    r = progress_new(&progress, stderr);
+    if (r < 0) {
+      log_error("failed to set up progress display: %s", strerror(-r));
+      goto out;
+    }
+    log_set_progress(progress);
+  }
+
+  r = upload(argv, argc);
+
+  log_set_progress(NULL);
+  progress_free(progress);
+
+  if (arg_domain_count > 1)
+    print_domain_summary();
+
+  export_stats();
+  ret = r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+out:
+  free_git();
+  stats_close(stats);
+  journal_close(journal);
+  ratelimit_free(ratelimit);
+  transport_free(recorder);
+  transport_free(transport);
+  trace_close();
 
-  return EXIT_SUCCESS;
+  return ret;
 }
 
 /* vim: set et ts=2 sw=2: */
@@ -0,0 +1,525 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "git.h"
+#include "log.h"
+#include "parse.h"
+#include "tarball.h"
+#include "trace.h"
+#include "util.h"
+
+struct git_t {
+  /* the repository URL, with %s for the pkgbase */
+  char *url;
+  /* "Name <email>" of the commits we make */
+  char *committer;
+
+  /* the environment git runs in, and the directory of the SSH control
+   * sockets it shares, if we set up SSH */
+  char **envp;
+  char *ssh_command;
+  char *control_dir;
+
+  /* The first push connects alone, so that the control master is up by the
+   * time the others start. Protected by the lock. */
+  pthread_mutex_t lock;
+  bool connected;
+};
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+    struct FTW *ftw) {
+  (void)st;
+  (void)flag;
+  (void)ftw;
+
+  remove(path);
+
+  return 0;
+}
+
+static void remove_tree(char **path) {
+  if (*path == NULL)
+    return;
+
+  nftw(*path, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+  free(*path);
+}
+#define _cleanup_tree_ _cleanup_(remove_tree)
+
+static int make_temp_dir(char **ret, const char *prefix) {
+  const char *tmpdir = getenv("TMPDIR");
+  char *path;
+
+  if (asprintf(&path, "%s/%s-XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp",
+        prefix) < 0)
+    return -ENOMEM;
+
+  if (mkdtemp(path) == NULL) {
+    int r = -errno;
+    free(path);
+    return r;
+  }
+
+  *ret = path;
+
+  return 0;
+}
+
+/* The whole of |fd|, from its start, NUL terminated. */
+static char *read_all(int fd) {
+  struct stat st;
+  char *buf;
+  ssize_t n;
+
+  if (fstat(fd, &st) < 0)
+    return NULL;
+
+  buf = malloc(st.st_size + 1);
+  if (buf == NULL)
+    return NULL;
+
+  n = pread(fd, buf, st.st_size, 0);
+  buf[n > 0 ? n : 0] = '\0';
+
+  return buf;
+}
+
+/* Run |argv|, searched for in $PATH, with its stdin read from |in| if that
+ * isn't negative and its output discarded unless |out| or |err| ask for it.
+ * Returns its exit status, or a negative errno if it couldn't be run. */
+static int run(char **envp, const char *const *argv, int in, char **out,
+    char **err) {
+  _cleanup_close_ int null = -1, out_fd = -1, err_fd = -1;
+  posix_spawn_file_actions_t actions;
+  int r, status;
+  pid_t pid;
+
+  null = open("/dev/null", O_RDWR|O_CLOEXEC);
+  if (null < 0)
+    return -errno;
+
+  /* files rather than pipes, which a control master going into the
+   * background would keep open */
+  if (out) {
+    out_fd = memfd_create("git-stdout", MFD_CLOEXEC);
+    if (out_fd < 0)
+      return -errno;
+  }
+  if (err) {
+    err_fd = memfd_create("git-stderr", MFD_CLOEXEC);
+    if (err_fd < 0)
+      return -errno;
+  }
+
+  r = -posix_spawn_file_actions_init(&actions);
+  if (r < 0)
+    return r;
+  posix_spawn_file_actions_adddup2(&actions, in >= 0 ? in : null, 0);
+  posix_spawn_file_actions_adddup2(&actions, out ? out_fd : null, 1);
+  posix_spawn_file_actions_adddup2(&actions, err ? err_fd : null, 2);
+
+  r = -posix_spawnp(&pid, argv[0], &actions, NULL, (char *const *)argv,
+      envp);
+  posix_spawn_file_actions_destroy(&actions);
+  if (r < 0)
+    return r;
+
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return -errno;
+
+  if (out) {
+    *out = read_all(out_fd);
+    if (*out == NULL)
+      return -ENOMEM;
+  }
+  if (err) {
+    *err = read_all(err_fd);
+    if (*err == NULL)
+      return -ENOMEM;
+    strtrim(*err);
+  }
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* Like run, for git. Whatever git printed on stderr is stored in |error| if
+ * it fails, and a failure is returned as |failure|. */
+static int run_git(git_t *git, const char *const *argv, int in, char **out,
+    int failure, char **error) {
+  _cleanup_free_ char *err = NULL;
+  int r;
+
+  r = run(git->envp, argv, in, out, &err);
+  if (r < 0)
+    return r;
+  if (r == 0)
+    return 0;
+
+  log_debug("git exited with status %d: %s", r, err);
+
+  if (error && *err) {
+    free(*error);
+    *error = err;
+    err = NULL;
+  }
+
+  return failure;
+}
+
+static bool has_env(const char *name) {
+  const char *value = getenv(name);
+  return value && *value;
+}
+
+static int make_env(git_t *git) {
+  size_t count = 0, n = 0;
+  int r;
+
+  for (char **e = environ; *e; ++e)
+    ++count;
+
+  git->envp = calloc(count + 3, sizeof(*git->envp));
+  if (git->envp == NULL)
+    return -ENOMEM;
+
+  for (char **e = environ; *e; ++e)
+    git->envp[n++] = *e;
+
+  /* git must never wait for a password on the terminal we draw on */
+  git->envp[n++] = (char *)"GIT_TERMINAL_PROMPT=0";
+
+  /* leave SSH alone if the user has set it up for git already */
+  if (has_env("GIT_SSH_COMMAND") || has_env("GIT_SSH"))
+    return 0;
+
+  /* ssh mustn't prompt either, for a passphrase or an unknown host key;
+   * without a directory for the control socket, pushes can't share one */
+  if (make_temp_dir(&git->control_dir, "burp-ssh") < 0)
+    r = asprintf(&git->ssh_command, "GIT_SSH_COMMAND=ssh -o BatchMode=yes");
+  else
+    r = asprintf(&git->ssh_command, "GIT_SSH_COMMAND=ssh -o BatchMode=yes "
+        "-o ControlMaster=auto -o ControlPath='%s/%%C' -o ControlPersist=60",
+        git->control_dir);
+  if (r < 0) {
+    git->ssh_command = NULL;
+    return -ENOMEM;
+  }
+  git->envp[n++] = git->ssh_command;
+
+  return 0;
+}
+
+/* The committer git would use, without the timestamp. */
+static int make_committer(git_t *git) {
+  static const char *const argv[] = { "git", "var", "GIT_COMMITTER_IDENT",
+    NULL };
+  _cleanup_free_ char *ident = NULL;
+  char *end;
+  int r;
+
+  r = run(git->envp, argv, -1, &ident, NULL);
+  if (r == 0 && (end = strrchr(ident, '>')) != NULL) {
+    end[1] = '\0';
+    git->committer = strdup(ident);
+  } else
+    git->committer = strdup("burp <burp@localhost>");
+
+  return git->committer ? 0 : -ENOMEM;
+}
+
+int git_new(git_t **ret, const char *url) {
+  git_t *git;
+  int r;
+
+  git = calloc(1, sizeof(*git));
+  if (git == NULL)
+    return -ENOMEM;
+
+  pthread_mutex_init(&git->lock, NULL);
+
+  git->url = strdup(url);
+  if (git->url == NULL) {
+    git_free(git);
+    return -ENOMEM;
+  }
+
+  r = make_env(git);
+  if (r == 0)
+    r = make_committer(git);
+  if (r < 0) {
+    git_free(git);
+    return r;
+  }
+
+  log_debug("pushing to %s as %s", git->url, git->committer);
+
+  *ret = git;
+
+  return 0;
+}
+
+/* Tell every control master to exit, rather than linger until it times
+ * out. */
+static void close_control_masters(git_t *git) {
+  DIR *dir;
+  struct dirent *entry;
+
+  dir = opendir(git->control_dir);
+  if (dir == NULL)
+    return;
+
+  while ((entry = readdir(dir)) != NULL) {
+    _cleanup_free_ char *option = NULL;
+
+    if (entry->d_name[0] == '.')
+      continue;
+
+    if (asprintf(&option, "ControlPath=%s/%s", git->control_dir,
+          entry->d_name) < 0) {
+      option = NULL;
+      continue;
+    }
+
+    {
+      const char *const argv[] = { "ssh", "-o", option, "-O", "exit", "burp",
+        NULL };
+      run(git->envp, argv, -1, NULL, NULL);
+    }
+  }
+
+  closedir(dir);
+}
+
+void git_free(git_t *git) {
+  if (git == NULL)
+    return;
+
+  if (git->control_dir) {
+    close_control_masters(git);
+    remove_tree(&git->control_dir);
+  }
+
+  pthread_mutex_destroy(&git->lock);
+  free(git->envp);
+  free(git->ssh_command);
+  free(git->committer);
+  free(git->url);
+  free(git);
+}
+
+/* The names the AUR accepts, which are also safe in a URL and a path. */
+static bool pkgbase_is_valid(const char *pkgbase) {
+  if (pkgbase == NULL || *pkgbase == '\0' || *pkgbase == '-' ||
+      *pkgbase == '.')
+    return false;
+
+  return pkgbase[strspn(pkgbase, "abcdefghijklmnopqrstuvwxyz"
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789@._+-")] == '\0';
+}
+
+static char *make_url(const git_t *git, const char *pkgbase) {
+  const char *placeholder = strstr(git->url, "%s");
+  char *url;
+
+  if (placeholder == NULL)
+    return strdup(git->url);
+
+  if (asprintf(&url, "%.*s%s%s", (int)(placeholder - git->url), git->url,
+        pkgbase, placeholder + 2) < 0)
+    return NULL;
+
+  return url;
+}
+
+struct import_t {
+  FILE *fp;
+  unsigned files;
+};
+
+/* Every file goes inline in the fast-import stream. */
+static int import_file(void *userdata, const struct tarball_file_t *file) {
+  struct import_t *import = userdata;
+
+  /* names fast-import would have to see quoted never make it to the AUR */
+  if (file->name[0] == '"' || strchr(file->name, '\n'))
+    return -EBADMSG;
+
+  fprintf(import->fp, "M %s inline %s\ndata %zu\n",
+      file->mode & 0111 ? "100755" : "100644", file->name, file->len);
+  fwrite(file->data, 1, file->len, import->fp);
+  fputc('\n', import->fp);
+  ++import->files;
+
+  return ferror(import->fp) ? -EIO : 0;
+}
+
+/* A fast-import stream making one commit on top of |parent|, if there is
+ * one, which holds exactly the files of the tarball. */
+static int write_import(git_t *git, const char *version, const char *path,
+    int fd, bool parent, int out) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ char *message = NULL;
+  struct import_t import;
+  int r, stream;
+
+  stream = fcntl(out, F_DUPFD_CLOEXEC, 0);
+  if (stream < 0)
+    return -errno;
+
+  fp = fdopen(stream, "w");
+  if (fp == NULL) {
+    r = -errno;
+    close(stream);
+    return r;
+  }
+
+  if (version)
+    r = asprintf(&message, "Update to %s\n", version);
+  else
+    r = asprintf(&message, "Update\n");
+  if (r < 0) {
+    message = NULL;
+    return -ENOMEM;
+  }
+
+  fprintf(fp, "commit refs/heads/master\ncommitter %s %jd +0000\n"
+      "data %zu\n%s", git->committer, (intmax_t)time(NULL), strlen(message),
+      message);
+  if (parent)
+    fputs("from refs/remotes/origin/master\n", fp);
+  fputs("deleteall\n", fp);
+
+  import.fp = fp;
+  import.files = 0;
+  if (fd >= 0)
+    r = tarball_read_files_fd(fd, import_file, &import);
+  else
+    r = tarball_read_files(path, import_file, &import);
+  if (r < 0)
+    return r;
+
+  if (import.files == 0)
+    return -ENOENT;
+
+  fputs("\ndone\n", fp);
+
+  if (fflush(fp) != 0)
+    return -errno;
+
+  return 0;
+}
+
+int git_push(git_t *git, const char *pkgbase, const char *version,
+    const char *path, int fd, char **error) {
+  _cleanup_tree_ char *workdir = NULL;
+  _cleanup_free_ char *url = NULL, *git_dir = NULL;
+  _cleanup_close_ int stream = -1;
+  bool first, parent;
+  int r;
+
+  trace_span(span, "git push", pkgbase);
+
+  if (!pkgbase_is_valid(pkgbase))
+    return -EINVAL;
+
+  url = make_url(git, pkgbase);
+  if (url == NULL)
+    return -ENOMEM;
+
+  log_info("pushing %s to %s", pkgbase, url);
+
+  r = make_temp_dir(&workdir, "burp-git");
+  if (r < 0)
+    return r;
+
+  if (asprintf(&git_dir, "--git-dir=%s", workdir) < 0) {
+    git_dir = NULL;
+    return -ENOMEM;
+  }
+
+  {
+    const char *const argv[] = { "git", "init", "-q", "--bare", workdir,
+      NULL };
+
+    r = run_git(git, argv, -1, NULL, -EIO, error);
+    if (r < 0)
+      return r;
+  }
+
+  /* a repository made for a new pkgbase has no branches yet */
+  {
+    const char *const argv[] = { "git", git_dir, "ls-remote", url,
+      "refs/heads/master", NULL };
+    _cleanup_free_ char *refs = NULL;
+
+    pthread_mutex_lock(&git->lock);
+    first = !git->connected;
+    if (!first)
+      pthread_mutex_unlock(&git->lock);
+
+    r = run_git(git, argv, -1, &refs, -EIO, error);
+
+    if (first) {
+      git->connected = r == 0;
+      pthread_mutex_unlock(&git->lock);
+    }
+    if (r < 0)
+      return r;
+
+    parent = *refs != '\0';
+  }
+
+  /* only the tip is needed, as the parent of our commit */
+  if (parent) {
+    const char *const argv[] = { "git", git_dir, "fetch", "-q", "--depth=1",
+      url, "+refs/heads/master:refs/remotes/origin/master", NULL };
+
+    r = run_git(git, argv, -1, NULL, -EIO, error);
+    if (r < 0)
+      return r;
+  }
+
+  stream = memfd_create("git-import", MFD_CLOEXEC);
+  if (stream < 0)
+    return -errno;
+
+  r = write_import(git, version, path, fd, parent, stream);
+  if (r < 0)
+    return r;
+
+  if (lseek(stream, 0, SEEK_SET) < 0)
+    return -errno;
+
+  {
+    const char *const argv[] = { "git", git_dir, "fast-import", "--quiet",
+      "--done", NULL };
+
+    r = run_git(git, argv, stream, NULL, -EIO, error);
+    if (r < 0)
+      return r;
+  }
+
+  {
+    const char *const argv[] = { "git", git_dir, "push", "-q", url,
+      "refs/heads/master:refs/heads/master", NULL };
+
+    return run_git(git, argv, -1, NULL, -EKEYREJECTED, error);
+  }
+}
+
+/* vim: set et ts=2 sw=2: */
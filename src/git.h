@@ -0,0 +1,28 @@
+#ifndef _GIT_H
+#define _GIT_H
+
+/* Uploads to git repositories of the kind the AUR keeps for every pkgbase
+ * since AUR 4, by driving the git command line tool. Over SSH, every push
+ * shares one connection per host: the first push starts an OpenSSH control
+ * master, which the others multiplex over. A git_t may be used by several
+ * threads at once, as long as they push different pkgbases. */
+typedef struct git_t git_t;
+
+/* |url| is the repository URL with %s standing for the pkgbase, such as
+ * "ssh://aur@aur.archlinux.org/%s.git" or, for a local stand-in,
+ * "/srv/aur/%s.git". */
+int git_new(git_t **ret, const char *url);
+void git_free(git_t *git);
+
+/* Commit the files of the source tarball or package directory |path| on top
+ * of the pkgbase's master branch, replacing whatever it held, and push the
+ * commit. If |fd| isn't negative, the tarball is read from it instead and
+ * |path| is unused. |version|, if known, goes in the commit message. Returns
+ * -EKEYREJECTED if the remote refused the push and -EIO if git failed
+ * otherwise; either way, what git printed is stored in |error|. */
+int git_push(git_t *git, const char *pkgbase, const char *version,
+    const char *path, int fd, char **error);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _GIT_H */
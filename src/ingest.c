@@ -0,0 +1,467 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ingest.h"
+#include "log.h"
+#include "util.h"
+
+/* statx, openat and read came to io_uring with Linux 5.6, whose header is
+ * the first to define IORING_FEAT_RW_CUR_POS; there is no liburing to lean
+ * on, so the ring is driven with the raw system calls */
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_RW_CUR_POS
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+/* files being read at once */
+#define INGEST_DEPTH 32
+/* how much a single read asks for */
+#define INGEST_CHUNK (256 * 1024)
+/* threads making blocking calls when there is no io_uring */
+#define INGEST_THREADS 8
+
+static size_t min_size(size_t a, size_t b) {
+  return a < b ? a : b;
+}
+
+#ifdef HAVE_IO_URING
+struct ring_t {
+  int fd;
+
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  /* entries filled in, and how many of them the kernel has yet to see */
+  unsigned tail;
+  unsigned queued;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_map;
+  size_t sq_map_len;
+  void *cq_map;
+  size_t cq_map_len;
+  size_t sqes_len;
+};
+
+enum stage_t {
+  STAGE_STAT,
+  STAGE_OPEN,
+  STAGE_READ,
+};
+
+/* A file being read, one request at a time. */
+struct slot_t {
+  const char *path;
+  enum stage_t stage;
+  struct statx stx;
+  int fd;
+  size_t offset;
+  size_t size;
+  char *buf;
+};
+
+static void ring_close(struct ring_t *ring) {
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_map && ring->cq_map != ring->sq_map)
+    munmap(ring->cq_map, ring->cq_map_len);
+  if (ring->sq_map)
+    munmap(ring->sq_map, ring->sq_map_len);
+  if (ring->fd >= 0)
+    close(ring->fd);
+}
+
+/* Whether the kernel knows every operation the ingestion needs. */
+static bool ring_supports(const struct ring_t *ring) {
+  static const uint8_t ops[] = {
+    IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ,
+  };
+  _cleanup_free_ struct io_uring_probe *probe = NULL;
+  size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+
+  probe = calloc(1, len);
+  if (probe == NULL)
+    return false;
+
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe,
+        256) < 0)
+    return false;
+
+  for (size_t i = 0; i < ARRAYSIZE(ops); ++i)
+    if (ops[i] > probe->last_op ||
+        !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+      return false;
+
+  return true;
+}
+
+static int ring_open(struct ring_t *ring, unsigned entries) {
+  struct io_uring_params params;
+  char *sq, *cq;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0)
+    return -errno;
+
+  ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_len = params.cq_off.cqes +
+      params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_len > ring->sq_map_len)
+      ring->sq_map_len = ring->cq_map_len;
+    ring->cq_map_len = ring->sq_map_len;
+  }
+
+  ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    ring->sq_map = NULL;
+    goto fail;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_map = ring->sq_map;
+  else {
+    ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) {
+      ring->cq_map = NULL;
+      goto fail;
+    }
+  }
+
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  sq = ring->sq_map;
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->tail = *ring->sq_tail;
+
+  cq = ring->cq_map;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  if (!ring_supports(ring)) {
+    errno = EOPNOTSUPP;
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  {
+    int r = -errno;
+    ring_close(ring);
+    return r;
+  }
+}
+
+/* The next free submission entry. There is always one, as no slot has more
+ * than one request in flight and the ring has an entry per slot. */
+static struct io_uring_sqe *ring_get_sqe(struct ring_t *ring, uint64_t slot) {
+  unsigned index = ring->tail++ & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = slot;
+  ring->sq_array[index] = index;
+  ++ring->queued;
+
+  return sqe;
+}
+
+/* Submit what was queued, and wait for at least one completion. */
+static int ring_enter(struct ring_t *ring) {
+  __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+  for (;;) {
+    long n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1,
+        IORING_ENTER_GETEVENTS, NULL, 0);
+    if (n >= 0) {
+      ring->queued -= n;
+      return 0;
+    }
+    if (errno != EINTR)
+      return -errno;
+  }
+}
+
+static void slot_stat(struct ring_t *ring, struct slot_t *slots, size_t i) {
+  struct io_uring_sqe *sqe = ring_get_sqe(ring, i);
+
+  slots[i].stage = STAGE_STAT;
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)slots[i].path;
+  sqe->len = STATX_TYPE|STATX_SIZE;
+  sqe->off = (uintptr_t)&slots[i].stx;
+}
+
+static void slot_read(struct ring_t *ring, struct slot_t *slots, size_t i) {
+  struct io_uring_sqe *sqe = ring_get_sqe(ring, i);
+
+  slots[i].stage = STAGE_READ;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = slots[i].fd;
+  sqe->addr = (uintptr_t)slots[i].buf;
+  sqe->len = min_size(INGEST_CHUNK, slots[i].size - slots[i].offset);
+  sqe->off = slots[i].offset;
+}
+
+/* Move a slot on to its next request once the last one completed with
+ * |res|. Returns false once the file is done with. */
+static bool slot_advance(struct ring_t *ring, struct slot_t *slots, size_t i,
+    int res, size_t limit) {
+  struct slot_t *slot = &slots[i];
+  struct io_uring_sqe *sqe;
+
+  switch (slot->stage) {
+  case STAGE_STAT:
+    if (res < 0 || !S_ISREG(slot->stx.stx_mode) || slot->stx.stx_size == 0)
+      return false;
+
+    slot->size = min_size(slot->stx.stx_size, limit);
+    slot->offset = 0;
+    slot->stage = STAGE_OPEN;
+    sqe = ring_get_sqe(ring, i);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)slot->path;
+    sqe->open_flags = O_RDONLY|O_CLOEXEC|O_NOCTTY;
+    return true;
+  case STAGE_OPEN:
+    if (res < 0)
+      return false;
+
+    slot->fd = res;
+    slot_read(ring, slots, i);
+    return true;
+  case STAGE_READ:
+    if (res > 0) {
+      slot->offset += res;
+      if (slot->offset < slot->size) {
+        slot_read(ring, slots, i);
+        return true;
+      }
+    }
+
+    close(slot->fd);
+    slot->fd = -1;
+    return false;
+  }
+
+  return false;
+}
+
+/* After a failure, wait for the requests in flight to complete without
+ * making new ones, and keep the descriptors an openat returned so that they
+ * are closed with the others. Only then may the buffers go. Completions the
+ * kernel posted already are reaped first, as a full queue of them may be
+ * what made submitting fail. */
+static int ring_drain(struct ring_t *ring, struct slot_t *slots,
+    size_t *active) {
+  for (;;) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    int r;
+
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      struct slot_t *slot = &slots[cqe->user_data];
+
+      if (slot->stage == STAGE_OPEN && cqe->res >= 0)
+        slot->fd = cqe->res;
+      --*active;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (*active == 0)
+      return 0;
+
+    r = ring_enter(ring);
+    if (r < 0)
+      return r;
+  }
+}
+
+static int ingest_ring(const char *const *paths, size_t count, size_t limit) {
+  struct slot_t slots[INGEST_DEPTH];
+  size_t next = 0, active = 0, depth = min_size(count, INGEST_DEPTH);
+  size_t free_slots[INGEST_DEPTH], free_count = 0;
+  struct ring_t ring;
+  int r;
+
+  r = ring_open(&ring, depth);
+  if (r < 0)
+    return r;
+
+  memset(slots, 0, sizeof(slots));
+  for (size_t i = 0; i < depth; ++i) {
+    slots[i].fd = -1;
+    slots[i].buf = malloc(min_size(INGEST_CHUNK, limit));
+    if (slots[i].buf == NULL) {
+      r = -ENOMEM;
+      goto out;
+    }
+    free_slots[free_count++] = depth - 1 - i;
+  }
+
+  while (next < count || active > 0) {
+    unsigned head, tail;
+
+    while (free_count > 0 && next < count) {
+      size_t i = free_slots[--free_count];
+
+      slots[i].path = paths[next++];
+      slot_stat(&ring, slots, i);
+      ++active;
+    }
+
+    r = ring_enter(&ring);
+    if (r < 0)
+      goto out;
+
+    head = *ring.cq_head;
+    tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      size_t i = cqe->user_data;
+
+      if (!slot_advance(&ring, slots, i, cqe->res, limit)) {
+        free_slots[free_count++] = i;
+        --active;
+      }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+out:
+  /* should even that fail, the kernel may still write to the buffers of
+   * what is in flight, and they are better leaked */
+  if (active > 0 && ring_drain(&ring, slots, &active) < 0)
+    log_debug("failed to wait for io_uring requests in flight");
+  if (active == 0)
+    for (size_t i = 0; i < depth; ++i)
+      free(slots[i].buf);
+  for (size_t i = 0; i < depth; ++i)
+    if (slots[i].fd >= 0)
+      close(slots[i].fd);
+  ring_close(&ring);
+
+  return r;
+}
+#endif
+
+struct pool_t {
+  const char *const *paths;
+  size_t count;
+  size_t limit;
+  size_t next;
+};
+
+static void ingest_file(const char *path, size_t limit, char *buf) {
+  struct stat st;
+  size_t size;
+  int fd;
+
+  if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+    return;
+
+  fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+  if (fd < 0)
+    return;
+
+  size = min_size(st.st_size, limit);
+  for (size_t offset = 0; offset < size;) {
+    ssize_t n = pread(fd, buf, min_size(INGEST_CHUNK, size - offset), offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    offset += n;
+  }
+
+  close(fd);
+}
+
+static void *pool_worker(void *arg) {
+  struct pool_t *pool = arg;
+  _cleanup_free_ char *buf = NULL;
+  size_t i;
+
+  buf = malloc(min_size(INGEST_CHUNK, pool->limit));
+  if (buf == NULL)
+    return NULL;
+
+  while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+      pool->count)
+    ingest_file(pool->paths[i], pool->limit, buf);
+
+  return NULL;
+}
+
+static int ingest_pool(const char *const *paths, size_t count, size_t limit) {
+  struct pool_t pool = { paths, count, limit, 0 };
+  pthread_t threads[INGEST_THREADS];
+  size_t thread_count = 0;
+
+  while (thread_count < min_size(count, INGEST_THREADS) &&
+      pthread_create(&threads[thread_count], NULL, pool_worker, &pool) == 0)
+    ++thread_count;
+
+  /* without any thread, the calls are made right here */
+  pool_worker(&pool);
+
+  for (size_t i = 0; i < thread_count; ++i)
+    pthread_join(threads[i], NULL);
+
+  return 0;
+}
+
+int ingest_files(const char *const *paths, size_t count, size_t limit) {
+  if (count == 0 || limit == 0)
+    return 0;
+
+#ifdef HAVE_IO_URING
+  {
+    int r = ingest_ring(paths, count, limit);
+    if (r == 0 || r == -ENOMEM)
+      return r;
+
+    log_debug("io_uring unavailable (%s), ingesting with threads",
+        strerror(-r));
+  }
+#endif
+
+  return ingest_pool(paths, count, limit);
+}
+
+/* vim: set et ts=2 sw=2: */
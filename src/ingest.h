@@ -0,0 +1,19 @@
+#ifndef _INGEST_H
+#define _INGEST_H
+
+#include <stddef.h>
+
+/* Pull the metadata and up to |limit| leading bytes of every regular file in
+ * |paths| into the page cache, with as many requests in flight at once as
+ * there are files, up to a bound, rather than one blocking call after
+ * another. Reading a batch of tarballs for real afterwards then waits for
+ * none of the round trips that make cold or network storage slow. With
+ * io_uring, the statx, openat and reads of all files are queued together;
+ * where the kernel lacks it or forbids it, a pool of threads makes the same
+ * calls. Files which can't be read are passed over, for the real reads to
+ * report. Returns 0, or -ENOMEM. */
+int ingest_files(const char *const *paths, size_t count, size_t limit);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _INGEST_H */
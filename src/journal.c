@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "log.h"
+#include "util.h"
+
+/* outstanding records are synced after this many, or this many seconds */
+#define JOURNAL_SYNC_RECORDS 64
+#define JOURNAL_SYNC_INTERVAL 1
+
+struct journal_t {
+  int fd;
+  pthread_mutex_t lock;
+  unsigned unsynced;
+  time_t last_sync;
+
+  /* Hashes of the keys of successful uploads, sorted after replay. Only the
+   * hash is kept, so a large journal costs 8 bytes per entry. */
+  uint64_t *done;
+  size_t done_len;
+};
+
+static uint64_t hash_key(const char *key, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  /* FNV-1a */
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)key[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static int hash_compare(const void *a, const void *b) {
+  uint64_t left = *(const uint64_t *)a, right = *(const uint64_t *)b;
+  return left < right ? -1 : left > right;
+}
+
+/* The key is everything following the status field of a record. The path
+ * is made absolute, so that the same file matches whichever directory burp
+ * runs in and however it is named; one that doesn't resolve, such as - for
+ * stdin, is kept as given. */
+static int format_key(char **key, const char *domain, const char *path,
+    const struct stat *st) {
+  _cleanup_free_ char *canonical = realpath(path, NULL);
+
+  return asprintf(key, "%s\t%jd\t%jd.%09ld\t%s", domain, (intmax_t)st->st_size,
+      (intmax_t)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+      canonical ? canonical : path);
+}
+
+static int journal_replay(journal_t *journal, FILE *fp) {
+  _cleanup_free_ char *line = NULL;
+  size_t linesz = 0, alloc = 0;
+  ssize_t len;
+
+  while ((len = getline(&line, &linesz, fp)) != -1) {
+    /* a torn final record has no newline */
+    if (len < 4 || line[len - 1] != '\n' || strncmp(line, "ok\t", 3) != 0)
+      continue;
+
+    if (journal->done_len == alloc) {
+      uint64_t *p;
+
+      alloc = alloc ? alloc * 2 : 256;
+      p = realloc(journal->done, alloc * sizeof(*p));
+      if (p == NULL)
+        return -ENOMEM;
+      journal->done = p;
+    }
+
+    journal->done[journal->done_len++] = hash_key(line + 3, len - 4);
+  }
+
+  qsort(journal->done, journal->done_len, sizeof(uint64_t), hash_compare);
+
+  log_debug("replayed journal: %zu completed uploads", journal->done_len);
+
+  return 0;
+}
+
+int journal_open(journal_t **ret, const char *path, bool replay) {
+  journal_t *journal;
+  int r;
+
+  journal = calloc(1, sizeof(*journal));
+  if (journal == NULL)
+    return -ENOMEM;
+
+  journal->fd = open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+  if (journal->fd < 0) {
+    r = -errno;
+    free(journal);
+    return r;
+  }
+
+  if (replay) {
+    FILE *fp = fdopen(dup(journal->fd), "r");
+
+    if (fp == NULL)
+      r = -errno;
+    else {
+      r = journal_replay(journal, fp);
+      fclose(fp);
+    }
+
+    if (r < 0) {
+      close(journal->fd);
+      free(journal->done);
+      free(journal);
+      return r;
+    }
+  }
+
+  pthread_mutex_init(&journal->lock, NULL);
+  journal->last_sync = time(NULL);
+
+  *ret = journal;
+
+  return 0;
+}
+
+void journal_close(journal_t *journal) {
+  if (journal == NULL)
+    return;
+
+  if (journal->unsynced)
+    fdatasync(journal->fd);
+
+  close(journal->fd);
+  pthread_mutex_destroy(&journal->lock);
+  free(journal->done);
+  free(journal);
+}
+
+bool journal_contains(journal_t *journal, const char *domain,
+    const char *path, const struct stat *st) {
+  _cleanup_free_ char *key = NULL;
+  uint64_t hash;
+  int len;
+
+  if (journal->done_len == 0)
+    return false;
+
+  len = format_key(&key, domain, path, st);
+  if (len < 0)
+    return false;
+
+  hash = hash_key(key, len);
+
+  return bsearch(&hash, journal->done, journal->done_len, sizeof(uint64_t),
+      hash_compare) != NULL;
+}
+
+int journal_record(journal_t *journal, const char *domain, const char *path,
+    const struct stat *st, bool success) {
+  _cleanup_free_ char *key = NULL, *record = NULL;
+  time_t now;
+  int len, r = 0;
+
+  if (format_key(&key, domain, path, st) < 0)
+    return -ENOMEM;
+
+  if (strchr(key, '\n'))
+    return -EINVAL;
+
+  len = asprintf(&record, "%s\t%s\n", success ? "ok" : "fail", key);
+  if (len < 0)
+    return -ENOMEM;
+
+  pthread_mutex_lock(&journal->lock);
+
+  /* a single O_APPEND write keeps concurrent records from interleaving */
+  errno = 0;
+  if (write(journal->fd, record, len) != len)
+    r = errno ? -errno : -EIO;
+  else
+    ++journal->unsynced;
+
+  now = time(NULL);
+  if (journal->unsynced >= JOURNAL_SYNC_RECORDS ||
+      (journal->unsynced && now - journal->last_sync >= JOURNAL_SYNC_INTERVAL)) {
+    if (fdatasync(journal->fd) < 0 && r == 0)
+      r = -errno;
+    journal->unsynced = 0;
+    journal->last_sync = now;
+  }
+
+  pthread_mutex_unlock(&journal->lock);
+
+  return r;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,29 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+/* An append-only log of upload outcomes. Each line records the status, the
+ * domain, and the size, mtime and absolute path of the tarball, so that an
+ * interrupted batch can be resumed without uploading unchanged tarballs
+ * again. */
+typedef struct journal_t journal_t;
+
+/* Open |path| for appending. If |replay| is set, successful uploads already
+ * recorded are loaded so that journal_contains can answer for them. */
+int journal_open(journal_t **ret, const char *path, bool replay);
+
+/* Flushes outstanding records to disk. */
+void journal_close(journal_t *journal);
+
+bool journal_contains(journal_t *journal, const char *domain,
+    const char *path, const struct stat *st);
+
+/* Safe to call from several threads. */
+int journal_record(journal_t *journal, const char *domain, const char *path,
+    const struct stat *st, bool success);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _JOURNAL_H */
@@ -6,7 +6,10 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "progress.h"
+
 static int max_log_level = LOG_WARN;
+static progress_t *log_progress;
 
 static const char *get_logprefix(int loglevel) {
   switch (loglevel) {
@@ -30,6 +33,10 @@ void log_set_level(int loglevel) {
   max_log_level = loglevel;
 }
 
+void log_set_progress(progress_t *progress) {
+  log_progress = progress;
+}
+
 int log_metav(int level, const char *file, int line, const char *format,
     va_list ap) {
   char buffer[LINE_MAX];
@@ -37,6 +44,16 @@ int log_metav(int level, const char *file, int line, const char *format,
 
   vsnprintf(buffer, sizeof(buffer), format, ap);
 
+  if (log_progress) {
+    if (level >= LOG_DEBUG)
+      progress_printf(log_progress, stream, "[%s:%d] %s%s\n", file, line,
+          get_logprefix(level), buffer);
+    else
+      progress_printf(log_progress, stream, "%s%s\n", get_logprefix(level),
+          buffer);
+    return 0;
+  }
+
   if (level >= LOG_DEBUG)
     return fprintf(stream, "[%s:%d] %s%s\n", file, line, get_logprefix(level),
         buffer);
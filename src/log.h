@@ -16,7 +16,11 @@ int log_meta(int level, const char*file, int line, const char *format, ...)
 int log_metav(int level, const char*file, int line, const char *format,
     va_list ap) __attribute__((format(printf, 4, 0)));
 
+struct progress_t;
+
 void log_set_level(int loglevel);
+/* Route messages around the status line of |progress|, or NULL. */
+void log_set_progress(struct progress_t *progress);
 int log_get_max_level(void);
 
 #define log_full(level, ...) \
@@ -0,0 +1,403 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "transport.h"
+#include "util.h"
+
+struct script_t {
+  char *path;
+  long status;
+  char *headers;
+  char *body;
+  struct script_t *next;
+};
+
+struct loopback_t {
+  transport_t transport;
+
+  pthread_mutex_t lock;
+  struct script_t *script;
+  struct script_t **script_tail;
+  unsigned long sessions;
+};
+
+/* The parts of the request URL a response depends on. */
+struct origin_t {
+  char host[256];
+  size_t host_len;  /* without the port */
+  bool secure;
+  const char *base;
+  size_t base_len;  /* scheme://host[:port] */
+};
+
+static int parse_origin(const char *url, struct origin_t *origin) {
+  const char *host, *end;
+
+  host = strstr(url, "://");
+  if (host == NULL)
+    return -EINVAL;
+  host += 3;
+
+  end = host + strcspn(host, "/");
+  if ((size_t)(end - host) >= sizeof(origin->host))
+    return -EINVAL;
+
+  memcpy(origin->host, host, end - host);
+  origin->host[end - host] = '\0';
+  origin->host_len = strcspn(origin->host, ":");
+  origin->secure = strncmp(url, "https:", 6) == 0;
+  origin->base = url;
+  origin->base_len = end - url;
+
+  return 0;
+}
+
+static const char *form_field(const struct curl_httppost *form,
+    const char *name) {
+  for (; form; form = form->next)
+    if (form->name && streq(form->name, name))
+      return form->contents;
+
+  return NULL;
+}
+
+static const char *form_filename(const struct curl_httppost *form,
+    const char *name) {
+  for (; form; form = form->next)
+    if (form->name && streq(form->name, name))
+      return transport_form_filename(form);
+
+  return NULL;
+}
+
+/* Read the file part |name| of the form in full, the way libcurl would
+ * send it, and store its length in |len|. */
+static int read_form_file(const struct transport_exchange_t *exchange,
+    const char *name, size_t *len) {
+  const struct curl_httppost *part;
+  char buf[16384];
+
+  for (part = exchange->form; part; part = part->next)
+    if (part->name && streq(part->name, name))
+      break;
+  if (part == NULL)
+    return -ENOENT;
+
+  *len = 0;
+
+  if (part->flags & CURL_HTTPPOST_BUFFER) {
+    *len = part->bufferlength;
+  } else if (part->flags & CURL_HTTPPOST_CALLBACK) {
+    for (;;) {
+      size_t n = exchange->read_cb(buf, 1, sizeof(buf), part->userp);
+      if (n == CURL_READFUNC_ABORT || n > sizeof(buf))
+        return -EIO;
+      if (n == 0)
+        break;
+      *len += n;
+    }
+  } else if (part->flags & CURL_HTTPPOST_FILENAME) {
+    _cleanup_fclose_ FILE *fp = NULL;
+    size_t n;
+
+    fp = fopen(part->contents, "rbe");
+    if (fp == NULL)
+      return -errno;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+      *len += n;
+    if (ferror(fp))
+      return -EIO;
+  } else
+    *len = part->contentslength ? (size_t)part->contentslength :
+        strlen(part->contents);
+
+  return 0;
+}
+
+static void set_cookie(CURL *curl, const struct origin_t *origin,
+    const char *name, const char *value, long expire) {
+  _cleanup_free_ char *cookie = NULL;
+
+  if (asprintf(&cookie, "%.*s\tFALSE\t/\t%s\t%ld\t%s\t%s",
+        (int)origin->host_len, origin->host, origin->secure ? "TRUE" : "FALSE",
+        expire, name, value) < 0)
+    return;
+
+  curl_easy_setopt(curl, CURLOPT_COOKIELIST, cookie);
+}
+
+/* Hand each line of |headers| to the exchange, and act on the ones libcurl
+ * would act on. */
+static int deliver_headers(CURL *curl, const struct origin_t *origin,
+    struct transport_exchange_t *exchange, const char *headers) {
+  _cleanup_free_ char *status_line = NULL;
+  const char *line = headers;
+
+  if (asprintf(&status_line, "HTTP/1.1 %ld\r\n", exchange->status) < 0)
+    return -ENOMEM;
+  exchange->header_cb(status_line, 1, strlen(status_line),
+      exchange->header_data);
+
+  while (line && *line) {
+    _cleanup_free_ char *copy = NULL;
+    size_t len = strcspn(line, "\n");
+    char *value;
+
+    copy = strndup(line, len);
+    if (copy == NULL)
+      return -ENOMEM;
+    copy[strcspn(copy, "\r")] = '\0';
+
+    line += len + (line[len] == '\n');
+
+    if (*copy == '\0')
+      continue;
+
+    {
+      _cleanup_free_ char *wire = NULL;
+
+      if (asprintf(&wire, "%s\r\n", copy) < 0)
+        return -ENOMEM;
+      exchange->header_cb(wire, 1, strlen(wire), exchange->header_data);
+    }
+
+    value = strchr(copy, ':');
+    if (value == NULL)
+      continue;
+    *value++ = '\0';
+    value += strspn(value, " \t");
+
+    if (strcasecmp(copy, "Location") == 0 && exchange->status / 100 == 3) {
+      free(exchange->redirect_url);
+      if (*value == '/') {
+        if (asprintf(&exchange->redirect_url, "%.*s%s",
+              (int)origin->base_len, origin->base, value) < 0)
+          exchange->redirect_url = NULL;
+      } else
+        exchange->redirect_url = strdup(value);
+      if (exchange->redirect_url == NULL)
+        return -ENOMEM;
+    } else if (strcasecmp(copy, "Set-Cookie") == 0) {
+      char *cookie_value, *attributes;
+
+      /* only NAME=VALUE and Max-Age are honored */
+      attributes = value + strcspn(value, ";");
+      if (*attributes)
+        *attributes++ = '\0';
+
+      cookie_value = strchr(value, '=');
+      if (cookie_value == NULL)
+        continue;
+      *cookie_value++ = '\0';
+
+      attributes = strcasestr(attributes, "Max-Age=");
+      set_cookie(curl, origin, value, cookie_value, attributes ?
+          (long)time(NULL) + strtol(attributes + 8, NULL, 10) : 0);
+    }
+  }
+
+  exchange->header_cb((char *)"\r\n", 1, 2, exchange->header_data);
+
+  return 0;
+}
+
+static int respond(CURL *curl, const struct origin_t *origin,
+    struct transport_exchange_t *exchange, long status, const char *headers,
+    const char *body) {
+  size_t len = body ? strlen(body) : 0;
+  int r;
+
+  exchange->status = status;
+
+  r = deliver_headers(curl, origin, exchange, headers);
+  if (r < 0)
+    return r;
+
+  if (len && exchange->body_cb((char *)body, 1, len,
+        exchange->body_data) != len)
+    return -EIO;
+
+  return 0;
+}
+
+static int serve_builtin(struct loopback_t *loopback, CURL *curl,
+    const struct origin_t *origin, struct transport_exchange_t *exchange) {
+  _cleanup_free_ char *headers = NULL;
+  const char *path = exchange->path;
+
+  if (streq(path, "/login")) {
+    const char *password = form_field(exchange->form, "passwd");
+    unsigned long session;
+
+    if (password && streq(password, "wrong"))
+      return respond(curl, origin, exchange, 200, NULL,
+          "<ul class=\"errorlist\"><li>Bad username or password.</li></ul>");
+
+    pthread_mutex_lock(&loopback->lock);
+    session = ++loopback->sessions;
+    pthread_mutex_unlock(&loopback->lock);
+
+    if (asprintf(&headers, "Location: /\n"
+          "Set-Cookie: AURSID=loopback%08lx; Max-Age=86400; Path=/\n",
+          session) < 0)
+      return -ENOMEM;
+
+    return respond(curl, origin, exchange, 302, headers, NULL);
+  }
+
+  if (streq(path, "/submit")) {
+    const char *token = form_field(exchange->form, "token");
+    const char *filename = form_filename(exchange->form, "pfile");
+    const char *suffix;
+    size_t len;
+    int r;
+
+    if (token == NULL || *token == '\0')
+      return respond(curl, origin, exchange, 200, NULL,
+          "<ul class=\"errorlist\"><li>You must be logged in.</li></ul>");
+
+    if (filename == NULL)
+      return respond(curl, origin, exchange, 200, NULL,
+          "<ul class=\"errorlist\"><li>No file uploaded.</li></ul>");
+
+    /* like a real upload, this drains a streamed tarball */
+    r = read_form_file(exchange, "pfile", &len);
+    if (r < 0)
+      return r;
+
+    if (len == 0)
+      return respond(curl, origin, exchange, 200, NULL,
+          "<ul class=\"errorlist\"><li>The uploaded file is empty.</li></ul>");
+
+    suffix = strstr(filename, ".src.tar");
+    if (asprintf(&headers, "Location: /packages/%.*s/\n",
+          (int)(suffix ? (size_t)(suffix - filename) : strlen(filename)),
+          filename) < 0)
+      return -ENOMEM;
+
+    return respond(curl, origin, exchange, 302, headers, NULL);
+  }
+
+  if (streq(path, "/rpc/"))
+    return respond(curl, origin, exchange, 200,
+        "Content-Type: application/json\n", "{\"version\":5,"
+        "\"type\":\"multiinfo\",\"resultcount\":0,\"results\":[]}");
+
+  if (streq(path, "/logout"))
+    return respond(curl, origin, exchange, 302,
+        "Location: /\nSet-Cookie: AURSID=deleted; Max-Age=-1; Path=/\n", NULL);
+
+  return respond(curl, origin, exchange, 404, NULL, NULL);
+}
+
+static struct script_t *script_pop(struct loopback_t *loopback,
+    const char *path) {
+  struct script_t **p, *entry = NULL;
+
+  pthread_mutex_lock(&loopback->lock);
+  for (p = &loopback->script; *p; p = &(*p)->next)
+    if (streq((*p)->path, path)) {
+      entry = *p;
+      *p = entry->next;
+      if (loopback->script_tail == &entry->next)
+        loopback->script_tail = p;
+      break;
+    }
+  pthread_mutex_unlock(&loopback->lock);
+
+  return entry;
+}
+
+static void script_free(struct script_t *entry) {
+  free(entry->path);
+  free(entry->headers);
+  free(entry->body);
+  free(entry);
+}
+
+static int loopback_perform(transport_t *transport, CURL *curl,
+    struct transport_exchange_t *exchange) {
+  struct loopback_t *loopback = (struct loopback_t *)transport;
+  struct script_t *entry;
+  struct origin_t origin;
+  int r;
+
+  r = parse_origin(exchange->url, &origin);
+  if (r < 0)
+    return r;
+
+  entry = script_pop(loopback, exchange->path);
+  if (entry) {
+    r = respond(curl, &origin, exchange, entry->status, entry->headers,
+        entry->body);
+    script_free(entry);
+    return r;
+  }
+
+  return serve_builtin(loopback, curl, &origin, exchange);
+}
+
+static void loopback_free(transport_t *transport) {
+  struct loopback_t *loopback = (struct loopback_t *)transport;
+
+  while (loopback->script) {
+    struct script_t *next = loopback->script->next;
+    script_free(loopback->script);
+    loopback->script = next;
+  }
+
+  pthread_mutex_destroy(&loopback->lock);
+  free(loopback);
+}
+
+int loopback_new(transport_t **ret) {
+  struct loopback_t *loopback;
+
+  loopback = calloc(1, sizeof(*loopback));
+  if (loopback == NULL)
+    return -ENOMEM;
+
+  loopback->transport.name = "loopback";
+  loopback->transport.perform = loopback_perform;
+  loopback->transport.free = loopback_free;
+  loopback->script_tail = &loopback->script;
+  pthread_mutex_init(&loopback->lock, NULL);
+
+  *ret = &loopback->transport;
+
+  return 0;
+}
+
+int loopback_script(transport_t *transport, const char *path, long status,
+    const char *headers, const char *body) {
+  struct loopback_t *loopback = (struct loopback_t *)transport;
+  struct script_t *entry;
+
+  entry = calloc(1, sizeof(*entry));
+  if (entry == NULL)
+    return -ENOMEM;
+
+  entry->status = status;
+  entry->path = strdup(path);
+  entry->headers = headers ? strdup(headers) : NULL;
+  entry->body = body ? strdup(body) : NULL;
+  if (entry->path == NULL || (headers && entry->headers == NULL) ||
+      (body && entry->body == NULL)) {
+    script_free(entry);
+    return -ENOMEM;
+  }
+
+  pthread_mutex_lock(&loopback->lock);
+  *loopback->script_tail = entry;
+  loopback->script_tail = &entry->next;
+  pthread_mutex_unlock(&loopback->lock);
+
+  return 0;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,699 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+#include "util.h"
+
+char *html_strip_tags(const char *in, size_t len) {
+  int tag_depth = 0;
+  size_t i;
+  char *p, *out;
+
+  out = malloc(len + 1);
+  if (out == NULL)
+    return NULL;
+
+  p = out;
+  for (i = 0; i < len; i++) {
+    switch (in[i]) {
+    case '<':
+      ++tag_depth;
+      break;
+    case '>':
+      --tag_depth;
+      break;
+    default:
+      if (!tag_depth)
+        *p++ = in[i];
+      break;
+    }
+  }
+
+  *p = '\0';
+  return out;
+}
+
+int html_extract(const char *html, const char *start_tag, const char *end_tag,
+    char **text_out) {
+  char *p, *q;
+
+  /* find the start */
+  p = strstr(html, start_tag);
+  if (p == NULL)
+    return -ENOENT;
+
+  /* fast forward past the tag */
+  p += strlen(start_tag);
+
+  q = strstr(p, end_tag);
+  if (q == NULL)
+    return -EINVAL;
+
+  *text_out = html_strip_tags(p, q - p);
+  if (*text_out == NULL)
+    return -ENOMEM;
+
+  return 0;
+}
+
+int html_extract_error(const char *html, char **error_out) {
+  struct tagpair_t {
+    const char *start;
+    const char *end;
+  } error_tags[] = {
+    { "<p class=\"pkgoutput\">", "</p>" },   /* AUR before 3.0.0 */
+    { "<ul class=\"errorlist\">", "</ul>" }, /* AUR >=3.0.0 */
+    { NULL, NULL },
+  };
+
+  for (struct tagpair_t *tag = error_tags; tag->start; ++tag) {
+    if (html_extract(html, tag->start, tag->end, error_out) == 0)
+      return 0;
+  }
+
+  return -ENOENT;
+}
+
+bool domain_equals(const char *a, const char *b) {
+  size_t a_len, b_len;
+
+  /* ignore port numbers */
+  a_len = strcspn(a, ":");
+  b_len = strcspn(b, ":");
+
+  return a_len == b_len && strncasecmp(a, b, a_len) == 0;
+}
+
+int cookie_parse(char *line, char **domain, long *expire, char **name,
+    char **value) {
+  /* domain, subdomains, path, secure, expiry, name and value */
+  char *fields[7], *end;
+
+  for (size_t i = 0; i < ARRAYSIZE(fields); ++i) {
+    fields[i] = strsep(&line, i < ARRAYSIZE(fields) - 1 ? "\t" : "");
+    if (fields[i] == NULL || *fields[i] == '\0')
+      return -EINVAL;
+  }
+
+  errno = 0;
+  *expire = strtol(fields[4], &end, 10);
+  if (errno != 0 || *end != '\0')
+    return -EINVAL;
+
+  *domain = fields[0];
+  *name = fields[5];
+  *value = fields[6];
+
+  return 0;
+}
+
+size_t strtrim(char *str) {
+  char *left = str, *right;
+
+  if (!str || *str == '\0')
+    return 0;
+
+  while (isspace((unsigned char)*left))
+    left++;
+
+  if (left != str) {
+    memmove(str, left, (strlen(left) + 1));
+    left = str;
+  }
+
+  if (*str == '\0')
+    return 0;
+
+  right = (char*)rawmemchr(str, '\0') - 1;
+  while (isspace((unsigned char)*right))
+    right--;
+
+  *++right = '\0';
+
+  return right - left;
+}
+
+enum config_line_t config_parse_line(char *line, char **key, char **value) {
+  size_t len;
+
+  len = strtrim(line);
+  if (len == 0 || line[0] == '#')
+    return CONFIG_BLANK;
+
+  if (line[0] == '[' && line[len - 1] == ']') {
+    line[len - 1] = '\0';
+    strtrim(line + 1);
+    *key = line + 1;
+    return CONFIG_SECTION;
+  }
+
+  *key = *value = line;
+  strsep(value, "=");
+  strtrim(*key);
+  if (*value == NULL)
+    return CONFIG_INVALID;
+  strtrim(*value);
+
+  return CONFIG_ENTRY;
+}
+
+static bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *trim_span(const char *start, const char *end,
+    size_t *len) {
+  while (start < end && is_blank(*start))
+    ++start;
+  while (end > start && is_blank(end[-1]))
+    --end;
+
+  *len = end - start;
+
+  return start;
+}
+
+bool srcinfo_next(const char **buf, size_t *len,
+    struct srcinfo_entry_t *entry) {
+  const char *p = *buf, *end = *buf + *len;
+
+  while (p < end) {
+    const char *eol, *eq, *line = p;
+
+    eol = memchr(p, '\n', end - p);
+    if (eol == NULL)
+      eol = end;
+    p = eol < end ? eol + 1 : end;
+
+    while (line < eol && is_blank(*line))
+      ++line;
+    if (line == eol || *line == '#')
+      continue;
+
+    eq = memchr(line, '=', eol - line);
+    if (eq == NULL)
+      continue;
+
+    entry->key = trim_span(line, eq, &entry->key_len);
+    entry->value = trim_span(eq + 1, eol, &entry->value_len);
+
+    *len -= p - *buf;
+    *buf = p;
+    return true;
+  }
+
+  *buf = end;
+  *len = 0;
+
+  return false;
+}
+
+bool srcinfo_key_is(const struct srcinfo_entry_t *entry, const char *key) {
+  return strlen(key) == entry->key_len &&
+      memcmp(entry->key, key, entry->key_len) == 0;
+}
+
+/* Deeper documents and longer strings than any response we read has any
+ * business holding. */
+#define JSON_MAX_DEPTH 64
+#define JSON_MAX_TOKEN (1 << 20)
+
+enum json_state_t {
+  JSON_STATE_VALUE,          /* a value */
+  JSON_STATE_VALUE_OR_END,   /* the first value of an array, or ']' */
+  JSON_STATE_KEY,            /* a member name */
+  JSON_STATE_KEY_OR_END,     /* the first member name of an object, or '}' */
+  JSON_STATE_COLON,
+  JSON_STATE_AFTER_VALUE,    /* ',' or the end of the container */
+  JSON_STATE_STRING,
+  JSON_STATE_ESCAPE,         /* after a backslash */
+  JSON_STATE_UNICODE,        /* in the hex digits of a \u escape */
+  JSON_STATE_NUMBER,
+  JSON_STATE_LITERAL,        /* true, false or null */
+  JSON_STATE_DONE,
+};
+
+struct json_buffer_t {
+  char *data;
+  size_t len;
+  size_t alloc;
+};
+
+struct json_reader_t {
+  json_event_fn callback;
+  void *userdata;
+  enum json_state_t state;
+  int error;
+
+  /* '{' or '[' for every open container */
+  char stack[JSON_MAX_DEPTH];
+  size_t depth;
+
+  /* the string, number or literal being read, and the name of the member
+   * whose value it is */
+  struct json_buffer_t token;
+  struct json_buffer_t key;
+  bool in_key;
+  bool has_key;
+
+  /* a \u escape being read, and the high surrogate before it */
+  unsigned digits;
+  uint32_t codepoint;
+  uint32_t surrogate;
+};
+
+int json_reader_new(json_reader_t **ret, json_event_fn callback,
+    void *userdata) {
+  json_reader_t *reader;
+
+  reader = calloc(1, sizeof(*reader));
+  if (reader == NULL)
+    return -ENOMEM;
+
+  reader->callback = callback;
+  reader->userdata = userdata;
+  reader->state = JSON_STATE_VALUE;
+
+  *ret = reader;
+
+  return 0;
+}
+
+void json_reader_free(json_reader_t *reader) {
+  if (reader == NULL)
+    return;
+
+  free(reader->token.data);
+  free(reader->key.data);
+  free(reader);
+}
+
+/* The buffer is kept NUL terminated. */
+static int buffer_append(struct json_buffer_t *buf, const char *data,
+    size_t len) {
+  if (buf->len + len + 1 > buf->alloc) {
+    size_t alloc = buf->alloc ? buf->alloc * 2 : 256;
+    char *newdata;
+
+    while (alloc < buf->len + len + 1)
+      alloc *= 2;
+    if (alloc > JSON_MAX_TOKEN + 1) {
+      if (buf->len + len > JSON_MAX_TOKEN)
+        return -E2BIG;
+      alloc = JSON_MAX_TOKEN + 1;
+    }
+
+    newdata = realloc(buf->data, alloc);
+    if (newdata == NULL)
+      return -ENOMEM;
+
+    buf->data = newdata;
+    buf->alloc = alloc;
+  }
+
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+
+  return 0;
+}
+
+static int buffer_append_utf8(struct json_buffer_t *buf, uint32_t cp) {
+  char utf8[4];
+  size_t len;
+
+  if (cp < 0x80) {
+    utf8[0] = cp;
+    len = 1;
+  } else if (cp < 0x800) {
+    utf8[0] = 0xc0 | (cp >> 6);
+    utf8[1] = 0x80 | (cp & 0x3f);
+    len = 2;
+  } else if (cp < 0x10000) {
+    utf8[0] = 0xe0 | (cp >> 12);
+    utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+    utf8[2] = 0x80 | (cp & 0x3f);
+    len = 3;
+  } else {
+    utf8[0] = 0xf0 | (cp >> 18);
+    utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+    utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+    utf8[3] = 0x80 | (cp & 0x3f);
+    len = 4;
+  }
+
+  return buffer_append(buf, utf8, len);
+}
+
+static bool is_json_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static bool is_json_number(const char *p, size_t len) {
+  const char *end = p + len;
+
+  if (p < end && *p == '-')
+    ++p;
+  if (p == end || !is_digit(*p))
+    return false;
+  if (*p++ != '0')
+    while (p < end && is_digit(*p))
+      ++p;
+
+  if (p < end && *p == '.') {
+    if (++p == end || !is_digit(*p))
+      return false;
+    while (p < end && is_digit(*p))
+      ++p;
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    if (++p < end && (*p == '+' || *p == '-'))
+      ++p;
+    if (p == end || !is_digit(*p))
+      return false;
+    while (p < end && is_digit(*p))
+      ++p;
+  }
+
+  return p == end;
+}
+
+static int json_emit(json_reader_t *reader, enum json_event_t event,
+    const char *value, size_t len) {
+  const char *key = reader->has_key ? reader->key.data : NULL;
+
+  reader->has_key = false;
+
+  return reader->callback(reader->userdata, event, key, reader->depth,
+      value ? value : "", len);
+}
+
+/* A value is complete; what may follow depends on where it was. */
+static void json_value_done(json_reader_t *reader) {
+  reader->state = reader->depth ? JSON_STATE_AFTER_VALUE : JSON_STATE_DONE;
+}
+
+static int json_open(json_reader_t *reader, char c) {
+  int r;
+
+  if (reader->depth == JSON_MAX_DEPTH)
+    return -E2BIG;
+
+  r = json_emit(reader, c == '{' ? JSON_OBJECT_START : JSON_ARRAY_START,
+      NULL, 0);
+  if (r < 0)
+    return r;
+
+  reader->stack[reader->depth++] = c;
+  reader->state = c == '{' ? JSON_STATE_KEY_OR_END : JSON_STATE_VALUE_OR_END;
+
+  return 0;
+}
+
+static int json_close(json_reader_t *reader, char c) {
+  char open = c == '}' ? '{' : '[';
+  int r;
+
+  if (reader->depth == 0 || reader->stack[reader->depth - 1] != open)
+    return -EBADMSG;
+
+  --reader->depth;
+  r = json_emit(reader, c == '}' ? JSON_OBJECT_END : JSON_ARRAY_END, NULL, 0);
+  if (r < 0)
+    return r;
+
+  json_value_done(reader);
+
+  return 0;
+}
+
+static int json_start_value(json_reader_t *reader, char c) {
+  reader->token.len = 0;
+
+  switch (c) {
+  case '{':
+  case '[':
+    return json_open(reader, c);
+  case '"':
+    reader->in_key = false;
+    reader->state = JSON_STATE_STRING;
+    return 0;
+  case 't':
+  case 'f':
+  case 'n':
+    reader->state = JSON_STATE_LITERAL;
+    return buffer_append(&reader->token, &c, 1);
+  default:
+    if (c != '-' && !is_digit(c))
+      return -EBADMSG;
+    reader->state = JSON_STATE_NUMBER;
+    return buffer_append(&reader->token, &c, 1);
+  }
+}
+
+/* The number or literal in the token buffer ended just before the byte
+ * being read. */
+static int json_end_bare(json_reader_t *reader) {
+  const char *token = reader->token.data;
+  size_t len = reader->token.len;
+  int r;
+
+  if (reader->state == JSON_STATE_NUMBER) {
+    if (!is_json_number(token, len))
+      return -EBADMSG;
+    r = json_emit(reader, JSON_NUMBER, token, len);
+  } else if (len == 4 && memcmp(token, "true", 4) == 0)
+    r = json_emit(reader, JSON_TRUE, token, len);
+  else if (len == 5 && memcmp(token, "false", 5) == 0)
+    r = json_emit(reader, JSON_FALSE, token, len);
+  else if (len == 4 && memcmp(token, "null", 4) == 0)
+    r = json_emit(reader, JSON_NULL, token, len);
+  else
+    return -EBADMSG;
+  if (r < 0)
+    return r;
+
+  json_value_done(reader);
+
+  return 0;
+}
+
+static int json_end_string(json_reader_t *reader) {
+  struct json_buffer_t swap;
+  int r;
+
+  if (reader->surrogate)
+    return -EBADMSG;
+
+  if (!reader->in_key) {
+    r = json_emit(reader, JSON_STRING, reader->token.data, reader->token.len);
+    if (r < 0)
+      return r;
+    json_value_done(reader);
+    return 0;
+  }
+
+  /* keep the name while its value is read into the other buffer */
+  swap = reader->key;
+  reader->key = reader->token;
+  reader->token = swap;
+  reader->token.len = 0;
+  if (reader->key.data == NULL) {
+    r = buffer_append(&reader->key, "", 0);
+    if (r < 0)
+      return r;
+  }
+  reader->has_key = true;
+  reader->state = JSON_STATE_COLON;
+
+  return 0;
+}
+
+static int json_escape(json_reader_t *reader, char c) {
+  static const char escapes[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+  const char *e;
+
+  if (c == 'u') {
+    reader->digits = 0;
+    reader->codepoint = 0;
+    reader->state = JSON_STATE_UNICODE;
+    return 0;
+  }
+
+  /* a high surrogate must be followed by a low one */
+  if (reader->surrogate)
+    return -EBADMSG;
+
+  for (e = escapes; *e; e += 2)
+    if (*e == c) {
+      reader->state = JSON_STATE_STRING;
+      return buffer_append(&reader->token, e + 1, 1);
+    }
+
+  return -EBADMSG;
+}
+
+static int json_unicode(json_reader_t *reader, char c) {
+  uint32_t cp;
+
+  if (is_digit(c))
+    reader->codepoint = reader->codepoint << 4 | (c - '0');
+  else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+    reader->codepoint = reader->codepoint << 4 | ((c | 0x20) - 'a' + 10);
+  else
+    return -EBADMSG;
+
+  if (++reader->digits < 4)
+    return 0;
+
+  reader->state = JSON_STATE_STRING;
+  cp = reader->codepoint;
+
+  if (reader->surrogate) {
+    if (cp < 0xdc00 || cp > 0xdfff)
+      return -EBADMSG;
+    cp = 0x10000 + ((reader->surrogate - 0xd800) << 10) + (cp - 0xdc00);
+    reader->surrogate = 0;
+  } else if (cp >= 0xd800 && cp <= 0xdbff) {
+    reader->surrogate = cp;
+    return 0;
+  } else if (cp >= 0xdc00 && cp <= 0xdfff)
+    return -EBADMSG;
+
+  return buffer_append_utf8(&reader->token, cp);
+}
+
+/* Returns 1 if |c| wasn't consumed and must be read again. */
+static int json_step(json_reader_t *reader, char c) {
+  int r;
+
+  switch (reader->state) {
+  case JSON_STATE_STRING:
+    if (c == '"')
+      return json_end_string(reader);
+    if (reader->surrogate && c != '\\')
+      return -EBADMSG;
+    if (c == '\\') {
+      reader->state = JSON_STATE_ESCAPE;
+      return 0;
+    }
+    if ((unsigned char)c < 0x20)
+      return -EBADMSG;
+    return buffer_append(&reader->token, &c, 1);
+  case JSON_STATE_ESCAPE:
+    return json_escape(reader, c);
+  case JSON_STATE_UNICODE:
+    return json_unicode(reader, c);
+  case JSON_STATE_NUMBER:
+  case JSON_STATE_LITERAL:
+    if (is_digit(c) || (c >= 'a' && c <= 'z') || c == '.' || c == '+' ||
+        c == '-' || c == 'E')
+      return buffer_append(&reader->token, &c, 1);
+    r = json_end_bare(reader);
+    return r < 0 ? r : 1;
+  default:
+    break;
+  }
+
+  if (is_json_space(c))
+    return 0;
+
+  switch (reader->state) {
+  case JSON_STATE_VALUE_OR_END:
+    if (c == ']')
+      return json_close(reader, c);
+    /* fall through */
+  case JSON_STATE_VALUE:
+    return json_start_value(reader, c);
+  case JSON_STATE_KEY_OR_END:
+    if (c == '}')
+      return json_close(reader, c);
+    /* fall through */
+  case JSON_STATE_KEY:
+    if (c != '"')
+      return -EBADMSG;
+    reader->token.len = 0;
+    reader->in_key = true;
+    reader->state = JSON_STATE_STRING;
+    return 0;
+  case JSON_STATE_COLON:
+    if (c != ':')
+      return -EBADMSG;
+    reader->state = JSON_STATE_VALUE;
+    return 0;
+  case JSON_STATE_AFTER_VALUE:
+    if (c == ',') {
+      reader->state = reader->stack[reader->depth - 1] == '{' ?
+          JSON_STATE_KEY : JSON_STATE_VALUE;
+      return 0;
+    }
+    if (c == '}' || c == ']')
+      return json_close(reader, c);
+    return -EBADMSG;
+  default:
+    /* nothing but whitespace may follow the document */
+    return -EBADMSG;
+  }
+}
+
+int json_reader_feed(json_reader_t *reader, const char *buf, size_t len) {
+  size_t i = 0;
+  int r;
+
+  while (reader->error == 0 && i < len) {
+    /* copy plain runs of a string in one go */
+    if (reader->state == JSON_STATE_STRING && !reader->surrogate) {
+      size_t run = i;
+
+      while (run < len && buf[run] != '"' && buf[run] != '\\' &&
+          (unsigned char)buf[run] >= 0x20)
+        ++run;
+      if (run > i) {
+        r = buffer_append(&reader->token, buf + i, run - i);
+        if (r < 0)
+          reader->error = r;
+        i = run;
+        continue;
+      }
+    }
+
+    r = json_step(reader, buf[i]);
+    if (r < 0)
+      reader->error = r;
+    else if (r == 0)
+      ++i;
+  }
+
+  return reader->error;
+}
+
+int json_reader_finish(json_reader_t *reader) {
+  int r;
+
+  if (reader->error)
+    return reader->error;
+
+  /* a number or literal at the top level ends with the document */
+  if (reader->depth == 0 && (reader->state == JSON_STATE_NUMBER ||
+        reader->state == JSON_STATE_LITERAL)) {
+    r = json_end_bare(reader);
+    if (r < 0)
+      return reader->error = r;
+  }
+
+  if (reader->state != JSON_STATE_DONE)
+    return reader->error = -EBADMSG;
+
+  return 0;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,102 @@
+#ifndef _PARSE_H
+#define _PARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Parsers for untrusted server responses and user input. They live apart
+ * from the code using them so that bench/ can measure and fuzz them. */
+
+/* Copy |len| bytes of |in|, dropping anything between < and >. */
+char *html_strip_tags(const char *in, size_t len);
+
+/* The text between the first |start_tag| and the |end_tag| following it,
+ * stripped of tags. Returns -ENOENT if there is no |start_tag|. */
+int html_extract(const char *html, const char *start_tag, const char *end_tag,
+    char **text_out);
+
+/* The error message of an aurweb page, for any aurweb version we know. */
+int html_extract_error(const char *html, char **error_out);
+
+/* Compare host names, ignoring case and port numbers. */
+bool domain_equals(const char *a, const char *b);
+
+/* Split a line of a Netscape cookie file, as returned by libcurl's cookie
+ * engine, in place; the strings point into |line|. Returns -EINVAL on a
+ * malformed line, which may then be partly split. */
+int cookie_parse(char *line, char **domain, long *expire, char **name,
+    char **value);
+
+/* Strip leading and trailing whitespace in place; returns the new length. */
+size_t strtrim(char *str);
+
+enum config_line_t {
+  CONFIG_BLANK,
+  CONFIG_SECTION,
+  CONFIG_ENTRY,
+  CONFIG_INVALID,
+};
+
+/* Classify and split one line of the config file in place. For a section,
+ * |key| is the section name; for an entry, |key| and |value| are trimmed. */
+enum config_line_t config_parse_line(char *line, char **key, char **value);
+
+/* A "key = value" entry of a .SRCINFO. Both point into the parsed buffer and
+ * are not NUL terminated. */
+struct srcinfo_entry_t {
+  const char *key;
+  size_t key_len;
+  const char *value;
+  size_t value_len;
+};
+
+/* Find the next entry in the |len| bytes at |*buf|, skipping blank lines,
+ * comments and lines without an '=', and advance |*buf| and |*len| past it.
+ * Nothing is copied or modified. Returns false at the end of the buffer. */
+bool srcinfo_next(const char **buf, size_t *len, struct srcinfo_entry_t *entry);
+
+/* Whether |entry| has the key |key|. */
+bool srcinfo_key_is(const struct srcinfo_entry_t *entry, const char *key);
+
+/* A streaming JSON reader, fed a response in whatever pieces it arrives in
+ * and reporting every value as soon as it is complete, without building a
+ * tree. */
+typedef struct json_reader_t json_reader_t;
+
+enum json_event_t {
+  JSON_OBJECT_START,
+  JSON_OBJECT_END,
+  JSON_ARRAY_START,
+  JSON_ARRAY_END,
+  JSON_STRING,
+  JSON_NUMBER,
+  JSON_TRUE,
+  JSON_FALSE,
+  JSON_NULL,
+};
+
+/* Called for every value, and again at the end of every object and array.
+ * |key| is the name of the member being read, or NULL outside of an object
+ * and for the end of a container. |depth| is the number of containers around
+ * the value. Strings are unescaped and numbers left as text in |value|,
+ * which is NUL terminated but may hold NULs of its own, so |len| is its true
+ * length; both are only valid during the call. A negative return stops the
+ * reader, and json_reader_feed returns it. */
+typedef int (*json_event_fn)(void *userdata, enum json_event_t event,
+    const char *key, size_t depth, const char *value, size_t len);
+
+int json_reader_new(json_reader_t **ret, json_event_fn callback,
+    void *userdata);
+void json_reader_free(json_reader_t *reader);
+
+/* Read the next |len| bytes of the document. Returns -EBADMSG on malformed
+ * JSON and -E2BIG if it nests too deep or a single token is too long; any
+ * later call returns the same error. */
+int json_reader_feed(json_reader_t *reader, const char *buf, size_t len);
+
+/* Finish the document, which must be complete: returns -EBADMSG if not. */
+int json_reader_finish(json_reader_t *reader);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _PARSE_H */
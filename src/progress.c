@@ -0,0 +1,313 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "progress.h"
+#include "util.h"
+
+#define RENDER_INTERVAL_TTY 0.1
+#define RENDER_INTERVAL_PLAIN 5.0
+/* weight of a new sample in the aggregate rate */
+#define RATE_ALPHA 0.3
+
+struct progress_slot_t {
+  progress_t *progress;
+  struct progress_slot_t *next;
+
+  const char *name;
+  uint64_t size;
+  uint64_t sent;
+  double start;
+  bool active;
+  bool growing;
+};
+
+struct progress_t {
+  pthread_mutex_t lock;
+  FILE *stream;
+  bool tty;
+  bool drawn;
+
+  progress_slot_t *slots;
+
+  uint64_t total_files;
+  uint64_t done_files;
+  uint64_t total_bytes;
+  uint64_t done_bytes;
+
+  double rate;
+  double last_render;
+  double last_sample;
+  uint64_t last_sent;
+};
+
+static const char *format_bytes(char *buf, size_t len, double bytes) {
+  static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+  size_t i = 0;
+
+  while (bytes >= 1024 && i < sizeof(units) / sizeof(units[0]) - 1) {
+    bytes /= 1024;
+    ++i;
+  }
+
+  snprintf(buf, len, i ? "%.1f %s" : "%.0f %s", bytes, units[i]);
+
+  return buf;
+}
+
+static unsigned terminal_width(FILE *stream) {
+  struct winsize ws;
+
+  if (ioctl(fileno(stream), TIOCGWINSZ, &ws) < 0 || ws.ws_col == 0)
+    return 80;
+
+  return ws.ws_col;
+}
+
+int progress_new(progress_t **ret, FILE *stream) {
+  progress_t *progress;
+
+  progress = calloc(1, sizeof(*progress));
+  if (progress == NULL)
+    return -ENOMEM;
+
+  pthread_mutex_init(&progress->lock, NULL);
+  progress->stream = stream;
+  progress->tty = isatty(fileno(stream));
+  progress->last_sample = now_monotonic();
+
+  *ret = progress;
+
+  return 0;
+}
+
+static uint64_t bytes_sent(const progress_t *progress, unsigned *inflight) {
+  uint64_t sent = progress->done_bytes;
+
+  *inflight = 0;
+  for (progress_slot_t *slot = progress->slots; slot; slot = slot->next)
+    if (slot->active) {
+      sent += slot->sent;
+      ++*inflight;
+    }
+
+  return sent;
+}
+
+static void render_tty(progress_t *progress, double now, uint64_t sent,
+    unsigned inflight) {
+  char line[1024], done[32], total[32], rate[32];
+  unsigned width = terminal_width(progress->stream);
+  double eta = -1;
+  int len;
+
+  if (progress->rate > 0 && progress->total_bytes > sent)
+    eta = (progress->total_bytes - sent) / progress->rate;
+
+  len = snprintf(line, sizeof(line), "[%ju/%ju] %u uploading, %s/%s, %s/s",
+      (uintmax_t)progress->done_files, (uintmax_t)progress->total_files,
+      inflight, format_bytes(done, sizeof(done), sent),
+      format_bytes(total, sizeof(total), progress->total_bytes),
+      format_bytes(rate, sizeof(rate), progress->rate));
+  if (eta >= 0 && len > 0 && (size_t)len < sizeof(line))
+    len += snprintf(line + len, sizeof(line) - len, ", ETA %d:%02d",
+        (int)eta / 60, (int)eta % 60);
+
+  for (progress_slot_t *slot = progress->slots; slot; slot = slot->next) {
+    const char *name;
+
+    if (!slot->active || len < 0 || (size_t)len >= sizeof(line))
+      continue;
+
+    name = strrchr(slot->name, '/');
+    len += snprintf(line + len, sizeof(line) - len, " | %s %ju%% %s/s",
+        name ? name + 1 : slot->name,
+        (uintmax_t)(slot->size ? slot->sent * 100 / slot->size : 100),
+        format_bytes(rate, sizeof(rate),
+          now > slot->start ? slot->sent / (now - slot->start) : 0));
+  }
+
+  if (len >= 0 && (size_t)len >= width && width > 0 && width <= sizeof(line))
+    line[width - 1] = '\0';
+
+  fprintf(progress->stream, "\r%s\033[K", line);
+  fflush(progress->stream);
+  progress->drawn = true;
+}
+
+static void render_plain(progress_t *progress, double now, uint64_t sent,
+    unsigned inflight) {
+  double eta = -1;
+
+  if (progress->rate > 0 && progress->total_bytes > sent)
+    eta = (progress->total_bytes - sent) / progress->rate;
+
+  fprintf(progress->stream, "progress: files=%ju/%ju inflight=%u "
+      "bytes=%ju/%ju rate=%.0f eta=%.0f\n",
+      (uintmax_t)progress->done_files, (uintmax_t)progress->total_files,
+      inflight, (uintmax_t)sent, (uintmax_t)progress->total_bytes,
+      progress->rate, eta);
+
+  for (progress_slot_t *slot = progress->slots; slot; slot = slot->next)
+    if (slot->active)
+      fprintf(progress->stream, "progress: file=%s bytes=%ju/%ju rate=%.0f\n",
+          slot->name, (uintmax_t)slot->sent, (uintmax_t)slot->size,
+          now > slot->start ? slot->sent / (now - slot->start) : 0);
+
+  fflush(progress->stream);
+}
+
+/* Called with the lock held. */
+static void render(progress_t *progress, bool force) {
+  double now = now_monotonic();
+  uint64_t sent;
+  unsigned inflight;
+
+  if (!force && now - progress->last_render <
+      (progress->tty ? RENDER_INTERVAL_TTY : RENDER_INTERVAL_PLAIN))
+    return;
+
+  sent = bytes_sent(progress, &inflight);
+
+  if (now > progress->last_sample) {
+    double rate = (sent - progress->last_sent) /
+        (now - progress->last_sample);
+
+    progress->rate = progress->rate > 0 ?
+        progress->rate + RATE_ALPHA * (rate - progress->rate) : rate;
+    progress->last_sample = now;
+    progress->last_sent = sent;
+  }
+
+  if (progress->tty)
+    render_tty(progress, now, sent, inflight);
+  else
+    render_plain(progress, now, sent, inflight);
+
+  progress->last_render = now;
+}
+
+void progress_free(progress_t *progress) {
+  if (progress == NULL)
+    return;
+
+  render(progress, true);
+  if (progress->tty)
+    fputc('\n', progress->stream);
+
+  while (progress->slots) {
+    progress_slot_t *next = progress->slots->next;
+    free(progress->slots);
+    progress->slots = next;
+  }
+
+  pthread_mutex_destroy(&progress->lock);
+  free(progress);
+}
+
+void progress_add(progress_t *progress, uint64_t size) {
+  pthread_mutex_lock(&progress->lock);
+  ++progress->total_files;
+  progress->total_bytes += size;
+  pthread_mutex_unlock(&progress->lock);
+}
+
+void progress_drop(progress_t *progress, uint64_t size) {
+  pthread_mutex_lock(&progress->lock);
+  ++progress->done_files;
+  progress->total_bytes -= size;
+  pthread_mutex_unlock(&progress->lock);
+}
+
+progress_slot_t *progress_slot_new(progress_t *progress) {
+  progress_slot_t *slot;
+
+  slot = calloc(1, sizeof(*slot));
+  if (slot == NULL)
+    return NULL;
+
+  slot->progress = progress;
+
+  pthread_mutex_lock(&progress->lock);
+  slot->next = progress->slots;
+  progress->slots = slot;
+  pthread_mutex_unlock(&progress->lock);
+
+  return slot;
+}
+
+void progress_begin(progress_slot_t *slot, const char *name, uint64_t size) {
+  pthread_mutex_lock(&slot->progress->lock);
+  slot->name = name;
+  slot->growing = size == PROGRESS_SIZE_UNKNOWN;
+  slot->size = slot->growing ? 0 : size;
+  slot->sent = 0;
+  slot->start = now_monotonic();
+  slot->active = true;
+  pthread_mutex_unlock(&slot->progress->lock);
+}
+
+void progress_update(progress_slot_t *slot, uint64_t sent) {
+  progress_t *progress = slot->progress;
+
+  /* don't hold up the transfer if another thread is drawing */
+  if (pthread_mutex_trylock(&progress->lock) != 0)
+    return;
+
+  if (slot->active && slot->growing && sent > slot->size) {
+    progress->total_bytes += sent - slot->size;
+    slot->size = sent;
+  }
+
+  if (slot->active)
+    /* the request body is a little larger than the tarball */
+    slot->sent = sent < slot->size ? sent : slot->size;
+
+  render(progress, false);
+  pthread_mutex_unlock(&progress->lock);
+}
+
+void progress_end(progress_slot_t *slot, bool success) {
+  progress_t *progress = slot->progress;
+
+  pthread_mutex_lock(&progress->lock);
+  slot->active = false;
+  ++progress->done_files;
+  if (success)
+    progress->done_bytes += slot->size;
+  else
+    progress->total_bytes -= slot->size;
+  render(progress, false);
+  pthread_mutex_unlock(&progress->lock);
+}
+
+void progress_printf(progress_t *progress, FILE *stream, const char *format,
+    ...) {
+  va_list ap;
+
+  pthread_mutex_lock(&progress->lock);
+
+  if (progress->drawn) {
+    fputs("\r\033[K", progress->stream);
+    fflush(progress->stream);
+    progress->drawn = false;
+  }
+
+  va_start(ap, format);
+  vfprintf(stream, format, ap);
+  va_end(ap);
+  fflush(stream);
+
+  /* put the status line back right away */
+  if (progress->tty)
+    render(progress, true);
+
+  pthread_mutex_unlock(&progress->lock);
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,42 @@
+#ifndef _PROGRESS_H
+#define _PROGRESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Aggregate progress of an upload batch. On a terminal, a status line is
+ * redrawn at most ten times a second. Otherwise, key=value lines suitable
+ * for machines are emitted every few seconds. */
+typedef struct progress_t progress_t;
+
+/* One in-flight transfer. Each worker owns one slot and reuses it. */
+typedef struct progress_slot_t progress_slot_t;
+
+int progress_new(progress_t **ret, FILE *stream);
+
+/* Draws the final state and releases all slots. */
+void progress_free(progress_t *progress);
+
+/* Account for a file that has been queued for upload. */
+void progress_add(progress_t *progress, uint64_t size);
+/* Account for a queued file that won't be uploaded after all. */
+void progress_drop(progress_t *progress, uint64_t size);
+
+progress_slot_t *progress_slot_new(progress_t *progress);
+
+/* The size of a file read from a pipe, which is only known once it has been
+ * sent: its share of the total grows with every byte. */
+#define PROGRESS_SIZE_UNKNOWN UINT64_MAX
+
+void progress_begin(progress_slot_t *slot, const char *name, uint64_t size);
+void progress_update(progress_slot_t *slot, uint64_t sent);
+void progress_end(progress_slot_t *slot, bool success);
+
+/* Print a line to |stream| without garbling the status line. */
+void progress_printf(progress_t *progress, FILE *stream, const char *format,
+    ...) __attribute__((format(printf, 3, 4)));
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _PROGRESS_H */
@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "queue.h"
+
+struct queue_node_t {
+  void *item;
+  uint64_t seq;
+};
+
+/* A binary heap ordered by the compare function, then by insertion order. */
+struct queue_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  int (*compare)(const void *a, const void *b);
+  struct queue_node_t *heap;
+  size_t len;
+  size_t alloc;
+  uint64_t seq;
+  bool closed;
+};
+
+int queue_new(queue_t **ret, int (*compare)(const void *a, const void *b)) {
+  queue_t *queue;
+
+  queue = calloc(1, sizeof(*queue));
+  if (queue == NULL)
+    return -ENOMEM;
+
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+  queue->compare = compare;
+
+  *ret = queue;
+
+  return 0;
+}
+
+void queue_free(queue_t *queue) {
+  if (queue == NULL)
+    return;
+
+  free(queue->heap);
+  pthread_cond_destroy(&queue->cond);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue);
+}
+
+static bool node_before(const queue_t *queue, const struct queue_node_t *a,
+    const struct queue_node_t *b) {
+  if (queue->compare) {
+    int r = queue->compare(a->item, b->item);
+    if (r != 0)
+      return r < 0;
+  }
+
+  return a->seq < b->seq;
+}
+
+static void swap_nodes(struct queue_node_t *a, struct queue_node_t *b) {
+  struct queue_node_t tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+int queue_push(queue_t *queue, void *item) {
+  size_t i;
+
+  pthread_mutex_lock(&queue->lock);
+
+  if (queue->len == queue->alloc) {
+    size_t alloc = queue->alloc ? queue->alloc * 2 : 64;
+    struct queue_node_t *heap = realloc(queue->heap, alloc * sizeof(*heap));
+
+    if (heap == NULL) {
+      pthread_mutex_unlock(&queue->lock);
+      return -ENOMEM;
+    }
+
+    queue->heap = heap;
+    queue->alloc = alloc;
+  }
+
+  i = queue->len++;
+  queue->heap[i].item = item;
+  queue->heap[i].seq = queue->seq++;
+
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+
+    if (!node_before(queue, &queue->heap[i], &queue->heap[parent]))
+      break;
+
+    swap_nodes(&queue->heap[i], &queue->heap[parent]);
+    i = parent;
+  }
+
+  pthread_cond_signal(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+
+  return 0;
+}
+
+void *queue_pop(queue_t *queue) {
+  void *item = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->len == 0 && !queue->closed)
+    pthread_cond_wait(&queue->cond, &queue->lock);
+
+  if (queue->len > 0) {
+    size_t i = 0;
+
+    item = queue->heap[0].item;
+    queue->heap[0] = queue->heap[--queue->len];
+
+    for (;;) {
+      size_t left = 2 * i + 1, right = left + 1, first = i;
+
+      if (left < queue->len &&
+          node_before(queue, &queue->heap[left], &queue->heap[first]))
+        first = left;
+      if (right < queue->len &&
+          node_before(queue, &queue->heap[right], &queue->heap[first]))
+        first = right;
+      if (first == i)
+        break;
+
+      swap_nodes(&queue->heap[i], &queue->heap[first]);
+      i = first;
+    }
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return item;
+}
+
+void queue_close(queue_t *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = true;
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* vim: set et ts=2 sw=2: */
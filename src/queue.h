@@ -0,0 +1,25 @@
+#ifndef _QUEUE_H
+#define _QUEUE_H
+
+#include <stdbool.h>
+
+/* A blocking queue handing work from producers to upload workers. Items are
+ * handed out in the order given by |compare|, or first in, first out when it
+ * is NULL or considers two items equal. */
+typedef struct queue_t queue_t;
+
+int queue_new(queue_t **ret, int (*compare)(const void *a, const void *b));
+void queue_free(queue_t *queue);
+
+int queue_push(queue_t *queue, void *item);
+
+/* Blocks until an item is available. Returns NULL once the queue has been
+ * closed and drained. */
+void *queue_pop(queue_t *queue);
+
+/* Mark the end of input. Pending items are still handed out. */
+void queue_close(queue_t *queue);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _QUEUE_H */
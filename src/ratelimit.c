@@ -0,0 +1,102 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "util.h"
+
+/* Each grant is at most this fraction of a second's budget. Small quanta keep
+ * the split between transfers fair, and bursts short. */
+#define QUANTA_PER_SECOND 50
+#define QUANTUM_MIN 1024
+
+struct ratelimit_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  double rate;
+  double tokens;
+  double last_refill;
+  size_t quantum;
+};
+
+int ratelimit_new(ratelimit_t **ret, size_t bytes_per_second) {
+  ratelimit_t *ratelimit;
+  pthread_condattr_t attr;
+
+  if (bytes_per_second == 0)
+    return -EINVAL;
+
+  ratelimit = calloc(1, sizeof(*ratelimit));
+  if (ratelimit == NULL)
+    return -ENOMEM;
+
+  pthread_mutex_init(&ratelimit->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ratelimit->cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  ratelimit->rate = bytes_per_second;
+  ratelimit->quantum = bytes_per_second / QUANTA_PER_SECOND;
+  if (ratelimit->quantum < QUANTUM_MIN)
+    ratelimit->quantum = QUANTUM_MIN;
+  ratelimit->last_refill = now_monotonic();
+
+  *ret = ratelimit;
+
+  return 0;
+}
+
+void ratelimit_free(ratelimit_t *ratelimit) {
+  if (ratelimit == NULL)
+    return;
+
+  pthread_cond_destroy(&ratelimit->cond);
+  pthread_mutex_destroy(&ratelimit->lock);
+  free(ratelimit);
+}
+
+size_t ratelimit_get_rate(ratelimit_t *ratelimit) {
+  return (size_t)ratelimit->rate;
+}
+
+size_t ratelimit_take(ratelimit_t *ratelimit, size_t want) {
+  size_t grant;
+
+  if (want == 0)
+    return 0;
+
+  if (want > ratelimit->quantum)
+    want = ratelimit->quantum;
+
+  pthread_mutex_lock(&ratelimit->lock);
+
+  for (;;) {
+    double now = now_monotonic(), wait;
+    struct timespec deadline;
+
+    ratelimit->tokens += (now - ratelimit->last_refill) * ratelimit->rate;
+    if (ratelimit->tokens > ratelimit->quantum)
+      ratelimit->tokens = ratelimit->quantum;
+    ratelimit->last_refill = now;
+
+    if (ratelimit->tokens >= want)
+      break;
+
+    wait = now + (want - ratelimit->tokens) / ratelimit->rate;
+    deadline.tv_sec = (time_t)wait;
+    deadline.tv_nsec = (long)((wait - deadline.tv_sec) * 1e9);
+    pthread_cond_timedwait(&ratelimit->cond, &ratelimit->lock, &deadline);
+  }
+
+  grant = want;
+  ratelimit->tokens -= grant;
+
+  pthread_mutex_unlock(&ratelimit->lock);
+
+  return grant;
+}
+
+/* vim: set et ts=2 sw=2: */
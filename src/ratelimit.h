@@ -0,0 +1,21 @@
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+#include <stddef.h>
+
+/* A bandwidth budget shared by every transfer in the process. Transfers take
+ * bytes in small quanta, so concurrent uploads split the budget evenly. */
+typedef struct ratelimit_t ratelimit_t;
+
+int ratelimit_new(ratelimit_t **ret, size_t bytes_per_second);
+void ratelimit_free(ratelimit_t *ratelimit);
+
+size_t ratelimit_get_rate(ratelimit_t *ratelimit);
+
+/* Blocks until some bytes may be sent, and returns how many, at most
+ * |want|. */
+size_t ratelimit_take(ratelimit_t *ratelimit, size_t want);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _RATELIMIT_H */
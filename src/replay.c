@@ -0,0 +1,585 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "transport.h"
+#include "util.h"
+
+/* Each exchange is stored in a file named after its sequence number:
+ *
+ *   method POST
+ *   url https://aur.archlinux.org/login
+ *   path /login
+ *   time 1700000000
+ *   duration 183021
+ *   field user=me
+ *   file pfile=foo.src.tar.gz
+ *   status 302
+ *   redirect https://aur.archlinux.org/
+ *   header HTTP/1.1 302 Found
+ *   header Location: /
+ *   cookie aur.archlinux.org<TAB>FALSE<TAB>/<TAB>TRUE<TAB>1700086400<TAB>...
+ *   body 0
+ *
+ * The body follows its length verbatim. Times are in seconds since the epoch,
+ * durations in microseconds. */
+#define EXCHANGE_SUFFIX ".exchange"
+/* what stands in for the session in a recording; passwords and the form's
+ * copy of the session are left empty */
+#define REDACTED "redacted"
+
+static inline void curl_slist_freep(struct curl_slist **list) {
+  curl_slist_free_all(*list);
+}
+
+static int exchange_filter(const struct dirent *entry) {
+  size_t len = strlen(entry->d_name);
+
+  return len > strlen(EXCHANGE_SUFFIX) &&
+      streq(entry->d_name + len - strlen(EXCHANGE_SUFFIX), EXCHANGE_SUFFIX);
+}
+
+struct record_t {
+  transport_t transport;
+  transport_t *inner;
+  char *dir;
+
+  pthread_mutex_t lock;
+  unsigned long sequence;
+};
+
+/* The response as it passes through to the real callbacks. */
+struct capture_t {
+  struct transport_exchange_t *exchange;
+  FILE *headers;
+  char *header_data;
+  size_t header_len;
+  FILE *body;
+  char *body_data;
+  size_t body_len;
+};
+
+static size_t capture_header(char *buffer, size_t size, size_t nitems,
+    void *userdata) {
+  struct capture_t *capture = userdata;
+  size_t len = size * nitems, end = len;
+
+  while (end > 0 && (buffer[end - 1] == '\n' || buffer[end - 1] == '\r'))
+    --end;
+  if (end > 12 && strncasecmp(buffer, "Set-Cookie:", 11) == 0 &&
+      strncmp(buffer + 11 + strspn(buffer + 11, " "), "AURSID=", 7) == 0) {
+    const char *attributes = memchr(buffer, ';', end);
+    size_t rest = attributes ? (size_t)(buffer + end - attributes) : 0;
+
+    fprintf(capture->headers, "header Set-Cookie: AURSID=" REDACTED "%.*s\n",
+        (int)rest, attributes ? attributes : "");
+  } else if (end > 0)
+    fprintf(capture->headers, "header %.*s\n", (int)end, buffer);
+
+  return capture->exchange->header_cb(buffer, size, nitems,
+      capture->exchange->header_data);
+}
+
+static size_t capture_body(char *buffer, size_t size, size_t nitems,
+    void *userdata) {
+  struct capture_t *capture = userdata;
+  size_t len;
+
+  len = capture->exchange->body_cb(buffer, size, nitems,
+      capture->exchange->body_data);
+  fwrite(buffer, 1, len, capture->body);
+
+  return len;
+}
+
+static void write_form(FILE *fp, const struct curl_httppost *form) {
+  for (; form; form = form->next) {
+    const char *filename = transport_form_filename(form);
+
+    if (form->name == NULL)
+      continue;
+
+    if (filename)
+      fprintf(fp, "file %s=%s\n", form->name, filename);
+    else if (streq(form->name, "passwd") || streq(form->name, "token"))
+      fprintf(fp, "field %s=\n", form->name);
+    else if (form->contents && strcspn(form->contents, "\n") ==
+        strlen(form->contents))
+      fprintf(fp, "field %s=%s\n", form->name, form->contents);
+  }
+}
+
+/* A cookie in the Netscape format of CURLINFO_COOKIELIST, whose last two
+ * fields are its name and value. The session's value is replaced, so that
+ * a replayed login still leaves a session behind. */
+static void write_cookie(FILE *fp, const char *cookie) {
+  const char *name = cookie;
+
+  for (int i = 0; i < 5 && name; ++i) {
+    name = strchr(name, '\t');
+    if (name)
+      ++name;
+  }
+
+  if (name && strncmp(name, "AURSID\t", 7) == 0)
+    fprintf(fp, "cookie %.*s" REDACTED "\n", (int)(name + 7 - cookie), cookie);
+  else
+    fprintf(fp, "cookie %s\n", cookie);
+}
+
+static int record_write(struct record_t *record, CURL *curl,
+    const struct transport_exchange_t *exchange, struct capture_t *capture,
+    time_t when, uint64_t duration) {
+  _cleanup_(curl_slist_freep) struct curl_slist *cookies = NULL;
+  _cleanup_free_ char *path = NULL, *tmp = NULL;
+  unsigned long sequence;
+  FILE *fp;
+  int fd, r = 0;
+
+  pthread_mutex_lock(&record->lock);
+  sequence = ++record->sequence;
+  pthread_mutex_unlock(&record->lock);
+
+  if (asprintf(&path, "%s/%06lu" EXCHANGE_SUFFIX, record->dir, sequence) < 0 ||
+      asprintf(&tmp, "%s/.%06lu.tmp", record->dir, sequence) < 0)
+    return -ENOMEM;
+
+  /* even redacted, an exchange is nobody else's business */
+  fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (fd < 0)
+    return -errno;
+
+  fp = fdopen(fd, "w");
+  if (fp == NULL) {
+    r = -errno;
+    close(fd);
+    unlink(tmp);
+    return r;
+  }
+
+  fprintf(fp, "method %s\nurl %s\npath %s\ntime %jd\nduration %" PRIu64 "\n",
+      exchange->method, exchange->url, exchange->path, (intmax_t)when,
+      duration);
+  write_form(fp, exchange->form);
+
+  fprintf(fp, "status %ld\n", exchange->status);
+  if (exchange->redirect_url)
+    fprintf(fp, "redirect %s\n", exchange->redirect_url);
+  fwrite(capture->header_data, 1, capture->header_len, fp);
+
+  curl_easy_getinfo(curl, CURLINFO_COOKIELIST, &cookies);
+  for (struct curl_slist *i = cookies; i; i = i->next)
+    write_cookie(fp, i->data);
+
+  fprintf(fp, "body %zu\n", capture->body_len);
+  fwrite(capture->body_data, 1, capture->body_len, fp);
+
+  if (ferror(fp))
+    r = -EIO;
+  if (fclose(fp) != 0 && r == 0)
+    r = -errno;
+  if (r == 0 && rename(tmp, path) < 0)
+    r = -errno;
+  if (r < 0)
+    unlink(tmp);
+
+  return r;
+}
+
+static int record_perform(transport_t *transport, CURL *curl,
+    struct transport_exchange_t *exchange) {
+  struct record_t *record = (struct record_t *)transport;
+  struct transport_exchange_t inner = *exchange;
+  struct capture_t capture = { .exchange = exchange };
+  time_t when = time(NULL);
+  uint64_t start;
+  int r, k;
+
+  capture.headers = open_memstream(&capture.header_data, &capture.header_len);
+  capture.body = open_memstream(&capture.body_data, &capture.body_len);
+  if (capture.headers == NULL || capture.body == NULL) {
+    r = -ENOMEM;
+    goto out;
+  }
+
+  inner.header_cb = capture_header;
+  inner.header_data = &capture;
+  inner.body_cb = capture_body;
+  inner.body_data = &capture;
+
+  start = now_usec();
+  r = transport_perform(record->inner, curl, &inner);
+  exchange->status = inner.status;
+  exchange->redirect_url = inner.redirect_url;
+  if (r < 0)
+    goto out;
+
+  fflush(capture.headers);
+  fflush(capture.body);
+
+  /* losing a recording shouldn't fail the upload */
+  k = record_write(record, curl, exchange, &capture, when, now_usec() - start);
+  if (k < 0)
+    log_warn("failed to record exchange in %s: %s", record->dir,
+        strerror(-k));
+
+out:
+  if (capture.headers)
+    fclose(capture.headers);
+  if (capture.body)
+    fclose(capture.body);
+  free(capture.header_data);
+  free(capture.body_data);
+
+  return r;
+}
+
+static void record_free(transport_t *transport) {
+  struct record_t *record = (struct record_t *)transport;
+
+  pthread_mutex_destroy(&record->lock);
+  free(record->dir);
+  free(record);
+}
+
+int record_new(transport_t **ret, transport_t *inner, const char *dir) {
+  struct dirent **entries;
+  struct record_t *record;
+  int count;
+
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    return -errno;
+
+  count = scandir(dir, &entries, exchange_filter, alphasort);
+  if (count < 0)
+    return -errno;
+
+  record = calloc(1, sizeof(*record));
+  if (record == NULL || (record->dir = strdup(dir)) == NULL) {
+    free(record);
+    for (int i = 0; i < count; ++i)
+      free(entries[i]);
+    free(entries);
+    return -ENOMEM;
+  }
+
+  /* append to an earlier recording rather than overwrite it */
+  for (int i = 0; i < count; ++i) {
+    unsigned long sequence = strtoul(entries[i]->d_name, NULL, 10);
+    if (sequence > record->sequence)
+      record->sequence = sequence;
+    free(entries[i]);
+  }
+  free(entries);
+
+  record->transport.name = "record";
+  record->transport.perform = record_perform;
+  record->transport.free = record_free;
+  record->inner = inner;
+  pthread_mutex_init(&record->lock, NULL);
+
+  *ret = &record->transport;
+
+  return 0;
+}
+
+struct replay_entry_t {
+  char *path;
+  char *files;
+  time_t time;
+  uint64_t duration;
+  long status;
+  char *redirect;
+  struct curl_slist *headers;
+  struct curl_slist *cookies;
+  char *body;
+  size_t body_len;
+  bool used;
+};
+
+struct replay_t {
+  transport_t transport;
+  bool realtime;
+
+  pthread_mutex_t lock;
+  struct replay_entry_t *entries;
+  size_t entry_count;
+};
+
+static void replay_entry_free(struct replay_entry_t *entry) {
+  free(entry->path);
+  free(entry->files);
+  free(entry->redirect);
+  curl_slist_free_all(entry->headers);
+  curl_slist_free_all(entry->cookies);
+  free(entry->body);
+}
+
+static int append_line(struct curl_slist **list, const char *line) {
+  struct curl_slist *l = curl_slist_append(*list, line);
+  if (l == NULL)
+    return -ENOMEM;
+
+  *list = l;
+  return 0;
+}
+
+/* Files uploaded by a request, as "name=filename" joined by newlines. */
+static int append_file(char **files, const char *file) {
+  char *joined;
+
+  if (asprintf(&joined, "%s%s%s", *files ? *files : "", *files ? "\n" : "",
+        file) < 0)
+    return -ENOMEM;
+
+  free(*files);
+  *files = joined;
+
+  return 0;
+}
+
+static int request_files(const struct curl_httppost *form, char **files) {
+  for (; form; form = form->next) {
+    _cleanup_free_ char *file = NULL;
+    const char *filename = transport_form_filename(form);
+    int r;
+
+    if (form->name == NULL || filename == NULL)
+      continue;
+
+    if (asprintf(&file, "%s=%s", form->name, filename) < 0)
+      return -ENOMEM;
+
+    r = append_file(files, file);
+    if (r < 0)
+      return r;
+  }
+
+  return 0;
+}
+
+static int replay_load(const char *filename, struct replay_entry_t *entry) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ char *line = NULL;
+  size_t linesz = 0;
+  ssize_t len;
+  int r = 0;
+
+  fp = fopen(filename, "re");
+  if (fp == NULL)
+    return -errno;
+
+  while (r == 0 && (len = getline(&line, &linesz, fp)) != -1) {
+    char *value;
+
+    if (len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+
+    value = strchr(line, ' ');
+    if (value == NULL)
+      continue;
+    *value++ = '\0';
+
+    if (streq(line, "path"))
+      r = (entry->path = strdup(value)) ? 0 : -ENOMEM;
+    else if (streq(line, "file"))
+      r = append_file(&entry->files, value);
+    else if (streq(line, "time"))
+      entry->time = strtoll(value, NULL, 10);
+    else if (streq(line, "duration"))
+      entry->duration = strtoull(value, NULL, 10);
+    else if (streq(line, "status"))
+      entry->status = strtol(value, NULL, 10);
+    else if (streq(line, "redirect"))
+      r = (entry->redirect = strdup(value)) ? 0 : -ENOMEM;
+    else if (streq(line, "header"))
+      r = append_line(&entry->headers, value);
+    else if (streq(line, "cookie"))
+      r = append_line(&entry->cookies, value);
+    else if (streq(line, "body")) {
+      entry->body_len = strtoull(value, NULL, 10);
+      entry->body = malloc(entry->body_len + 1);
+      if (entry->body == NULL)
+        return -ENOMEM;
+      if (fread(entry->body, 1, entry->body_len, fp) != entry->body_len)
+        return -EBADMSG;
+      entry->body[entry->body_len] = '\0';
+      break;
+    }
+  }
+
+  if (r < 0)
+    return r;
+
+  if (entry->path == NULL || entry->status == 0)
+    return -EBADMSG;
+
+  return 0;
+}
+
+/* Concurrent uploads may have been recorded in any order, so they are told
+ * apart by the files they send. */
+static struct replay_entry_t *replay_take(struct replay_t *replay,
+    const char *path, const char *files) {
+  struct replay_entry_t *entry = NULL;
+
+  pthread_mutex_lock(&replay->lock);
+  for (size_t i = 0; i < replay->entry_count; ++i)
+    if (!replay->entries[i].used && streq(replay->entries[i].path, path) &&
+        streq(replay->entries[i].files ? replay->entries[i].files : "",
+          files ? files : "")) {
+      entry = &replay->entries[i];
+      entry->used = true;
+      break;
+    }
+  pthread_mutex_unlock(&replay->lock);
+
+  return entry;
+}
+
+/* Cookies expire as long after the replay as they did after the recording. */
+static int replay_cookie(CURL *curl, const char *line, time_t shift) {
+  _cleanup_free_ char *domain = NULL, *flag = NULL, *path = NULL,
+      *secure = NULL, *name = NULL, *value = NULL, *cookie = NULL;
+  long long expire;
+
+  if (sscanf(line, "%ms\t%ms\t%ms\t%ms\t%lld\t%ms\t%ms", &domain, &flag,
+        &path, &secure, &expire, &name, &value) != 7)
+    return 0;
+
+  if (expire != 0)
+    expire += shift;
+
+  if (asprintf(&cookie, "%s\t%s\t%s\t%s\t%lld\t%s\t%s", domain, flag, path,
+        secure, expire, name, value) < 0)
+    return -ENOMEM;
+
+  curl_easy_setopt(curl, CURLOPT_COOKIELIST, cookie);
+
+  return 0;
+}
+
+static int replay_perform(transport_t *transport, CURL *curl,
+    struct transport_exchange_t *exchange) {
+  struct replay_t *replay = (struct replay_t *)transport;
+  struct replay_entry_t *entry;
+  _cleanup_free_ char *files = NULL;
+  int r;
+
+  r = request_files(exchange->form, &files);
+  if (r < 0)
+    return r;
+
+  entry = replay_take(replay, exchange->path, files);
+  if (entry == NULL)
+    return -ENOENT;
+
+  if (replay->realtime && entry->duration) {
+    struct timespec ts = {
+      .tv_sec = entry->duration / 1000000,
+      .tv_nsec = (entry->duration % 1000000) * 1000,
+    };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+      ;
+  }
+
+  for (struct curl_slist *i = entry->cookies; i; i = i->next) {
+    r = replay_cookie(curl, i->data, time(NULL) - entry->time);
+    if (r < 0)
+      return r;
+  }
+
+  exchange->status = entry->status;
+  if (entry->redirect) {
+    exchange->redirect_url = strdup(entry->redirect);
+    if (exchange->redirect_url == NULL)
+      return -ENOMEM;
+  }
+
+  for (struct curl_slist *i = entry->headers; i; i = i->next) {
+    _cleanup_free_ char *wire = NULL;
+
+    if (asprintf(&wire, "%s\r\n", i->data) < 0)
+      return -ENOMEM;
+    exchange->header_cb(wire, 1, strlen(wire), exchange->header_data);
+  }
+  exchange->header_cb((char *)"\r\n", 1, 2, exchange->header_data);
+
+  if (entry->body_len && exchange->body_cb(entry->body, 1, entry->body_len,
+        exchange->body_data) != entry->body_len)
+    return -EIO;
+
+  return 0;
+}
+
+static void replay_free(transport_t *transport) {
+  struct replay_t *replay = (struct replay_t *)transport;
+
+  for (size_t i = 0; i < replay->entry_count; ++i)
+    replay_entry_free(&replay->entries[i]);
+
+  pthread_mutex_destroy(&replay->lock);
+  free(replay->entries);
+  free(replay);
+}
+
+int replay_new(transport_t **ret, const char *dir, bool realtime) {
+  struct dirent **entries;
+  struct replay_t *replay;
+  int count, r = 0;
+
+  count = scandir(dir, &entries, exchange_filter, alphasort);
+  if (count < 0)
+    return -errno;
+
+  replay = calloc(1, sizeof(*replay));
+  if (replay)
+    replay->entries = calloc(count ? count : 1, sizeof(*replay->entries));
+  if (replay == NULL || replay->entries == NULL)
+    r = -ENOMEM;
+
+  for (int i = 0; i < count; ++i) {
+    _cleanup_free_ char *filename = NULL;
+
+    if (r == 0 && asprintf(&filename, "%s/%s", dir, entries[i]->d_name) < 0)
+      r = -ENOMEM;
+    if (r == 0)
+      r = replay_load(filename, &replay->entries[replay->entry_count++]);
+
+    free(entries[i]);
+  }
+  free(entries);
+
+  if (r < 0) {
+    if (replay) {
+      for (size_t i = 0; i < replay->entry_count; ++i)
+        replay_entry_free(&replay->entries[i]);
+      free(replay->entries);
+      free(replay);
+    }
+    return r;
+  }
+
+  replay->transport.name = "replay";
+  replay->transport.perform = replay_perform;
+  replay->transport.free = replay_free;
+  replay->realtime = realtime;
+  pthread_mutex_init(&replay->lock, NULL);
+
+  *ret = &replay->transport;
+
+  return 0;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "util.h"
+
+#define STATS_MAGIC "BURPSTAT"
+#define STATS_VERSION 1
+
+/* Latencies in microseconds are bucketed log-linearly, as in an HDR
+ * histogram: values below 2^SUB_BITS get a bucket each, and every power of
+ * two above is split into 2^(SUB_BITS-1) buckets, for an error of at most
+ * 1/16. Latencies are capped at 2^MAX_BITS us, roughly 19 hours. */
+#define SUB_BITS 5
+#define MAX_BITS 36
+#define SUB_COUNT (1 << SUB_BITS)
+#define HALF_COUNT (SUB_COUNT / 2)
+#define LATENCY_BUCKETS (SUB_COUNT + (MAX_BITS - SUB_BITS) * HALF_COUNT)
+
+/* Uploads are split by tarball size: below 16 KiB, 64 KiB, ... 16 MiB, and
+ * above. Requests without a body all land in the first bucket. */
+#define SIZE_BUCKETS 7
+#define SIZE_BUCKET_BASE (16 * 1024)
+
+struct histogram_t {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[LATENCY_BUCKETS];
+};
+
+struct stats_file_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t latency_buckets;
+  uint32_t size_buckets;
+  uint32_t ops;
+  struct histogram_t histograms[_STATS_OP_MAX][SIZE_BUCKETS];
+};
+
+struct stats_t {
+  int fd;
+  struct stats_file_t *file;
+};
+
+static const char *op_names[_STATS_OP_MAX] = {
+  [STATS_LOGIN] = "login",
+  [STATS_UPLOAD] = "upload",
+  [STATS_LOGOUT] = "logout",
+};
+
+static const char *size_names[SIZE_BUCKETS] = {
+  "16KiB", "64KiB", "256KiB", "1MiB", "4MiB", "16MiB", "+Inf",
+};
+
+static unsigned latency_bucket(uint64_t usec) {
+  unsigned msb, shift;
+
+  if (usec < SUB_COUNT)
+    return usec;
+
+  if (usec >= (UINT64_C(1) << MAX_BITS))
+    return LATENCY_BUCKETS - 1;
+
+  msb = 63 - __builtin_clzll(usec);
+  shift = msb - (SUB_BITS - 1);
+
+  /* the top SUB_BITS bits, of which the first is always set */
+  return SUB_COUNT + (shift - 1) * HALF_COUNT +
+      ((usec >> shift) - HALF_COUNT);
+}
+
+/* The largest latency which falls into |bucket|. */
+static uint64_t latency_bucket_limit(unsigned bucket) {
+  unsigned shift;
+
+  if (bucket < SUB_COUNT)
+    return bucket;
+
+  shift = (bucket - SUB_COUNT) / HALF_COUNT + 1;
+
+  return (((uint64_t)((bucket - SUB_COUNT) % HALF_COUNT + HALF_COUNT + 1))
+      << shift) - 1;
+}
+
+static unsigned size_bucket(uint64_t size) {
+  unsigned bucket = 0;
+
+  for (uint64_t limit = SIZE_BUCKET_BASE; size >= limit &&
+      bucket < SIZE_BUCKETS - 1; limit *= 4)
+    ++bucket;
+
+  return bucket;
+}
+
+static bool header_matches(const struct stats_file_t *file) {
+  return memcmp(file->magic, STATS_MAGIC, sizeof(file->magic)) == 0 &&
+      file->version == STATS_VERSION &&
+      file->latency_buckets == LATENCY_BUCKETS &&
+      file->size_buckets == SIZE_BUCKETS &&
+      file->ops == _STATS_OP_MAX;
+}
+
+int stats_open(stats_t **ret, const char *path) {
+  struct stats_file_t header;
+  struct stats_t *stats;
+  struct stat st;
+  int fd, r;
+
+  fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -errno;
+
+  /* serialize initialization against other processes */
+  if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+    r = -errno;
+    goto fail;
+  }
+
+  if (st.st_size == 0) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATS_MAGIC, sizeof(header.magic));
+    header.version = STATS_VERSION;
+    header.latency_buckets = LATENCY_BUCKETS;
+    header.size_buckets = SIZE_BUCKETS;
+    header.ops = _STATS_OP_MAX;
+
+    if (ftruncate(fd, sizeof(struct stats_file_t)) < 0 ||
+        pwrite(fd, &header, offsetof(struct stats_file_t, histograms), 0) < 0) {
+      r = -errno;
+      goto fail;
+    }
+  } else if ((size_t)st.st_size != sizeof(struct stats_file_t)) {
+    r = -EBADMSG;
+    goto fail;
+  }
+
+  stats = calloc(1, sizeof(*stats));
+  if (stats == NULL) {
+    r = -ENOMEM;
+    goto fail;
+  }
+
+  stats->file = mmap(NULL, sizeof(struct stats_file_t), PROT_READ|PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  if (stats->file == MAP_FAILED) {
+    r = -errno;
+    free(stats);
+    goto fail;
+  }
+
+  if (!header_matches(stats->file)) {
+    munmap(stats->file, sizeof(struct stats_file_t));
+    free(stats);
+    r = -EBADMSG;
+    goto fail;
+  }
+
+  flock(fd, LOCK_UN);
+  stats->fd = fd;
+  *ret = stats;
+
+  return 0;
+
+fail:
+  close(fd);
+  return r;
+}
+
+void stats_close(stats_t *stats) {
+  if (stats == NULL)
+    return;
+
+  munmap(stats->file, sizeof(struct stats_file_t));
+  close(stats->fd);
+  free(stats);
+}
+
+void stats_record(stats_t *stats, enum stats_op_t op, uint64_t size,
+    uint64_t usec) {
+  struct histogram_t *h = &stats->file->histograms[op][size_bucket(size)];
+  uint64_t max;
+
+  __atomic_fetch_add(&h->buckets[latency_bucket(usec)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, usec, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (usec > max && !__atomic_compare_exchange_n(&h->max, &max, usec,
+        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* Take a consistent enough copy of a histogram which may be updated by other
+ * processes while we read it. */
+static void histogram_snapshot(const struct histogram_t *h,
+    struct histogram_t *out) {
+  out->count = 0;
+  for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+    out->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+    out->count += out->buckets[i];
+  }
+  out->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+  out->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+static uint64_t histogram_percentile(const struct histogram_t *h,
+    double percentile) {
+  uint64_t rank, seen = 0;
+
+  rank = (uint64_t)(h->count * percentile / 100.0 + 0.5);
+  if (rank == 0)
+    rank = 1;
+
+  for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t limit = latency_bucket_limit(i);
+      return limit < h->max ? limit : h->max;
+    }
+  }
+
+  return h->max;
+}
+
+static const char *format_usec(char *buf, size_t len, uint64_t usec) {
+  if (usec < 1000)
+    snprintf(buf, len, "%" PRIu64 "us", usec);
+  else if (usec < 1000000)
+    snprintf(buf, len, "%.1fms", usec / 1e3);
+  else
+    snprintf(buf, len, "%.2fs", usec / 1e6);
+
+  return buf;
+}
+
+void stats_report(stats_t *stats, FILE *stream) {
+  struct histogram_t h;
+
+  fprintf(stream, "%-8s %-8s %10s %10s %10s %10s\n", "request", "size",
+      "count", "p50", "p99", "max");
+
+  for (unsigned op = 0; op < _STATS_OP_MAX; ++op)
+    for (unsigned size = 0; size < SIZE_BUCKETS; ++size) {
+      char p50[16], p99[16], max[16];
+
+      histogram_snapshot(&stats->file->histograms[op][size], &h);
+      if (h.count == 0)
+        continue;
+
+      fprintf(stream, "%-8s %-8s %10" PRIu64 " %10s %10s %10s\n",
+          op_names[op], op == STATS_UPLOAD ? size_names[size] : "-", h.count,
+          format_usec(p50, sizeof(p50), histogram_percentile(&h, 50)),
+          format_usec(p99, sizeof(p99), histogram_percentile(&h, 99)),
+          format_usec(max, sizeof(max), h.max));
+    }
+}
+
+/* Bucket boundaries of the exported histogram, in seconds. */
+static const double export_buckets[] = {
+  0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300,
+};
+
+static void export_histogram(FILE *fp, const char *op, const char *size,
+    const struct histogram_t *h) {
+  unsigned i = 0;
+  uint64_t seen = 0;
+
+  for (size_t b = 0; b < ARRAYSIZE(export_buckets); ++b) {
+    uint64_t limit = export_buckets[b] * 1e6;
+
+    for (; i < LATENCY_BUCKETS && latency_bucket_limit(i) <= limit; ++i)
+      seen += h->buckets[i];
+
+    fprintf(fp, "burp_request_duration_seconds_bucket{request=\"%s\","
+        "size=\"%s\",le=\"%g\"} %" PRIu64 "\n", op, size, export_buckets[b],
+        seen);
+  }
+
+  fprintf(fp, "burp_request_duration_seconds_bucket{request=\"%s\","
+      "size=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", op, size, h->count);
+  fprintf(fp, "burp_request_duration_seconds_sum{request=\"%s\",size=\"%s\"} "
+      "%.6f\n", op, size, h->sum / 1e6);
+  fprintf(fp, "burp_request_duration_seconds_count{request=\"%s\","
+      "size=\"%s\"} %" PRIu64 "\n", op, size, h->count);
+}
+
+int stats_export_prometheus(stats_t *stats, const char *path) {
+  _cleanup_free_ char *tmp = NULL;
+  struct histogram_t h;
+  FILE *fp;
+  int r = 0;
+
+  if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+    return -ENOMEM;
+
+  {
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0)
+      return -errno;
+
+    fchmod(fd, 0644);
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+      r = -errno;
+      close(fd);
+      unlink(tmp);
+      return r;
+    }
+  }
+
+  fputs("# HELP burp_request_duration_seconds Latency of requests to the AUR.\n"
+      "# TYPE burp_request_duration_seconds histogram\n", fp);
+
+  for (unsigned op = 0; op < _STATS_OP_MAX; ++op)
+    for (unsigned size = 0; size < SIZE_BUCKETS; ++size) {
+      histogram_snapshot(&stats->file->histograms[op][size], &h);
+      if (h.count == 0)
+        continue;
+
+      export_histogram(fp, op_names[op],
+          op == STATS_UPLOAD ? size_names[size] : "none", &h);
+    }
+
+  if (ferror(fp))
+    r = -EIO;
+  if (fclose(fp) != 0 && r == 0)
+    r = -errno;
+  if (r == 0 && rename(tmp, path) < 0)
+    r = -errno;
+  if (r < 0)
+    unlink(tmp);
+
+  return r;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,38 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Latency histograms kept across runs in a small memory mapped file. Counts
+ * are updated with atomic adds on the shared mapping, so several burp
+ * processes may record into the same file at once. */
+typedef struct stats_t stats_t;
+
+enum stats_op_t {
+  STATS_LOGIN,
+  STATS_UPLOAD,
+  STATS_LOGOUT,
+  _STATS_OP_MAX,
+};
+
+/* Map |path|, creating and initializing it if it doesn't exist yet. Returns
+ * -EBADMSG if the file exists but isn't a stats file of this version. */
+int stats_open(stats_t **ret, const char *path);
+void stats_close(stats_t *stats);
+
+/* Record one request of |op|, sending |size| bytes, which took |usec|
+ * microseconds. Safe to call from any thread or process; O(1). */
+void stats_record(stats_t *stats, enum stats_op_t op, uint64_t size,
+    uint64_t usec);
+
+/* A table of request count and latency percentiles per operation and size. */
+void stats_report(stats_t *stats, FILE *stream);
+
+/* Export in the Prometheus text format. The file is replaced atomically, as
+ * the node exporter's textfile collector expects. */
+int stats_export_prometheus(stats_t *stats, const char *path);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _STATS_H */
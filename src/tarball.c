@@ -0,0 +1,1045 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lzma.h>
+#include <zlib.h>
+
+#include "parse.h"
+#include "tarball.h"
+#include "util.h"
+
+#define TAR_BLOCKSIZE 512
+#define TAR_MEMBER_MAX (16 * 1024 * 1024)
+
+struct tar_header_t {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+};
+
+#define XZ_BUFSIZE (64 * 1024)
+
+/* The decompressed contents of a tarball. gzip compressed and plain tarballs
+ * are read through zlib, xz compressed ones through liblzma. Either way,
+ * nothing is decompressed beyond what has been asked for. */
+struct tar_input_t {
+  gzFile gz;
+
+  int fd;
+  lzma_stream xz;
+  uint8_t *xz_buf;
+  bool xz_eof;
+};
+
+static bool is_xz(int fd) {
+  static const uint8_t magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+  uint8_t buf[sizeof(magic)];
+
+  return pread(fd, buf, sizeof(buf), 0) == sizeof(buf) &&
+      memcmp(buf, magic, sizeof(magic)) == 0;
+}
+
+const char *tarball_suffix_fd(int fd) {
+  static const uint8_t gzip_magic[] = { 0x1f, 0x8b };
+  uint8_t buf[sizeof(gzip_magic)];
+
+  if (is_xz(fd))
+    return ".src.tar.xz";
+
+  if (pread(fd, buf, sizeof(buf), 0) == sizeof(buf) &&
+      memcmp(buf, gzip_magic, sizeof(gzip_magic)) == 0)
+    return ".src.tar.gz";
+
+  return ".src.tar";
+}
+
+static bool has_suffix(const char *name, const char *suffix) {
+  size_t len = strlen(name), suffix_len = strlen(suffix);
+
+  return len > suffix_len && streq(name + len - suffix_len, suffix);
+}
+
+bool tarball_name_is_source(const char *name) {
+  return name[0] != '.' && (has_suffix(name, ".src.tar") ||
+      has_suffix(name, ".src.tar.gz") || has_suffix(name, ".src.tar.xz"));
+}
+
+static void input_close(struct tar_input_t *in) {
+  if (in->gz)
+    gzclose(in->gz);
+
+  if (in->xz_buf) {
+    lzma_end(&in->xz);
+    free(in->xz_buf);
+    close(in->fd);
+  }
+}
+
+/* Takes ownership of |fd|, which is read from its current offset. */
+static int input_open(struct tar_input_t *in, int fd) {
+  static const lzma_stream xz_init = LZMA_STREAM_INIT;
+
+  if (!is_xz(fd)) {
+    errno = 0;
+    in->gz = gzdopen(fd, "rb");
+    if (in->gz == NULL) {
+      close(fd);
+      return errno ? -errno : -ENOMEM;
+    }
+
+    /* zlib inflates twice this much ahead; most reads stop within the
+     * first few blocks, so keep it small */
+    gzbuffer(in->gz, 8 * 1024);
+    return 0;
+  }
+
+  in->xz_buf = malloc(XZ_BUFSIZE);
+  if (in->xz_buf == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+
+  in->fd = fd;
+  in->xz = xz_init;
+  if (lzma_stream_decoder(&in->xz, UINT64_MAX, LZMA_CONCATENATED) !=
+      LZMA_OK) {
+    free(in->xz_buf);
+    in->xz_buf = NULL;
+    close(fd);
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+static ssize_t xz_read(struct tar_input_t *in, void *buf, size_t len) {
+  in->xz.next_out = buf;
+  in->xz.avail_out = len;
+
+  while (in->xz.avail_out > 0) {
+    lzma_ret ret;
+
+    if (in->xz.avail_in == 0 && !in->xz_eof) {
+      ssize_t n = read(in->fd, in->xz_buf, XZ_BUFSIZE);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        return -errno;
+      }
+
+      in->xz.next_in = in->xz_buf;
+      in->xz.avail_in = n;
+      in->xz_eof = n == 0;
+    }
+
+    ret = lzma_code(&in->xz, in->xz_eof ? LZMA_FINISH : LZMA_RUN);
+    if (ret == LZMA_STREAM_END || (ret == LZMA_BUF_ERROR && in->xz_eof))
+      break;
+    if (ret != LZMA_OK)
+      return ret == LZMA_MEM_ERROR ? -ENOMEM : -EBADMSG;
+  }
+
+  return len - in->xz.avail_out;
+}
+
+static int read_exact(struct tar_input_t *in, void *buf, size_t len) {
+  ssize_t r;
+
+  if (in->gz) {
+    r = gzread(in->gz, buf, len);
+    if (r < 0)
+      return -EIO;
+  } else {
+    r = xz_read(in, buf, len);
+    if (r < 0)
+      return r;
+  }
+
+  if ((size_t)r != len)
+    return -EBADMSG;
+
+  return 0;
+}
+
+static uint64_t padding(uint64_t len) {
+  return (TAR_BLOCKSIZE - len % TAR_BLOCKSIZE) % TAR_BLOCKSIZE;
+}
+
+static int skip_bytes(struct tar_input_t *in, uint64_t len) {
+  char buf[16 * 1024];
+
+  if (len == 0)
+    return 0;
+
+  if (in->gz) {
+    if (gzseek(in->gz, len, SEEK_CUR) < 0)
+      return -EIO;
+    return 0;
+  }
+
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? len : sizeof(buf);
+    int r = read_exact(in, buf, n);
+    if (r < 0)
+      return r;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static int skip_padded(struct tar_input_t *in, uint64_t len) {
+  return skip_bytes(in, len + padding(len));
+}
+
+static int read_padded(struct tar_input_t *in, uint64_t len, char **data) {
+  char *buf;
+  int r;
+
+  if (len > TAR_MEMBER_MAX)
+    return -EFBIG;
+
+  buf = malloc(len + 1);
+  if (buf == NULL)
+    return -ENOMEM;
+
+  r = read_exact(in, buf, len);
+  if (r == 0)
+    r = skip_bytes(in, padding(len));
+  if (r < 0) {
+    free(buf);
+    return r;
+  }
+
+  buf[len] = '\0';
+  *data = buf;
+
+  return 0;
+}
+
+static uint64_t parse_number(const char *field, size_t len) {
+  uint64_t n = 0;
+
+  /* GNU base-256 encoding for values which don't fit in octal */
+  if ((unsigned char)field[0] & 0x80) {
+    n = (unsigned char)field[0] & 0x7f;
+    for (size_t i = 1; i < len; ++i)
+      n = (n << 8) | (unsigned char)field[i];
+    return n;
+  }
+
+  while (len > 0 && *field == ' ')
+    ++field, --len;
+
+  for (size_t i = 0; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    n = (n << 3) | (field[i] - '0');
+
+  return n;
+}
+
+static bool header_is_valid(const struct tar_header_t *h) {
+  const unsigned char *p = (const unsigned char *)h;
+  uint64_t sum = 0;
+
+  /* the checksum is computed with its own field filled with spaces */
+  for (size_t i = 0; i < TAR_BLOCKSIZE; ++i)
+    sum += (i >= offsetof(struct tar_header_t, chksum) &&
+        i < offsetof(struct tar_header_t, typeflag)) ? ' ' : p[i];
+
+  return sum == parse_number(h->chksum, sizeof(h->chksum));
+}
+
+static char *pax_find_path(char *records, size_t len) {
+  char *p = records, *end = records + len;
+
+  /* each record is "LEN key=value\n" where LEN counts the whole record */
+  while (p < end) {
+    char *key, *value;
+    unsigned long reclen;
+
+    reclen = strtoul(p, &key, 10);
+    if (reclen == 0 || key == p || *key != ' ' || reclen > (size_t)(end - p))
+      return NULL;
+
+    ++key;
+    value = p + reclen - 1;
+    if (*value != '\n')
+      return NULL;
+    *value = '\0';
+
+    if (strncmp(key, "path=", 5) == 0)
+      return strdup(key + 5);
+
+    p += reclen;
+  }
+
+  return NULL;
+}
+
+struct tar_reader_t {
+  struct tar_input_t in;
+  char *longname;
+  char name[155 + 1 + 100 + 1];
+
+  /* the current entry */
+  const char *path;
+  uint64_t size;
+  mode_t mode;
+  char typeflag;
+  bool consumed;
+};
+
+static void tar_reader_close(struct tar_reader_t *tar) {
+  input_close(&tar->in);
+  free(tar->longname);
+}
+#define _cleanup_tar_reader_ _cleanup_(tar_reader_close)
+
+/* Opens |path|, or if it is NULL, reads |fd| from its start. */
+static int tar_reader_open(struct tar_reader_t *tar, const char *path,
+    int fd) {
+  memset(tar, 0, sizeof(*tar));
+  tar->consumed = true;
+
+  if (path)
+    fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+  else if (lseek(fd, 0, SEEK_SET) < 0)
+    return -errno;
+  else
+    fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+
+  return input_open(&tar->in, fd);
+}
+
+/* Advance to the next entry, skipping over the data of the current one.
+ * Returns -ENOENT at the end of the archive. */
+static int tar_next(struct tar_reader_t *tar) {
+  union {
+    struct tar_header_t h;
+    char block[TAR_BLOCKSIZE];
+  } hdr;
+  int r;
+
+  if (!tar->consumed) {
+    r = skip_padded(&tar->in, tar->size);
+    if (r < 0)
+      return r;
+  }
+
+  free(tar->longname);
+  tar->longname = NULL;
+
+  for (;;) {
+    r = read_exact(&tar->in, hdr.block, sizeof(hdr.block));
+    if (r < 0)
+      return r;
+
+    /* a zeroed block marks the end of the archive */
+    if (hdr.block[0] == '\0')
+      return -ENOENT;
+
+    if (!header_is_valid(&hdr.h))
+      return -EBADMSG;
+
+    tar->size = parse_number(hdr.h.size, sizeof(hdr.h.size));
+    tar->mode = parse_number(hdr.h.mode, sizeof(hdr.h.mode)) & 07777;
+    tar->typeflag = hdr.h.typeflag;
+
+    switch (hdr.h.typeflag) {
+    case 'L':  /* GNU long name applying to the next header */
+    case 'x':  /* pax extended header applying to the next header */
+      {
+        _cleanup_free_ char *ext = NULL;
+
+        r = read_padded(&tar->in, tar->size, &ext);
+        if (r < 0)
+          return r;
+
+        free(tar->longname);
+        if (hdr.h.typeflag == 'L') {
+          tar->longname = ext;
+          ext = NULL;
+        } else
+          tar->longname = pax_find_path(ext, tar->size);
+      }
+      continue;
+    case 'g':  /* pax global header */
+      r = skip_padded(&tar->in, tar->size);
+      if (r < 0)
+        return r;
+      continue;
+    }
+
+    break;
+  }
+
+  if (strncmp(hdr.h.magic, "ustar", 5) == 0 && hdr.h.prefix[0] != '\0')
+    snprintf(tar->name, sizeof(tar->name), "%.*s/%.*s",
+        (int)sizeof(hdr.h.prefix), hdr.h.prefix,
+        (int)sizeof(hdr.h.name), hdr.h.name);
+  else
+    snprintf(tar->name, sizeof(tar->name), "%.*s", (int)sizeof(hdr.h.name),
+        hdr.h.name);
+
+  tar->path = tar->longname ? tar->longname : tar->name;
+  while (strncmp(tar->path, "./", 2) == 0)
+    tar->path += 2;
+
+  tar->consumed = false;
+
+  return 0;
+}
+
+static int tar_read_data(struct tar_reader_t *tar, char **data) {
+  tar->consumed = true;
+  return read_padded(&tar->in, tar->size, data);
+}
+
+static bool tar_is_regular(const struct tar_reader_t *tar) {
+  return tar->typeflag == '0' || tar->typeflag == '\0';
+}
+
+static bool member_matches(const char *name, const char *member) {
+  const char *slash;
+
+  /* source tarballs are rooted at a single pkgbase directory */
+  slash = strchr(name, '/');
+  if (slash == NULL)
+    return false;
+
+  return streq(slash + 1, member);
+}
+
+static bool is_directory(const char *path) {
+  struct stat st;
+
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int read_file_at(int dirfd, const char *name, char **data,
+    size_t *len) {
+  _cleanup_close_ int fd = -1;
+  struct stat st;
+  char *buf;
+  size_t n = 0;
+
+  fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+  if (fd < 0)
+    return -errno;
+
+  if (fstat(fd, &st) < 0)
+    return -errno;
+
+  if (!S_ISREG(st.st_mode))
+    return -EINVAL;
+
+  if (st.st_size > TAR_MEMBER_MAX)
+    return -EFBIG;
+
+  buf = malloc(st.st_size + 1);
+  if (buf == NULL)
+    return -ENOMEM;
+
+  while (n < (size_t)st.st_size) {
+    ssize_t k = read(fd, buf + n, st.st_size - n);
+    if (k <= 0) {
+      free(buf);
+      return k < 0 ? -errno : -EIO;
+    }
+    n += k;
+  }
+
+  buf[n] = '\0';
+  *data = buf;
+  if (len)
+    *len = n;
+
+  return 0;
+}
+
+static int read_file(const char *dir, const char *name, char **data,
+    size_t *len) {
+  _cleanup_close_ int dirfd = -1;
+
+  dirfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (dirfd < 0)
+    return -errno;
+
+  return read_file_at(dirfd, name, data, len);
+}
+
+static bool is_remote_source(const char *source) {
+  return strstr(source, "://") != NULL;
+}
+
+/* Split the .SRCINFO of a package directory in place into its pkgbase and,
+ * if |ret| is given, the files makepkg --source would pack: the PKGBUILD,
+ * the .SRCINFO, and whatever install scripts, changelogs and local sources
+ * it names. The strings point into |srcinfo|. */
+static int srcinfo_parse(char *srcinfo, const char **pkgbase,
+    const char ***ret, size_t *ret_count) {
+  const char **files = NULL;
+  size_t count = 2, alloc = 16;
+  char *line, *p = srcinfo;
+
+  *pkgbase = NULL;
+
+  if (ret) {
+    files = malloc(alloc * sizeof(*files));
+    if (files == NULL)
+      return -ENOMEM;
+    files[0] = "PKGBUILD";
+    files[1] = ".SRCINFO";
+  }
+
+  while ((line = strsep(&p, "\n")) != NULL) {
+    char *key, *value, *file, *rename;
+    bool seen = false;
+
+    if (config_parse_line(line, &key, &value) != CONFIG_ENTRY)
+      continue;
+
+    if (streq(key, "pkgbase") && *pkgbase == NULL) {
+      *pkgbase = value;
+      if (ret == NULL)
+        return 0;
+    }
+
+    if (ret == NULL)
+      continue;
+
+    if (!streq(key, "install") && !streq(key, "changelog") &&
+        strncmp(key, "source", 6) != 0)
+      continue;
+
+    if (is_remote_source(value))
+      continue;
+
+    /* like makepkg, look for a local source under the name it's given
+     * with "name::", if any */
+    file = value;
+    rename = strstr(value, "::");
+    if (rename)
+      *rename = '\0';
+    if (strrchr(file, '/'))
+      file = strrchr(file, '/') + 1;
+    if (*file == '\0')
+      continue;
+
+    for (size_t i = 0; i < count && !seen; ++i)
+      seen = streq(files[i], file);
+    if (seen)
+      continue;
+
+    if (count == alloc) {
+      const char **grown = realloc(files, alloc * 2 * sizeof(*files));
+      if (grown == NULL) {
+        free(files);
+        return -ENOMEM;
+      }
+      files = grown;
+      alloc *= 2;
+    }
+    files[count++] = file;
+  }
+
+  if (*pkgbase == NULL || **pkgbase == '\0') {
+    free(files);
+    return -EBADMSG;
+  }
+
+  if (ret) {
+    *ret = files;
+    *ret_count = count;
+  }
+
+  return 0;
+}
+
+static int read_pkgbase(const char *path, int fd, char **pkgbase) {
+  _cleanup_tar_reader_ struct tar_reader_t tar = { .longname = NULL };
+  char *out;
+  int r;
+
+  r = tar_reader_open(&tar, path, fd);
+  if (r < 0)
+    return r;
+
+  r = tar_next(&tar);
+  if (r < 0)
+    return r == -ENOENT ? -EBADMSG : r;
+
+  out = strndup(tar.path, strcspn(tar.path, "/"));
+  if (out == NULL)
+    return -ENOMEM;
+
+  *pkgbase = out;
+
+  return 0;
+}
+
+int tarball_read_pkgbase_fd(int fd, char **pkgbase) {
+  return read_pkgbase(NULL, fd, pkgbase);
+}
+
+static int read_files(const char *path, int fd, tarball_file_fn callback,
+    void *userdata) {
+  _cleanup_tar_reader_ struct tar_reader_t tar = { .longname = NULL };
+  int r;
+
+  r = tar_reader_open(&tar, path, fd);
+  if (r < 0)
+    return r;
+
+  while ((r = tar_next(&tar)) == 0) {
+    _cleanup_free_ char *data = NULL;
+    struct tarball_file_t file;
+    const char *slash;
+
+    /* source tarballs are rooted at a single pkgbase directory */
+    slash = strchr(tar.path, '/');
+    if (!tar_is_regular(&tar) || slash == NULL || slash[1] == '\0')
+      continue;
+
+    r = tar_read_data(&tar, &data);
+    if (r < 0)
+      return r;
+
+    file.name = slash + 1;
+    file.mode = tar.mode;
+    file.data = data;
+    file.len = tar.size;
+
+    r = callback(userdata, &file);
+    if (r < 0)
+      return r;
+  }
+
+  return r == -ENOENT ? 0 : r;
+}
+
+static int read_directory_files(const char *dir, tarball_file_fn callback,
+    void *userdata) {
+  _cleanup_free_ char *srcinfo = NULL;
+  _cleanup_free_ const char **files = NULL;
+  _cleanup_close_ int dirfd = -1;
+  const char *pkgbase;
+  size_t file_count;
+  int r;
+
+  dirfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (dirfd < 0)
+    return -errno;
+
+  r = read_file_at(dirfd, ".SRCINFO", &srcinfo, NULL);
+  if (r < 0)
+    return r;
+
+  r = srcinfo_parse(srcinfo, &pkgbase, &files, &file_count);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < file_count; ++i) {
+    _cleanup_free_ char *data = NULL;
+    struct tarball_file_t file;
+    struct stat st;
+
+    if (fstatat(dirfd, files[i], &st, 0) < 0)
+      return -errno;
+
+    r = read_file_at(dirfd, files[i], &data, &file.len);
+    if (r < 0)
+      return r;
+
+    file.name = files[i];
+    file.mode = st.st_mode & 07777;
+    file.data = data;
+
+    r = callback(userdata, &file);
+    if (r < 0)
+      return r;
+  }
+
+  return 0;
+}
+
+int tarball_read_files(const char *path, tarball_file_fn callback,
+    void *userdata) {
+  if (is_directory(path))
+    return read_directory_files(path, callback, userdata);
+
+  return read_files(path, -1, callback, userdata);
+}
+
+int tarball_read_files_fd(int fd, tarball_file_fn callback, void *userdata) {
+  return read_files(NULL, fd, callback, userdata);
+}
+
+void tarball_info_free(struct tarball_info_t *info) {
+  free(info->pkgbase);
+  free(info->pkgver);
+  free(info->pkgrel);
+  free(info->epoch);
+  free(info->version);
+  memset(info, 0, sizeof(*info));
+}
+
+static int copy_value(char **field, const struct srcinfo_entry_t *entry) {
+  if (*field)
+    return 0;
+
+  *field = strndup(entry->value, entry->value_len);
+  return *field ? 0 : -ENOMEM;
+}
+
+/* Only the pkgbase section, which comes first, is looked at: split packages
+ * can't override the version. */
+static int srcinfo_info(const char *srcinfo, size_t len,
+    struct tarball_info_t *info) {
+  struct srcinfo_entry_t entry;
+  int r = 0;
+
+  memset(info, 0, sizeof(*info));
+
+  while (r == 0 && srcinfo_next(&srcinfo, &len, &entry)) {
+    if (srcinfo_key_is(&entry, "pkgname"))
+      break;
+    else if (srcinfo_key_is(&entry, "pkgbase"))
+      r = copy_value(&info->pkgbase, &entry);
+    else if (srcinfo_key_is(&entry, "pkgver"))
+      r = copy_value(&info->pkgver, &entry);
+    else if (srcinfo_key_is(&entry, "pkgrel"))
+      r = copy_value(&info->pkgrel, &entry);
+    else if (srcinfo_key_is(&entry, "epoch"))
+      r = copy_value(&info->epoch, &entry);
+  }
+
+  if (r == 0 && (info->pkgbase == NULL || info->pkgver == NULL ||
+        info->pkgrel == NULL))
+    r = -EBADMSG;
+
+  if (r == 0 && asprintf(&info->version, "%s%s%s-%s",
+        info->epoch ? info->epoch : "", info->epoch ? ":" : "", info->pkgver,
+        info->pkgrel) < 0) {
+    info->version = NULL;
+    r = -ENOMEM;
+  }
+
+  if (r < 0)
+    tarball_info_free(info);
+
+  return r;
+}
+
+void tarball_head_free(struct tarball_head_t *head) {
+  free(head->dirname);
+  free(head->srcinfo);
+  free(head->pkgbuild);
+  memset(head, 0, sizeof(*head));
+}
+
+static int read_head(const char *path, int fd, struct tarball_head_t *head) {
+  _cleanup_tar_reader_ struct tar_reader_t tar = { .longname = NULL };
+  int r;
+
+  r = tar_reader_open(&tar, path, fd);
+  if (r < 0)
+    return r;
+
+  while ((head->srcinfo == NULL || head->pkgbuild == NULL) &&
+      (r = tar_next(&tar)) == 0) {
+    if (head->dirname == NULL) {
+      head->dirname = strndup(tar.path, strcspn(tar.path, "/"));
+      if (head->dirname == NULL)
+        return -ENOMEM;
+    }
+
+    if (!tar_is_regular(&tar))
+      continue;
+
+    if (head->srcinfo == NULL && member_matches(tar.path, ".SRCINFO")) {
+      r = tar_read_data(&tar, &head->srcinfo);
+      if (r < 0)
+        return r;
+      head->srcinfo_len = tar.size;
+    } else if (head->pkgbuild == NULL && member_matches(tar.path, "PKGBUILD")) {
+      r = tar_read_data(&tar, &head->pkgbuild);
+      if (r < 0)
+        return r;
+    }
+  }
+
+  return r == -ENOENT ? 0 : r;
+}
+
+static int read_directory_head(const char *dir, struct tarball_head_t *head) {
+  int r;
+
+  r = read_file(dir, ".SRCINFO", &head->srcinfo, &head->srcinfo_len);
+  if (r < 0 && r != -ENOENT)
+    return r;
+
+  r = read_file(dir, "PKGBUILD", &head->pkgbuild, NULL);
+
+  return r == -ENOENT ? 0 : r;
+}
+
+int tarball_read_head(const char *path, struct tarball_head_t *head) {
+  memset(head, 0, sizeof(*head));
+
+  if (is_directory(path))
+    return read_directory_head(path, head);
+
+  return read_head(path, -1, head);
+}
+
+int tarball_read_head_fd(int fd, struct tarball_head_t *head) {
+  memset(head, 0, sizeof(*head));
+
+  return read_head(NULL, fd, head);
+}
+
+int tarball_head_info(const struct tarball_head_t *head,
+    struct tarball_info_t *info) {
+  if (head->srcinfo == NULL)
+    return -ENOENT;
+
+  return srcinfo_info(head->srcinfo, head->srcinfo_len, info);
+}
+
+struct tar_writer_t {
+  z_stream z;
+  bool z_open;
+
+  char *data;
+  size_t len;
+  size_t alloc;
+
+  time_t mtime;
+};
+
+static void tar_writer_close(struct tar_writer_t *tar) {
+  if (tar->z_open)
+    deflateEnd(&tar->z);
+  free(tar->data);
+}
+#define _cleanup_tar_writer_ _cleanup_(tar_writer_close)
+
+static int tar_writer_open(struct tar_writer_t *tar) {
+  memset(tar, 0, sizeof(*tar));
+
+  /* a window of 15 bits plus 16 makes deflate write a gzip wrapper */
+  if (deflateInit2(&tar->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    return -ENOMEM;
+  tar->z_open = true;
+
+  return 0;
+}
+
+/* Compress |len| bytes onto the end of the output, which grows as needed. */
+static int tar_write(struct tar_writer_t *tar, const void *buf, size_t len,
+    int flush) {
+  int r;
+
+  tar->z.next_in = (Bytef *)buf;
+  tar->z.avail_in = len;
+
+  do {
+    if (tar->alloc - tar->len < 16 * 1024) {
+      size_t alloc = tar->alloc ? tar->alloc * 2 : 64 * 1024;
+      char *data = realloc(tar->data, alloc);
+      if (data == NULL)
+        return -ENOMEM;
+
+      tar->data = data;
+      tar->alloc = alloc;
+    }
+
+    tar->z.next_out = (Bytef *)tar->data + tar->len;
+    tar->z.avail_out = tar->alloc - tar->len;
+
+    r = deflate(&tar->z, flush);
+    if (r == Z_STREAM_ERROR)
+      return -EIO;
+
+    tar->len = tar->alloc - tar->z.avail_out;
+  } while (tar->z.avail_in > 0 || (flush == Z_FINISH && r != Z_STREAM_END));
+
+  return 0;
+}
+
+static void format_number(char *field, size_t len, uint64_t n) {
+  snprintf(field, len, "%0*jo", (int)len - 1, (uintmax_t)n);
+}
+
+static int tar_write_header(struct tar_writer_t *tar, const char *prefix,
+    const char *name, char typeflag, mode_t mode, uint64_t size,
+    time_t mtime) {
+  union {
+    struct tar_header_t h;
+    unsigned char block[TAR_BLOCKSIZE];
+  } hdr;
+  unsigned sum = 0;
+
+  if (strlen(prefix) > sizeof(hdr.h.prefix) ||
+      strlen(name) > sizeof(hdr.h.name))
+    return -ENAMETOOLONG;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.h.prefix, prefix, strlen(prefix));
+  memcpy(hdr.h.name, name, strlen(name));
+  format_number(hdr.h.mode, sizeof(hdr.h.mode), mode & 07777);
+  format_number(hdr.h.uid, sizeof(hdr.h.uid), 0);
+  format_number(hdr.h.gid, sizeof(hdr.h.gid), 0);
+  format_number(hdr.h.size, sizeof(hdr.h.size), size);
+  format_number(hdr.h.mtime, sizeof(hdr.h.mtime), mtime);
+  hdr.h.typeflag = typeflag;
+  memcpy(hdr.h.magic, "ustar", 6);
+  memcpy(hdr.h.version, "00", 2);
+  strcpy(hdr.h.uname, "root");
+  strcpy(hdr.h.gname, "root");
+
+  memset(hdr.h.chksum, ' ', sizeof(hdr.h.chksum));
+  for (size_t i = 0; i < TAR_BLOCKSIZE; ++i)
+    sum += hdr.block[i];
+  snprintf(hdr.h.chksum, sizeof(hdr.h.chksum), "%06o", sum);
+
+  return tar_write(tar, hdr.block, sizeof(hdr.block), Z_NO_FLUSH);
+}
+
+/* Add the file |name| of the package directory, read in chunks so that
+ * large local sources are never held uncompressed in memory. */
+static int tar_add_file(struct tar_writer_t *tar, int dirfd,
+    const char *pkgbase, const char *name) {
+  static const char zeroes[TAR_BLOCKSIZE];
+  _cleanup_close_ int fd = -1;
+  char buf[64 * 1024];
+  struct stat st;
+  uint64_t left;
+  int r;
+
+  fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+  if (fd < 0)
+    return -errno;
+
+  if (fstat(fd, &st) < 0)
+    return -errno;
+
+  if (!S_ISREG(st.st_mode))
+    return -EINVAL;
+
+  /* the pkgbase goes in the prefix, leaving the name field to the file */
+  r = tar_write_header(tar, pkgbase, name, '0', st.st_mode, st.st_size,
+      st.st_mtime);
+  if (r < 0)
+    return r;
+
+  for (left = st.st_size; left > 0;) {
+    ssize_t n = read(fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+    if (n <= 0)
+      return n < 0 ? -errno : -EIO;
+
+    r = tar_write(tar, buf, n, Z_NO_FLUSH);
+    if (r < 0)
+      return r;
+
+    left -= n;
+  }
+
+  if (st.st_mtime > tar->mtime)
+    tar->mtime = st.st_mtime;
+
+  return tar_write(tar, zeroes, padding(st.st_size), Z_NO_FLUSH);
+}
+
+int tarball_build(const char *dir, char **pkgbase_out, void **data,
+    size_t *len, time_t *mtime) {
+  static const char zeroes[2 * TAR_BLOCKSIZE];
+  _cleanup_tar_writer_ struct tar_writer_t tar = { .data = NULL };
+  _cleanup_free_ char *srcinfo = NULL, *dirname = NULL;
+  _cleanup_free_ const char **files = NULL;
+  _cleanup_close_ int dirfd = -1;
+  const char *pkgbase;
+  size_t file_count;
+  struct stat st;
+  int r;
+
+  dirfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (dirfd < 0)
+    return -errno;
+
+  if (fstat(dirfd, &st) < 0)
+    return -errno;
+
+  r = read_file_at(dirfd, ".SRCINFO", &srcinfo, NULL);
+  if (r < 0)
+    return r;
+
+  r = srcinfo_parse(srcinfo, &pkgbase, &files, &file_count);
+  if (r < 0)
+    return r;
+
+  r = tar_writer_open(&tar);
+  if (r < 0)
+    return r;
+
+  /* like makepkg's, the tarball starts with the pkgbase directory */
+  if (asprintf(&dirname, "%s/", pkgbase) < 0) {
+    dirname = NULL;
+    return -ENOMEM;
+  }
+
+  r = tar_write_header(&tar, "", dirname, '5', 0755, 0, st.st_mtime);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < file_count; ++i) {
+    r = tar_add_file(&tar, dirfd, pkgbase, files[i]);
+    if (r < 0)
+      return r;
+  }
+
+  r = tar_write(&tar, zeroes, sizeof(zeroes), Z_FINISH);
+  if (r < 0)
+    return r;
+
+  if (pkgbase_out) {
+    *pkgbase_out = strdup(pkgbase);
+    if (*pkgbase_out == NULL)
+      return -ENOMEM;
+  }
+
+  *data = tar.data;
+  *len = tar.len;
+  tar.data = NULL;
+  if (mtime)
+    *mtime = tar.mtime;
+
+  return 0;
+}
+
+/* vim: set et ts=2 sw=2: */
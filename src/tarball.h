@@ -0,0 +1,87 @@
+#ifndef _TARBALL_H
+#define _TARBALL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Determine the pkgbase of a (possibly gzip or xz compressed) source tarball
+ * from the directory its first entry lives in, reading it from the start of
+ * the seekable descriptor |fd|, which may hold only the beginning of it. Only
+ * the first header is decompressed. */
+int tarball_read_pkgbase_fd(int fd, char **pkgbase);
+
+/* A regular file of a source tarball. |name| is its path minus the leading
+ * pkgbase directory, and |mode| its permission bits. */
+struct tarball_file_t {
+  const char *name;
+  mode_t mode;
+  const char *data;
+  size_t len;
+};
+
+/* Called for every file by tarball_read_files. The file is only valid during
+ * the call. A negative return stops the iteration and is returned. */
+typedef int (*tarball_file_fn)(void *userdata,
+    const struct tarball_file_t *file);
+
+/* Read every regular file of a source tarball, in archive order. If |path|
+ * is a package directory, the files a tarball built from it would hold are
+ * read instead. */
+int tarball_read_files(const char *path, tarball_file_fn callback,
+    void *userdata);
+int tarball_read_files_fd(int fd, tarball_file_fn callback, void *userdata);
+
+/* The file name suffix which fits the compression of the tarball in |fd|. */
+const char *tarball_suffix_fd(int fd);
+
+/* Whether a file called |name| is taken for a source tarball when looking
+ * through a directory: it must end in one of the suffixes above, and hidden
+ * files, such as the temporaries of tools writing in place, never are. */
+bool tarball_name_is_source(const char *name);
+
+/* What the .SRCINFO of a source tarball says about its pkgbase. |version|
+ * is the full "[epoch:]pkgver-pkgrel"; |epoch| may be NULL. */
+struct tarball_info_t {
+  char *pkgbase;
+  char *pkgver;
+  char *pkgrel;
+  char *epoch;
+  char *version;
+};
+
+void tarball_info_free(struct tarball_info_t *info);
+
+/* Everything looked up in the front of a source tarball, read in a single
+ * pass: the directory its first entry lives in, its .SRCINFO and its
+ * PKGBUILD, each NULL if missing. Decompression stops once both files have
+ * been read, which makepkg puts near the front. For a package directory,
+ * only the files are read. Whatever was found before a failure is kept, and
+ * |head| must be freed either way. */
+struct tarball_head_t {
+  char *dirname;
+  char *srcinfo;
+  size_t srcinfo_len;
+  char *pkgbuild;
+};
+
+int tarball_read_head(const char *path, struct tarball_head_t *head);
+/* Like the above, from the start of |fd| as for tarball_read_pkgbase_fd. */
+int tarball_read_head_fd(int fd, struct tarball_head_t *head);
+void tarball_head_free(struct tarball_head_t *head);
+
+/* Parse the .SRCINFO of |head|, or return -ENOENT if it has none. */
+int tarball_head_info(const struct tarball_head_t *head,
+    struct tarball_info_t *info);
+
+/* Build the source tarball makepkg --source would make from the package
+ * directory |dir|, in memory. The .SRCINFO must be up to date, as it names
+ * the install scripts, changelogs and local sources which go in alongside
+ * it and the PKGBUILD. |mtime| is set to that of the newest file packed. */
+int tarball_build(const char *dir, char **pkgbase, void **data, size_t *len,
+    time_t *mtime);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _TARBALL_H */
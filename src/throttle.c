@@ -0,0 +1,190 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "log.h"
+#include "throttle.h"
+#include "util.h"
+
+/* weight of a new sample in the latency average */
+#define LATENCY_ALPHA 0.2
+/* back off once the average exceeds the best latency seen by this much */
+#define LATENCY_TOLERANCE 3.0
+/* latencies below this are jitter, not a sign of how busy the server is */
+#define LATENCY_FLOOR 0.01
+/* pause used for a 429 or 503 without Retry-After */
+#define DEFAULT_BACKOFF 1.0
+
+struct throttle_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  double limit;
+  unsigned max_inflight;
+  unsigned inflight;
+
+  double tokens;
+  double last_refill;
+  double pause_until;
+
+  double latency_min;
+  double latency_avg;
+  double last_decrease;
+};
+
+static struct timespec to_timespec(double t) {
+  struct timespec ts;
+
+  ts.tv_sec = (time_t)t;
+  ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+
+  return ts;
+}
+
+int throttle_new(throttle_t **ret, unsigned max_inflight) {
+  throttle_t *throttle;
+  pthread_condattr_t attr;
+
+  throttle = calloc(1, sizeof(*throttle));
+  if (throttle == NULL)
+    return -ENOMEM;
+
+  pthread_mutex_init(&throttle->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&throttle->cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  throttle->limit = 1;
+  throttle->max_inflight = max_inflight ? max_inflight : 1;
+  throttle->tokens = 1;
+  throttle->last_refill = now_monotonic();
+
+  *ret = throttle;
+
+  return 0;
+}
+
+void throttle_free(throttle_t *throttle) {
+  if (throttle == NULL)
+    return;
+
+  pthread_cond_destroy(&throttle->cond);
+  pthread_mutex_destroy(&throttle->lock);
+  free(throttle);
+}
+
+/* Tokens accrue at the rate the current window completes requests. Until a
+ * latency has been observed, the window alone limits us. */
+static double refill(throttle_t *throttle, double now) {
+  double burst = ceil(throttle->limit), rate;
+
+  if (throttle->latency_avg <= 0) {
+    throttle->tokens = burst;
+    rate = INFINITY;
+  } else {
+    rate = throttle->limit / throttle->latency_avg;
+    throttle->tokens += (now - throttle->last_refill) * rate;
+    if (throttle->tokens > burst)
+      throttle->tokens = burst;
+  }
+  throttle->last_refill = now;
+
+  return rate;
+}
+
+void throttle_acquire(throttle_t *throttle) {
+  pthread_mutex_lock(&throttle->lock);
+
+  for (;;) {
+    double now = now_monotonic(), rate;
+    struct timespec deadline;
+
+    if (now < throttle->pause_until) {
+      throttle->last_refill = throttle->pause_until;
+      deadline = to_timespec(throttle->pause_until);
+      pthread_cond_timedwait(&throttle->cond, &throttle->lock, &deadline);
+      continue;
+    }
+
+    rate = refill(throttle, now);
+
+    if (throttle->inflight >= (unsigned)throttle->limit) {
+      pthread_cond_wait(&throttle->cond, &throttle->lock);
+      continue;
+    }
+
+    if (throttle->tokens >= 1)
+      break;
+
+    deadline = to_timespec(now + (1 - throttle->tokens) / rate);
+    pthread_cond_timedwait(&throttle->cond, &throttle->lock, &deadline);
+  }
+
+  throttle->tokens -= 1;
+  ++throttle->inflight;
+
+  pthread_mutex_unlock(&throttle->lock);
+}
+
+static void decrease(throttle_t *throttle, double now, double factor) {
+  /* at most once per round trip, as every request in flight saw the same
+   * conditions */
+  if (now - throttle->last_decrease < throttle->latency_avg)
+    return;
+
+  throttle->limit *= factor;
+  if (throttle->limit < 1)
+    throttle->limit = 1;
+  throttle->last_decrease = now;
+
+  log_debug("throttle: window decreased to %.2f", throttle->limit);
+}
+
+void throttle_release(throttle_t *throttle, double latency, bool throttled,
+    double retry_after) {
+  double now = now_monotonic();
+
+  pthread_mutex_lock(&throttle->lock);
+
+  --throttle->inflight;
+
+  if (throttled) {
+    double pause = retry_after > 0 ? retry_after : DEFAULT_BACKOFF;
+
+    decrease(throttle, now, 0.5);
+    throttle->tokens = 0;
+    if (now + pause > throttle->pause_until)
+      throttle->pause_until = now + pause;
+
+    log_debug("throttle: server asked us to slow down, pausing for %.1fs",
+        pause);
+  } else {
+    if (latency < LATENCY_FLOOR)
+      latency = LATENCY_FLOOR;
+
+    if (throttle->latency_min <= 0 || latency < throttle->latency_min)
+      throttle->latency_min = latency;
+
+    if (throttle->latency_avg <= 0)
+      throttle->latency_avg = latency;
+    else
+      throttle->latency_avg += LATENCY_ALPHA *
+          (latency - throttle->latency_avg);
+
+    if (throttle->latency_avg > LATENCY_TOLERANCE * throttle->latency_min)
+      decrease(throttle, now, 0.75);
+    else if (throttle->limit < throttle->max_inflight) {
+      throttle->limit += 1 / throttle->limit;
+      if (throttle->limit > throttle->max_inflight)
+        throttle->limit = throttle->max_inflight;
+    }
+  }
+
+  pthread_cond_broadcast(&throttle->cond);
+  pthread_mutex_unlock(&throttle->lock);
+}
+
+/* vim: set et ts=2 sw=2: */
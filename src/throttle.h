@@ -0,0 +1,27 @@
+#ifndef _THROTTLE_H
+#define _THROTTLE_H
+
+#include <stdbool.h>
+
+/* An AIMD controller sizing the number of in-flight requests to one server.
+ * The window grows additively while responses stay fast, and shrinks
+ * multiplicatively when latency climbs or the server throttles us with a
+ * 429 or 503. Request starts are additionally paced by a token bucket shared
+ * by all workers, which is drained and paused on Retry-After. */
+typedef struct throttle_t throttle_t;
+
+int throttle_new(throttle_t **ret, unsigned max_inflight);
+void throttle_free(throttle_t *throttle);
+
+/* Blocks until another request may be started. */
+void throttle_acquire(throttle_t *throttle);
+
+/* Report the outcome of a request started with throttle_acquire, and the
+ * |latency| of the server's answer, which should not depend on how much was
+ * sent. A |retry_after| of zero means the server didn't ask for a delay. */
+void throttle_release(throttle_t *throttle, double latency, bool throttled,
+    double retry_after);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _THROTTLE_H */
@@ -0,0 +1,132 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_fp;
+static bool trace_first;
+static pid_t trace_pid;
+
+static __thread pid_t trace_tid;
+
+double trace_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static pid_t current_tid(void) {
+  if (trace_tid == 0)
+    trace_tid = syscall(SYS_gettid);
+
+  return trace_tid;
+}
+
+static void write_string(const char *str) {
+  fputc('"', trace_fp);
+
+  for (const unsigned char *p = (const unsigned char *)str; *p; ++p) {
+    if (*p == '"' || *p == '\\')
+      fprintf(trace_fp, "\\%c", *p);
+    else if (*p < 0x20)
+      fprintf(trace_fp, "\\u%04x", *p);
+    else
+      fputc(*p, trace_fp);
+  }
+
+  fputc('"', trace_fp);
+}
+
+/* Called with the lock held. */
+static void write_event(char phase, const char *name, const char *detail,
+    double ts, double dur) {
+  fputs(trace_first ? "\n" : ",\n", trace_fp);
+  trace_first = false;
+
+  fputs("{\"name\":", trace_fp);
+  write_string(name);
+  fprintf(trace_fp, ",\"cat\":\"burp\",\"ph\":\"%c\",\"ts\":%.3f", phase, ts);
+  if (phase == 'X')
+    fprintf(trace_fp, ",\"dur\":%.3f", dur);
+  fprintf(trace_fp, ",\"pid\":%d,\"tid\":%d", (int)trace_pid,
+      (int)current_tid());
+  if (detail) {
+    fputs(",\"args\":{\"detail\":", trace_fp);
+    write_string(detail);
+    fputc('}', trace_fp);
+  }
+  fputc('}', trace_fp);
+}
+
+int trace_open(const char *path) {
+  FILE *fp;
+
+  fp = fopen(path, "we");
+  if (fp == NULL)
+    return -errno;
+
+  pthread_mutex_lock(&trace_lock);
+  trace_fp = fp;
+  trace_first = true;
+  trace_pid = getpid();
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", trace_fp);
+  pthread_mutex_unlock(&trace_lock);
+
+  return 0;
+}
+
+void trace_close(void) {
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fp) {
+    fputs("\n]}\n", trace_fp);
+    fclose(trace_fp);
+    trace_fp = NULL;
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_complete(const char *name, const char *detail, double start,
+    double end) {
+  if (trace_fp == NULL)
+    return;
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fp)
+    write_event('X', name, detail, start, end - start);
+  pthread_mutex_unlock(&trace_lock);
+}
+
+struct trace_span_t trace_span_begin(const char *name, const char *detail) {
+  struct trace_span_t span = { NULL };
+
+  if (trace_fp == NULL)
+    return span;
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fp) {
+    write_event('B', name, detail, trace_now(), 0);
+    span.name = name;
+  }
+  pthread_mutex_unlock(&trace_lock);
+
+  return span;
+}
+
+void trace_span_end(struct trace_span_t *span) {
+  if (span->name == NULL)
+    return;
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fp)
+    write_event('E', span->name, NULL, trace_now(), 0);
+  pthread_mutex_unlock(&trace_lock);
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,37 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+
+#include "util.h"
+
+/* Spans of work recorded in the Chrome trace event format, which trace
+ * viewers such as Perfetto open directly. Recording is process-wide and off
+ * unless trace_open has been called, in which case a span costs nothing but
+ * a check of a pointer. */
+
+struct trace_span_t {
+  const char *name;
+};
+
+int trace_open(const char *path);
+void trace_close(void);
+
+/* Microseconds on the monotonic clock trace timestamps are taken from. */
+double trace_now(void);
+
+/* Record a span which ended already, e.g. one that predates trace_open. */
+void trace_complete(const char *name, const char *detail, double start,
+    double end);
+
+struct trace_span_t trace_span_begin(const char *name, const char *detail);
+void trace_span_end(struct trace_span_t *span);
+
+/* Declares a span which ends when |var| goes out of scope. */
+#define trace_span(var, name, detail) \
+  _cleanup_(trace_span_end) struct trace_span_t var = \
+      trace_span_begin((name), (detail))
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _TRACE_H */
@@ -0,0 +1,69 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transport.h"
+
+const char *transport_form_filename(const struct curl_httppost *part) {
+  const char *slash;
+
+  if (part->showfilename)
+    return part->showfilename;
+  if (part->flags & CURL_HTTPPOST_BUFFER)
+    return part->buffer;
+  if ((part->flags & CURL_HTTPPOST_FILENAME) && part->contents) {
+    slash = strrchr(part->contents, '/');
+    return slash ? slash + 1 : part->contents;
+  }
+
+  return NULL;
+}
+
+int transport_perform(transport_t *transport, CURL *curl,
+    struct transport_exchange_t *exchange) {
+  exchange->status = 0;
+  exchange->redirect_url = NULL;
+
+  return transport->perform(transport, curl, exchange);
+}
+
+void transport_free(transport_t *transport) {
+  if (transport && transport->free)
+    transport->free(transport);
+}
+
+static int curl_perform(transport_t *transport, CURL *curl,
+    struct transport_exchange_t *exchange) {
+  char *redirect_url = NULL;
+
+  (void)transport;
+
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, exchange->header_cb);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, exchange->header_data);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, exchange->body_cb);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, exchange->body_data);
+
+  if (curl_easy_perform(curl) != CURLE_OK)
+    return -EIO;
+
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &exchange->status);
+  curl_easy_getinfo(curl, CURLINFO_REDIRECT_URL, &redirect_url);
+  if (redirect_url) {
+    exchange->redirect_url = strdup(redirect_url);
+    if (exchange->redirect_url == NULL)
+      return -ENOMEM;
+  }
+
+  return 0;
+}
+
+transport_t *transport_curl(void) {
+  static transport_t curl_transport = {
+    .name = "curl",
+    .perform = curl_perform,
+  };
+
+  return &curl_transport;
+}
+
+/* vim: set et ts=2 sw=2: */
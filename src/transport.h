@@ -0,0 +1,81 @@
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#include <stdbool.h>
+
+#include <curl/curl.h>
+
+/* A single HTTP exchange. The caller prepares the request on a curl easy
+ * handle and describes it here; the transport performs it and delivers the
+ * response headers and body through the callbacks, the same way libcurl
+ * does. Cookies set by the response end up in the handle's cookie engine. */
+struct transport_exchange_t {
+  const char *method;
+  const char *url;
+  const char *path;
+  struct curl_httppost *form;
+
+  curl_write_callback header_cb;
+  void *header_data;
+  curl_write_callback body_cb;
+  void *body_data;
+  /* what parts of |form| added with CURLFORM_STREAM are read through, each
+   * with its userp */
+  curl_read_callback read_cb;
+
+  /* filled in by the transport; redirect_url is owned by the caller */
+  long status;
+  char *redirect_url;
+};
+
+/* libcurl before 7.46 spells these without the prefix */
+#ifndef CURL_HTTPPOST_FILENAME
+#define CURL_HTTPPOST_FILENAME HTTPPOST_FILENAME
+#define CURL_HTTPPOST_BUFFER HTTPPOST_BUFFER
+#define CURL_HTTPPOST_CALLBACK HTTPPOST_CALLBACK
+#endif
+
+/* Backends embed this as their first member. Transports may be shared by
+ * clients on different threads. */
+typedef struct transport_t transport_t;
+struct transport_t {
+  const char *name;
+  int (*perform)(transport_t *transport, CURL *curl,
+      struct transport_exchange_t *exchange);
+  void (*free)(transport_t *transport);
+};
+
+/* Returns 0 once a response has been received, whatever its status, or a
+ * negative errno if none was. */
+int transport_perform(transport_t *transport, CURL *curl,
+    struct transport_exchange_t *exchange);
+void transport_free(transport_t *transport);
+
+/* The name a part of a form is sent under if it is a file, or NULL. */
+const char *transport_form_filename(const struct curl_httppost *part);
+
+/* The default backend, which talks to the network through libcurl. It has
+ * no state and must not be freed. */
+transport_t *transport_curl(void);
+
+/* An in-process AUR which never touches the network. Logins succeed for any
+ * password but "wrong", uploads are read in full and, unless empty, redirect
+ * to the package's page, info queries find nothing, and logouts expire the
+ * session cookie. Responses queued with loopback_script are served first, in
+ * order, to requests for their path, whose body is then left unread. */
+int loopback_new(transport_t **ret);
+int loopback_script(transport_t *transport, const char *path, long status,
+    const char *headers, const char *body);
+
+/* Pass requests on to |inner| and store each exchange, minus passwords, in a
+ * file of its own under |dir|. The directory is created if needed. */
+int record_new(transport_t **ret, transport_t *inner, const char *dir);
+
+/* Serve the exchanges stored under |dir| by a recording transport. Each
+ * request gets the first unused response recorded for its path. With
+ * |realtime|, responses take as long as they originally did. */
+int replay_new(transport_t **ret, const char *dir, bool realtime);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _TRANSPORT_H */
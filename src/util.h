@@ -3,8 +3,11 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #define _cleanup_(x) __attribute__((cleanup(x)))
 #define ARRAYSIZE(x) (sizeof(x)/sizeof(x[0]))
@@ -19,6 +22,26 @@ static inline void freep(void *p) { free(*(void **)p); }
 static inline void fclosep(FILE **f) { if (*f) fclose(*f); }
 #define _cleanup_fclose_ _cleanup_(fclosep)
 
+static inline void closep(int *fd) { if (*fd >= 0) close(*fd); }
+#define _cleanup_close_ _cleanup_(closep)
+
+/* The monotonic clock, in seconds and in microseconds. */
+static inline double now_monotonic(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
 #endif /* _BURP_UTIL_H */
 
 /* vim: set et sw=2: */
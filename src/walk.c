@@ -0,0 +1,185 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "tarball.h"
+#include "util.h"
+#include "walk.h"
+
+/* what one getdents64 call fills, enough for a few hundred entries */
+#define DENTS_BUFSIZE (32 * 1024)
+
+struct walk_t {
+  walk_fn callback;
+  void *userdata;
+
+  /* the path of the directory being read, with room to append to it */
+  char *path;
+  size_t len;
+  size_t alloc;
+};
+
+/* Append "/|name|" to the path, for as long as an entry is handled. */
+static int path_push(struct walk_t *walk, const char *name) {
+  size_t name_len = strlen(name);
+
+  if (walk->len + name_len + 2 > walk->alloc) {
+    size_t alloc = (walk->len + name_len + 2) * 2;
+    char *path = realloc(walk->path, alloc);
+    if (path == NULL)
+      return -ENOMEM;
+    walk->path = path;
+    walk->alloc = alloc;
+  }
+
+  walk->path[walk->len] = '/';
+  memcpy(walk->path + walk->len + 1, name, name_len + 1);
+
+  return 0;
+}
+
+static void path_pop(struct walk_t *walk) {
+  walk->path[walk->len] = '\0';
+}
+
+static int walk_dir(struct walk_t *walk, int dirfd);
+
+static int walk_entry(struct walk_t *walk, int dirfd,
+    const struct dirent64 *entry) {
+  unsigned char type = entry->d_type;
+  size_t saved_len;
+  struct stat st;
+  int fd, r;
+
+  /* ".", ".." and hidden entries */
+  if (entry->d_name[0] == '.')
+    return 0;
+
+  if (type != DT_DIR && type != DT_UNKNOWN &&
+      !tarball_name_is_source(entry->d_name))
+    return 0;
+
+  if (type == DT_UNKNOWN) {
+    if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+      return 0;
+    type = IFTODT(st.st_mode);
+  }
+
+  /* uploads follow symlinks, and so does the check that they lead to a
+   * regular file; the walk itself doesn't */
+  if (type == DT_LNK) {
+    if (fstatat(dirfd, entry->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+      return 0;
+    type = DT_REG;
+  }
+
+  if (type == DT_REG) {
+    if (!tarball_name_is_source(entry->d_name))
+      return 0;
+
+    r = path_push(walk, entry->d_name);
+    if (r < 0)
+      return r;
+    r = walk->callback(walk->userdata, walk->path);
+    path_pop(walk);
+
+    return r;
+  }
+
+  if (type != DT_DIR)
+    return 0;
+
+  r = path_push(walk, entry->d_name);
+  if (r < 0)
+    return r;
+
+  fd = openat(dirfd, entry->d_name,
+      O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+  if (fd < 0) {
+    log_warn("skipping %s: %s", walk->path, strerror(errno));
+    path_pop(walk);
+    return 0;
+  }
+
+  saved_len = walk->len;
+  walk->len += strlen(entry->d_name) + 1;
+  r = walk_dir(walk, fd);
+  walk->len = saved_len;
+  path_pop(walk);
+  close(fd);
+
+  return r;
+}
+
+/* Read |dirfd| a batch of entries at a time. Subdirectories are walked in
+ * the middle of a batch, so every level needs a buffer of its own. */
+static int walk_dir(struct walk_t *walk, int dirfd) {
+  _cleanup_free_ char *buf = NULL;
+  int r;
+
+  buf = malloc(DENTS_BUFSIZE);
+  if (buf == NULL)
+    return -ENOMEM;
+
+  for (;;) {
+    ssize_t n = getdents64(dirfd, buf, DENTS_BUFSIZE);
+    if (n < 0) {
+      log_warn("failed to read %s: %s", walk->path, strerror(errno));
+      return 0;
+    }
+    if (n == 0)
+      return 0;
+
+    for (ssize_t off = 0; off < n;) {
+      const struct dirent64 *entry =
+          (const struct dirent64 *)(buf + off);
+      r = walk_entry(walk, dirfd, entry);
+      if (r < 0)
+        return r;
+
+      off += entry->d_reclen;
+    }
+
+    r = walk->callback(walk->userdata, NULL);
+    if (r < 0)
+      return r;
+  }
+}
+
+int walk_tree(const char *dir, walk_fn callback, void *userdata) {
+  struct walk_t walk = { callback, userdata, NULL, 0, 0 };
+  int fd, r;
+
+  /* "dir/" would otherwise make for paths like "dir//foo.src.tar.gz" */
+  walk.len = strlen(dir);
+  while (walk.len > 0 && dir[walk.len - 1] == '/')
+    --walk.len;
+
+  walk.alloc = walk.len + 256;
+  walk.path = malloc(walk.alloc);
+  if (walk.path == NULL)
+    return -ENOMEM;
+  memcpy(walk.path, dir, walk.len);
+  walk.path[walk.len] = '\0';
+
+  fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (fd < 0) {
+    free(walk.path);
+    return -errno;
+  }
+
+  r = walk_dir(&walk, fd);
+
+  close(fd);
+  free(walk.path);
+
+  return r;
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,22 @@
+#ifndef _WALK_H
+#define _WALK_H
+
+/* Called for every source tarball found by walk_tree, with its path, and
+ * with NULL after every batch of directory entries read, so that time
+ * passing in a long walk without matches can be acted on. A negative return
+ * stops the walk and is returned. */
+typedef int (*walk_fn)(void *userdata, const char *path);
+
+/* Look for source tarballs in the tree below |dir|: regular files, or
+ * symlinks to them, which tarball_name_is_source accepts. Directories are
+ * read in large batches with getdents64, and only entries whose type the
+ * file system doesn't report, or symlinks, are stat'ed, relative to the
+ * descriptor of their directory. Each tarball is passed to |callback| as
+ * soon as it is found. Hidden directories and symlinks to directories are
+ * not descended into. A subdirectory which can't be read is skipped with a
+ * warning; |dir| itself not being readable is an error. */
+int walk_tree(const char *dir, walk_fn callback, void *userdata);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _WALK_H */
@@ -0,0 +1,254 @@
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "tarball.h"
+#include "util.h"
+#include "watch.h"
+
+/* how long a tarball must be left alone before it is handed out */
+#define SETTLE_SECONDS 1.0
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE|IN_MOVED_TO|IN_MODIFY|IN_DELETE| \
+    IN_MOVED_FROM|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR|IN_EXCL_UNLINK)
+
+/* A tarball which has been written, and when it counts as complete. */
+struct pending_t {
+  char *name;
+  double deadline;
+};
+
+struct watch_t {
+  char *dir;
+  int fd;
+
+  struct pending_t *pending;
+  size_t len;
+  size_t alloc;
+};
+
+void watch_free(watch_t *watch) {
+  if (watch == NULL)
+    return;
+
+  for (size_t i = 0; i < watch->len; ++i)
+    free(watch->pending[i].name);
+  free(watch->pending);
+  if (watch->fd >= 0)
+    close(watch->fd);
+  free(watch->dir);
+  free(watch);
+}
+
+static ssize_t pending_find(const watch_t *watch, const char *name) {
+  for (size_t i = 0; i < watch->len; ++i)
+    if (streq(watch->pending[i].name, name))
+      return i;
+
+  return -1;
+}
+
+static void pending_remove(watch_t *watch, size_t i) {
+  free(watch->pending[i].name);
+  watch->pending[i] = watch->pending[--watch->len];
+}
+
+/* Start, or restart, the wait for |name| to settle. */
+static int pending_add(watch_t *watch, const char *name) {
+  ssize_t i = pending_find(watch, name);
+
+  if (i < 0) {
+    if (watch->len == watch->alloc) {
+      size_t alloc = watch->alloc ? watch->alloc * 2 : 8;
+      struct pending_t *pending = realloc(watch->pending,
+          alloc * sizeof(*pending));
+      if (pending == NULL)
+        return -ENOMEM;
+      watch->pending = pending;
+      watch->alloc = alloc;
+    }
+
+    i = watch->len;
+    watch->pending[i].name = strdup(name);
+    if (watch->pending[i].name == NULL)
+      return -ENOMEM;
+    ++watch->len;
+  }
+
+  watch->pending[i].deadline = now_monotonic() + SETTLE_SECONDS;
+
+  return 0;
+}
+
+/* The tarballs already in the directory wait to settle like new ones, so
+ * that one still being written is handed out once it is complete. The
+ * inotify watch is in place first, so that nothing slips in between. */
+static int scan_dir(watch_t *watch) {
+  DIR *dir;
+  struct dirent *entry;
+  int r = 0;
+
+  dir = opendir(watch->dir);
+  if (dir == NULL)
+    return -errno;
+
+  while (r == 0 && (entry = readdir(dir)) != NULL) {
+    struct stat st;
+
+    if (!tarball_name_is_source(entry->d_name))
+      continue;
+
+    if (fstatat(dirfd(dir), entry->d_name, &st, 0) < 0 ||
+        !S_ISREG(st.st_mode))
+      continue;
+
+    log_debug("%s/%s was there already", watch->dir, entry->d_name);
+    r = pending_add(watch, entry->d_name);
+  }
+
+  closedir(dir);
+
+  return r;
+}
+
+int watch_new(watch_t **ret, const char *dir) {
+  watch_t *watch;
+  int r;
+
+  watch = calloc(1, sizeof(*watch));
+  if (watch == NULL)
+    return -ENOMEM;
+
+  watch->dir = strdup(dir);
+  if (watch->dir == NULL) {
+    free(watch);
+    return -ENOMEM;
+  }
+
+  watch->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (watch->fd < 0 || inotify_add_watch(watch->fd, dir, WATCH_EVENTS) < 0) {
+    r = -errno;
+    watch_free(watch);
+    return r;
+  }
+
+  r = scan_dir(watch);
+  if (r < 0) {
+    watch_free(watch);
+    return r;
+  }
+
+  *ret = watch;
+
+  return 0;
+}
+
+static int handle_event(watch_t *watch, const struct inotify_event *event) {
+  ssize_t i;
+
+  if (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED))
+    return -ENOENT;
+
+  if (event->mask & IN_Q_OVERFLOW) {
+    log_warn("too many changes in %s at once, some tarballs may be missed",
+        watch->dir);
+    return 0;
+  }
+
+  if (event->len == 0 || (event->mask & IN_ISDIR) ||
+      !tarball_name_is_source(event->name))
+    return 0;
+
+  if (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)) {
+    log_debug("%s/%s was written", watch->dir, event->name);
+    return pending_add(watch, event->name);
+  }
+
+  /* written to again, or gone: it's only complete once closed anew */
+  i = pending_find(watch, event->name);
+  if (i >= 0)
+    pending_remove(watch, i);
+
+  return 0;
+}
+
+static int read_events(watch_t *watch) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  for (;;) {
+    ssize_t n = read(watch->fd, buf, sizeof(buf));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN ? 0 : -errno;
+    }
+
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+      int r = handle_event(watch, event);
+      if (r < 0)
+        return r;
+
+      p += sizeof(*event) + event->len;
+    }
+  }
+}
+
+int watch_next(watch_t *watch, int cancel, char **path) {
+  for (;;) {
+    struct pollfd fds[] = {
+      { .fd = watch->fd, .events = POLLIN },
+      { .fd = cancel, .events = POLLIN },
+    };
+    double now = now_monotonic(), first = 0;
+    ssize_t next = -1;
+    int r, timeout = -1;
+
+    for (size_t i = 0; i < watch->len; ++i)
+      if (next < 0 || watch->pending[i].deadline < first) {
+        next = i;
+        first = watch->pending[i].deadline;
+      }
+
+    if (next >= 0 && first <= now) {
+      r = asprintf(path, "%s/%s", watch->dir, watch->pending[next].name);
+      pending_remove(watch, next);
+      if (r < 0) {
+        *path = NULL;
+        return -ENOMEM;
+      }
+
+      return 1;
+    }
+
+    /* round up, so that the deadline has passed on waking */
+    if (next >= 0)
+      timeout = (int)((first - now) * 1000) + 1;
+
+    r = poll(fds, ARRAYSIZE(fds), timeout);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+
+    if (fds[1].revents)
+      return 0;
+
+    if (fds[0].revents) {
+      r = read_events(watch);
+      if (r < 0)
+        return r;
+    }
+  }
+}
+
+/* vim: set et ts=2 sw=2: */
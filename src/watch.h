@@ -0,0 +1,22 @@
+#ifndef _WATCH_H
+#define _WATCH_H
+
+/* Watches a directory with inotify for source tarballs dropped into it. A
+ * tarball is handed out once it has been closed after writing, or moved in,
+ * and then left alone for a moment, so that a file written in several goes
+ * is only picked up when it is complete. The tarballs already in the
+ * directory are handed out the same way. Only files which
+ * tarball_name_is_source accepts count. */
+typedef struct watch_t watch_t;
+
+int watch_new(watch_t **ret, const char *dir);
+void watch_free(watch_t *watch);
+
+/* Blocks until another tarball has settled, and stores its path in |path|,
+ * to be freed by the caller. Returns 1 for a tarball, 0 as soon as |cancel|
+ * becomes readable, and -ENOENT if the directory went away. */
+int watch_next(watch_t *watch, int cancel, char **path);
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _WATCH_H */
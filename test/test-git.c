@@ -0,0 +1,155 @@
+/* Pushes package directories to local bare repositories standing in for the
+ * AUR's, and checks what git ends up with. */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "git.h"
+#include "test.h"
+#include "util.h"
+
+static char base[] = "/tmp/burp-test-git-XXXXXX";
+
+static int write_file(const char *dir, const char *name, const char *data) {
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ char *path = NULL;
+
+  if (asprintf(&path, "%s/%s", dir, name) < 0)
+    return -ENOMEM;
+
+  fp = fopen(path, "we");
+  if (fp == NULL)
+    return -errno;
+
+  fputs(data, fp);
+
+  return ferror(fp) ? -EIO : 0;
+}
+
+/* The first line a shell command printed, or NULL if it failed. */
+static char *command_output(const char *format, ...) {
+  _cleanup_free_ char *command = NULL;
+  char *line = NULL;
+  size_t alloc = 0;
+  va_list ap;
+  FILE *fp;
+  int r;
+
+  va_start(ap, format);
+  r = vasprintf(&command, format, ap);
+  va_end(ap);
+  if (r < 0)
+    return NULL;
+
+  fp = popen(command, "r");
+  if (fp == NULL)
+    return NULL;
+
+  if (getline(&line, &alloc, fp) > 0)
+    line[strcspn(line, "\n")] = '\0';
+  if (pclose(fp) != 0) {
+    free(line);
+    return NULL;
+  }
+
+  return line;
+}
+
+static int make_package(const char *dir, const char *pkgver) {
+  _cleanup_free_ char *pkgbuild = NULL, *srcinfo = NULL;
+  int r;
+
+  if (asprintf(&pkgbuild, "pkgname=gitpkg\npkgver=%s\npkgrel=1\n",
+        pkgver) < 0)
+    return -ENOMEM;
+  if (asprintf(&srcinfo, "pkgbase = gitpkg\n\tpkgver = %s\n\tpkgrel = 1\n\n"
+        "pkgname = gitpkg\n", pkgver) < 0)
+    return -ENOMEM;
+
+  r = write_file(dir, "PKGBUILD", pkgbuild);
+  if (r == 0)
+    r = write_file(dir, ".SRCINFO", srcinfo);
+
+  return r;
+}
+
+static void test_push(git_t *git, const char *pkgdir) {
+  _cleanup_free_ char *subject = NULL, *count = NULL, *pkgbuild = NULL;
+  char *error = NULL;
+
+  check(make_package(pkgdir, "1") == 0);
+  check(git_push(git, "gitpkg", "1-1", pkgdir, -1, &error) == 0);
+  check(error == NULL);
+
+  subject = command_output("git --git-dir=%s/gitpkg.git log -1 --format=%%s "
+      "master", base);
+  check(subject && streq(subject, "Update to 1-1"));
+
+  /* the next push goes on top of the first */
+  check(make_package(pkgdir, "2") == 0);
+  check(git_push(git, "gitpkg", "2-1", pkgdir, -1, &error) == 0);
+
+  count = command_output("git --git-dir=%s/gitpkg.git rev-list --count "
+      "master", base);
+  check(count && streq(count, "2"));
+
+  pkgbuild = command_output("git --git-dir=%s/gitpkg.git show "
+      "master:PKGBUILD | grep pkgver", base);
+  check(pkgbuild && streq(pkgbuild, "pkgver=2"));
+}
+
+static void test_rejected(git_t *git, const char *pkgdir) {
+  char *error = NULL;
+
+  check(git_push(git, "../gitpkg", NULL, pkgdir, -1, &error) == -EINVAL);
+
+  /* there is no repository for this one */
+  check(git_push(git, "missing", NULL, pkgdir, -1, &error) == -EIO);
+  check(error && *error);
+  free(error);
+}
+
+int main(void) {
+  _cleanup_free_ char *url = NULL, *pkgdir = NULL, *command = NULL;
+  git_t *git = NULL;
+
+  if (mkdtemp(base) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+
+  /* no user configuration in the way, and an identity to commit as */
+  setenv("GIT_CONFIG_NOSYSTEM", "1", 1);
+  setenv("GIT_CONFIG_GLOBAL", "/dev/null", 1);
+  setenv("GIT_COMMITTER_NAME", "burp test", 1);
+  setenv("GIT_COMMITTER_EMAIL", "test@example.org", 1);
+
+  if (asprintf(&url, "%s/%%s.git", base) < 0 ||
+      asprintf(&pkgdir, "%s/gitpkg", base) < 0 ||
+      asprintf(&command, "git init -q --bare %s/gitpkg.git && mkdir %s",
+        base, pkgdir) < 0)
+    return EXIT_FAILURE;
+
+  check(system(command) == 0);
+  check(git_new(&git, url) == 0);
+
+  if (git) {
+    test_push(git, pkgdir);
+    test_rejected(git, pkgdir);
+    git_free(git);
+  }
+
+  free(command);
+  if (asprintf(&command, "rm -rf %s", base) < 0)
+    command = NULL;
+  else
+    check(system(command) == 0);
+
+  return test_result();
+}
+
+/* vim: set et ts=2 sw=2: */
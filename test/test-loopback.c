@@ -0,0 +1,148 @@
+/* Drives the AUR client against the loopback transport, with responses
+ * scripted through loopback_script where the built-in AUR won't do. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "aur.h"
+#include "test.h"
+#include "transport.h"
+
+static const char tarball[] = "not really a tarball, but it will do";
+
+struct chunks_t {
+  size_t offset;
+  size_t calls;
+};
+
+static ssize_t read_chunks(void *userdata, void *buf, size_t len) {
+  struct chunks_t *chunks = userdata;
+  size_t left = sizeof(tarball) - chunks->offset;
+
+  /* a few bytes at a time, as a pipe might */
+  if (len > 5)
+    len = 5;
+  if (len > left)
+    len = left;
+
+  memcpy(buf, tarball + chunks->offset, len);
+  chunks->offset += len;
+  ++chunks->calls;
+
+  return len;
+}
+
+static aur_t *client_new(transport_t *transport, const char *password) {
+  aur_t *aur = NULL;
+
+  if (aur_new(&aur, "aur.example.org", true) < 0)
+    return NULL;
+
+  aur_set_transport(aur, transport);
+  aur_set_username(aur, "tester");
+  aur_set_password(aur, password);
+
+  return aur;
+}
+
+static void test_login(transport_t *transport) {
+  char *error = NULL;
+  aur_t *aur;
+
+  aur = client_new(transport, "wrong");
+  check(aur_login(aur, &error) < 0);
+  check(error && strstr(error, "Bad username or password"));
+  free(error);
+  aur_free(aur);
+
+  error = NULL;
+  aur = client_new(transport, "secret");
+  check(aur_login(aur, &error) == 0);
+  check(aur_get_session(aur) != NULL);
+  free(error);
+  aur_free(aur);
+}
+
+static void test_upload(transport_t *transport) {
+  struct chunks_t chunks = { 0, 0 };
+  char *error = NULL;
+  aur_t *aur;
+
+  aur = client_new(transport, "secret");
+  check(aur_login(aur, &error) == 0);
+
+  check(aur_upload_buffer(aur, "foo.src.tar.gz", tarball, sizeof(tarball),
+        "None", &error) == 0);
+
+  /* the loopback reads a streamed tarball to its end */
+  check(aur_upload_stream(aur, "foo.src.tar.gz", read_chunks, &chunks,
+        "None", &error) == 0);
+  check(chunks.offset == sizeof(tarball));
+  check(chunks.calls > 1);
+
+  check(aur_upload_buffer(aur, "empty.src.tar.gz", "", 0, "None",
+        &error) < 0);
+  check(error && strstr(error, "empty"));
+  free(error);
+
+  aur_free(aur);
+}
+
+static void test_scripted(transport_t *transport) {
+  char *error = NULL;
+  aur_t *aur;
+
+  aur = client_new(transport, "secret");
+  check(aur_login(aur, &error) == 0);
+
+  /* throttled, with the delay the server asks for */
+  check(loopback_script(transport, "/submit", 503, "Retry-After: 7\n",
+        NULL) == 0);
+  check(aur_upload_buffer(aur, "foo.src.tar.gz", tarball, sizeof(tarball),
+        "None", &error) == -EAGAIN);
+  check(aur_get_retry_after(aur) == 7);
+
+  /* the script is used up, and the built-in AUR answers again */
+  check(aur_upload_buffer(aur, "foo.src.tar.gz", tarball, sizeof(tarball),
+        "None", &error) == 0);
+  check(aur_get_retry_after(aur) == 0);
+
+  /* an error page is passed on */
+  check(loopback_script(transport, "/submit", 200, NULL,
+        "<ul class=\"errorlist\"><li>You are not allowed to overwrite the "
+        "<b>foo</b> package.</li></ul>") == 0);
+  check(aur_upload_buffer(aur, "foo.src.tar.gz", tarball, sizeof(tarball),
+        "None", &error) < 0);
+  check(error && strstr(error, "not allowed to overwrite"));
+  free(error);
+  error = NULL;
+
+  /* a dropped session sends the upload to the login page */
+  check(loopback_script(transport, "/submit", 302,
+        "Location: /login\nSet-Cookie: AURSID=deleted; Max-Age=-1; Path=/\n",
+        NULL) == 0);
+  check(aur_upload_buffer(aur, "foo.src.tar.gz", tarball, sizeof(tarball),
+        "None", &error) == -EKEYEXPIRED);
+  free(error);
+
+  aur_free(aur);
+}
+
+int main(void) {
+  transport_t *transport;
+
+  if (loopback_new(&transport) < 0)
+    return EXIT_FAILURE;
+
+  test_login(transport);
+  test_upload(transport);
+  test_scripted(transport);
+
+  transport_free(transport);
+
+  return test_result();
+}
+
+/* vim: set et ts=2 sw=2: */
@@ -0,0 +1,25 @@
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Checks report where they failed and let the test go on; a test program
+ * exits with test_result() once it is done. */
+static int test_failures;
+
+#define check(expr) do { \
+    if (!(expr)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+          #expr); \
+      ++test_failures; \
+    } \
+  } while (0)
+
+static inline int test_result(void) {
+  return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set et ts=2 sw=2: */
+
+#endif  /* _TEST_H */